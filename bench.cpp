@@ -0,0 +1,880 @@
+// Reproducible benchmarks of TGC.
+//
+// Every case runs a fixed amount of work (seeded inputs, fixed sizes), is
+// repeated several times and reports the median. Results are printed as a
+// table and can be written as json for tracking regressions.
+//
+// usage: tgc_bench [--json <path>] [--filter <substr>] [--scale <factor>]
+//                  [--reps <count>]
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+#include <malloc.h>
+#define TGC_BENCH_MALLINFO
+#endif
+
+#include "tgc.h"
+
+using namespace tgc;
+using namespace std;
+
+namespace {
+
+struct Result {
+  string name;
+  size_t iterations;
+  double nsPerOp;
+  vector<pair<string, double>> counters;
+};
+
+vector<Result> results;
+string filter;
+double scale = 1;
+int reps = 5;
+
+size_t scaled(size_t n) {
+  return max<size_t>(1, (size_t)(n * scale));
+}
+
+uint64_t nowNs() {
+  return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+bool enabled(const string& name) {
+  return filter.empty() || name.find(filter) != string::npos;
+}
+
+void addResult(const string& name,
+               size_t iterations,
+               double ns,
+               vector<pair<string, double>> counters = {}) {
+  results.push_back({name, iterations, ns / iterations, move(counters)});
+  auto& r = results.back();
+  printf("%-32s %12zu %14.2f ns/op", r.name.c_str(), r.iterations, r.nsPerOp);
+  for (auto& c : r.counters)
+    printf("  %s=%.0f", c.first.c_str(), c.second);
+  printf("\n");
+}
+
+volatile int64_t sink;
+
+// Collects with the default step count until the cycle in progress is done.
+void finishCycle() {
+  auto cycles = gc_stats().cycles;
+  while (gc_stats().cycles == cycles)
+    gc_collect();
+}
+
+// setup is not timed, the median time of run over the repetitions is
+// reported.
+void bench(const string& name,
+           size_t iterations,
+           function<void()> setup,
+           function<void()> run,
+           function<void()> teardown = {}) {
+  if (!enabled(name))
+    return;
+  vector<uint64_t> times;
+  for (int i = 0; i < reps; i++) {
+    if (setup)
+      setup();
+    auto start = nowNs();
+    run();
+    times.push_back(nowNs() - start);
+    if (teardown)
+      teardown();
+  }
+  sort(times.begin(), times.end());
+  addResult(name, iterations, (double)times[times.size() / 2]);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Allocation
+
+struct Small {
+  int64_t v[4];
+};
+
+void benchAlloc() {
+  auto n = scaled(1000000);
+
+  bench("alloc/gc_new<int>", n, gc_collect_full, [=] {
+    for (size_t i = 0; i < n; i++)
+      gc_new<int>((int)i);
+  });
+
+  bench("alloc/gc_new<Small>", n, gc_collect_full, [=] {
+    for (size_t i = 0; i < n; i++)
+      gc_new<Small>();
+  });
+
+  auto arrays = n / 100;
+  bench("alloc/gc_new_array<int>(256)", arrays, gc_collect_full, [=] {
+    for (size_t i = 0; i < arrays; i++)
+      gc_new_array<int>(256);
+  });
+
+  // bulk loading keeps the objects, 1000 per batch.
+  bench("alloc/gc_new<Small>_kept", n, gc_collect_full, [=] {
+    vector<gc<Small>> objs;
+    for (size_t i = 0; i < n; i += 1000) {
+      objs.clear();
+      for (size_t j = 0; j < 1000; j++)
+        objs.push_back(gc_new<Small>());
+    }
+  });
+
+  bench("alloc/gc_new_batch<Small>_kept", n, gc_collect_full, [=] {
+    for (size_t i = 0; i < n; i += 1000)
+      gc_new_batch<Small>(1000);
+  });
+
+  vector<int*> raws;
+  bench(
+      "alloc/baseline_new_int", n, [&] { raws.reserve(n); },
+      [&] {
+        for (size_t i = 0; i < n; i++)
+          raws.push_back(new int((int)i));
+      },
+      [&] {
+        for (auto* p : raws)
+          delete p;
+        raws.clear();
+      });
+
+  vector<shared_ptr<int>> shareds;
+  bench(
+      "alloc/baseline_make_shared_int", n, [&] { shareds.reserve(n); },
+      [&] {
+        for (size_t i = 0; i < n; i++)
+          shareds.push_back(make_shared<int>((int)i));
+      },
+      [&] { shareds.clear(); });
+
+  gc_collect_full();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Pointer operations
+
+void benchPointers() {
+  auto n = scaled(5000000);
+  auto obj = gc_new<int>(1);
+
+  bench("ptr/copy_construct", n, nullptr, [&] {
+    for (size_t i = 0; i < n; i++) {
+      gc<int> p = obj;
+    }
+  });
+
+  gc<int> target;
+  bench("ptr/copy_assign", n, nullptr, [&] {
+    for (size_t i = 0; i < n; i++)
+      target = obj;
+  });
+
+  bench("ptr/move_construct", n, nullptr, [&] {
+    gc<int> a = obj;
+    for (size_t i = 0; i < n; i++) {
+      gc<int> b = std::move(a);
+      a = std::move(b);
+    }
+  });
+
+  bench("ptr/deref", n, nullptr, [&] {
+    int64_t sum = 0;
+    for (size_t i = 0; i < n; i++)
+      sum += *obj + (int64_t)i;
+    sink = sum;
+  });
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Containers
+
+void benchContainers() {
+  auto n = scaled(1000000);
+  auto obj = gc_new<int>(1);
+
+  gc_vector<int> vec;
+  bench(
+      "container/vector_push_back", n, [&] { vec = gc_new_vector<int>(); },
+      [&] {
+        for (size_t i = 0; i < n; i++)
+          vec->push_back(obj);
+      },
+      [&] { vec = nullptr; });
+
+  vec = gc_new_vector<int>();
+  for (size_t i = 0; i < n; i++)
+    vec->push_back(gc_new<int>((int)i));
+  bench("container/vector_iterate", n, nullptr, [&] {
+    int64_t sum = 0;
+    for (auto& i : *vec)
+      sum += *i;
+    sink = sum;
+  });
+  vec = nullptr;
+
+  auto keys = scaled(200000);
+  gc_map<int, int> map;
+  bench(
+      "container/map_insert", keys, [&] { map = gc_new_map<int, int>(); },
+      [&] {
+        for (size_t i = 0; i < keys; i++)
+          map[(int)i] = obj;
+      },
+      [&] { map = nullptr; });
+
+  gc_collect_full();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Marking & sweeping of canonical graph shapes
+
+struct TreeNode {
+  gc<TreeNode> left, right;
+};
+
+gc<TreeNode> makeTree(int depth) {
+  auto n = gc_new<TreeNode>();
+  if (depth > 0) {
+    n->left = makeTree(depth - 1);
+    n->right = makeTree(depth - 1);
+  }
+  return n;
+}
+
+struct ListNode {
+  gc<ListNode> next;
+  int64_t v = 0;
+};
+
+struct GraphNode {
+  gc<GraphNode> edges[4];
+};
+
+struct Graph {
+  gc<TreeNode> tree;
+  gc<ListNode> list;
+  gc<GraphNode> graph;
+  gc_vector<int64_t> wide;
+};
+
+struct Shape {
+  const char* name;
+  function<void(Graph& g, size_t& objCnt)> build;
+};
+
+// mark: one collecting cycle with the whole graph alive.
+// sweep: the cycle freeing the graph after it's dropped.
+void benchMarkSweep() {
+  mt19937 rng(42);
+  auto nodes = scaled(1 << 18);
+
+  vector<Shape> shapes = {
+      {"binary_tree",
+       [&](Graph& g, size_t& cnt) {
+         auto depth = 1;
+         while (((size_t)2 << depth) <= nodes)
+           depth++;
+         cnt = ((size_t)2 << depth) - 1;
+         g.tree = makeTree(depth);
+       }},
+      {"linked_list",
+       [&](Graph& g, size_t& cnt) {
+         cnt = nodes * 4;
+         g.list = gc_new<ListNode>();
+         auto tail = g.list;
+         for (size_t i = 1; i < cnt; i++) {
+           tail->next = gc_new<ListNode>();
+           tail = tail->next;
+         }
+       }},
+      // nodes are linked in a random order of their addresses, so every
+      // step of marking misses the cache.
+      {"shuffled_list",
+       [&](Graph& g, size_t& cnt) {
+         cnt = nodes * 4;
+         vector<gc<ListNode>> all(cnt);
+         for (auto& n : all)
+           n = gc_new<ListNode>();
+         shuffle(all.begin(), all.end(), rng);
+         for (size_t i = 1; i < cnt; i++)
+           all[i - 1]->next = all[i];
+         g.list = all[0];
+       }},
+      {"shuffled_tree",
+       [&](Graph& g, size_t& cnt) {
+         cnt = nodes * 4;
+         vector<gc<TreeNode>> all(cnt);
+         for (auto& n : all)
+           n = gc_new<TreeNode>();
+         shuffle(all.begin(), all.end(), rng);
+         for (size_t i = 1; i < cnt; i++) {
+           auto& parent = all[(i - 1) / 2];
+           (i % 2 ? parent->left : parent->right) = all[i];
+         }
+         g.tree = all[0];
+       }},
+      {"random_graph",
+       [&](Graph& g, size_t& cnt) {
+         cnt = nodes;
+         vector<gc<GraphNode>> all;
+         all.reserve(cnt);
+         for (size_t i = 0; i < cnt; i++)
+           all.push_back(gc_new<GraphNode>());
+         uniform_int_distribution<size_t> pick(0, cnt - 1);
+         for (auto& n : all)
+           for (auto& e : n->edges)
+             e = all[pick(rng)];
+         g.graph = all[0];
+       }},
+      {"wide_container",
+       [&](Graph& g, size_t& cnt) {
+         cnt = nodes;
+         g.wide = gc_new_vector<int64_t>();
+         for (size_t i = 0; i < cnt; i++)
+           g.wide->push_back(gc_new<int64_t>((int64_t)i));
+       }},
+  };
+
+  for (auto& shape : shapes) {
+    auto markName = string("mark/") + shape.name;
+    auto sweepName = string("sweep/") + shape.name;
+    if (!enabled(markName) && !enabled(sweepName))
+      continue;
+
+    vector<uint64_t> markTimes, sweepTimes;
+    size_t cnt = 0;
+    for (int i = 0; i < reps; i++) {
+      gc_collect_full();
+      auto root = gc_new<Graph>();
+      shape.build(*root, cnt);
+
+      finishCycle();
+      auto start = nowNs();
+      finishCycle();
+      markTimes.push_back(nowNs() - start);
+
+      root = nullptr;
+      start = nowNs();
+      finishCycle();
+      sweepTimes.push_back(nowNs() - start);
+    }
+    sort(markTimes.begin(), markTimes.end());
+    sort(sweepTimes.begin(), sweepTimes.end());
+    if (enabled(markName))
+      addResult(markName, cnt, (double)markTimes[reps / 2]);
+    if (enabled(sweepName))
+      addResult(sweepName, cnt, (double)sweepTimes[reps / 2]);
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Pause time distribution of incremental collecting
+
+void benchPauses() {
+  const char* name = "pause/incremental_256_steps";
+  if (!enabled(name))
+    return;
+
+  gc_collect_full();
+  mt19937 rng(7);
+  auto live = gc_new_vector<TreeNode>();
+  auto rounds = scaled(20000);
+  size_t slices = 0;
+  uint64_t total = 0;
+  PauseHistogram hist;
+  auto cycles = gc_stats().cycles;
+
+  for (size_t i = 0; i < rounds; i++) {
+    // mutator: keep a sliding window of small trees alive.
+    auto t = makeTree(3);
+    if (live->size() < 512)
+      live->push_back(t);
+    else
+      (*live)[rng() % live->size()] = t;
+
+    if (i % 4 == 0) {
+      auto start = nowNs();
+      gc_collect(256);
+      auto ns = nowNs() - start;
+      hist.record(ns);
+      total += ns;
+      slices++;
+    }
+  }
+  addResult(name, slices, (double)total,
+            {{"p50_ns", (double)hist.percentile(50)},
+             {"p99_ns", (double)hist.percentile(99)},
+             {"p999_ns", (double)hist.percentile(99.9)},
+             {"max_ns", (double)hist.max()},
+             {"cycles", (double)(gc_stats().cycles - cycles)}});
+  live = nullptr;
+  gc_collect_full();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Event loop: collecting in the allocations vs in the idle gaps
+
+void benchScheduler() {
+  for (auto idle : {false, true}) {
+    auto name = idle ? "sched/request_latency_idle"
+                     : "sched/request_latency_allocation";
+    if (!enabled(name))
+      continue;
+
+    gc_collect_full();
+    mt19937 rng(7);
+    auto live = gc_new_vector<TreeNode>();
+    for (int j = 0; j < 8192; j++)
+      live->push_back(makeTree(3));
+    gc_collect_full();
+    // both paced by the soft target, the scheduler keeps below it.
+    gc_set_heap_limit(0, gc_stats().liveBytes + (2 << 20));
+    gc_scheduler sched;
+    auto requests = scaled(20000);
+    uint64_t total = 0;
+    size_t behind = 0;
+    PauseHistogram hist;
+
+    for (size_t i = 0; i < requests; i++) {
+      auto start = nowNs();
+      for (int j = 0; j < 4; j++) {
+        auto t = makeTree(3);
+        (*live)[rng() % live->size()] = t;
+      }
+      auto ns = nowNs() - start;
+      hist.record(ns);
+      total += ns;
+
+      if (idle) {
+        sched.onIdle(chrono::microseconds(100));
+        behind += sched.fallingBehind();
+      }
+    }
+    addResult(name, requests, (double)total,
+              {{"p50_ns", (double)hist.percentile(50)},
+               {"p99_ns", (double)hist.percentile(99)},
+               {"max_ns", (double)hist.max()},
+               {"behind", (double)behind},
+               {"cycles", (double)gc_stats().cycles}});
+    gc_set_heap_limit(0);
+    live = nullptr;
+    gc_collect_full();
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Memory footprint of small objects
+
+// bytes in use by malloc, 0 if not supported by the platform.
+size_t mallocBytes() {
+#ifdef TGC_BENCH_MALLINFO
+  return mallinfo2().uordblks;
+#else
+  return 0;
+#endif
+}
+
+// Objects are left unreferenced and not collected until measured, heap bytes
+// are the headers & payloads, malloc bytes include the allocator overhead and
+// the collector bookkeeping as well.
+template <typename T>
+void footprint(const string& name, size_t n) {
+  if (!enabled(name))
+    return;
+  gc_collect_full();
+  auto used = mallocBytes();
+  auto live = gc_stats().liveBytes;
+  auto start = nowNs();
+  for (size_t i = 0; i < n; i++)
+    details::gc_new_meta<T>(1);
+  auto ns = nowNs() - start;
+  auto heapBytes = (double)(gc_stats().liveBytes - live) / n;
+  auto mallocBytesPerObj = (double)(mallocBytes() - used) / n;
+  gc_collect_full();
+  addResult(name, n, (double)ns,
+            {{"header_bytes", (double)sizeof(details::ObjMeta)},
+             {"ptr_bytes", (double)sizeof(gc<T>)},
+             {"heap_bytes_per_obj", heapBytes},
+             {"malloc_bytes_per_obj", mallocBytesPerObj}});
+}
+
+struct Linked {
+  gc<Linked> prev, next;
+  int64_t v;
+};
+
+void benchFootprint() {
+  auto n = scaled(4000000);
+  footprint<int>("footprint/gc_int", n);
+  footprint<double>("footprint/gc_double", n);
+  footprint<Small>("footprint/gc_new<Small>", n);
+  footprint<Linked>("footprint/linked_node", n);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Temporary graph of a request, freed by the collector or with a region
+
+void benchRegion() {
+  auto requests = scaled(10000);
+  auto build = [] {
+    gc<Linked> head;
+    for (int i = 0; i < 100; i++) {
+      auto n = gc_new<Linked>();
+      n->next = head;
+      head = n;
+    }
+  };
+  bench("region/request_graph_collected", requests * 100, gc_collect_full,
+        [=] {
+          for (size_t r = 0; r < requests; r++) {
+            build();
+            gc_collect(256);
+          }
+          gc_collect_full();
+        });
+  bench("region/request_graph_region", requests * 100, gc_collect_full,
+        [=] {
+          for (size_t r = 0; r < requests; r++) {
+            gc_region region;
+            build();
+          }
+        });
+
+  // each request also opens a session outliving the run, which would promote
+  // the whole region if it was not pretenured.
+  struct Session {
+    int id = 0;
+  };
+  static gc_site site{"bench session"};
+  auto sessions = make_shared<vector<gc<Session>>>();
+  bench(
+      "region/request_graph_region_session", requests * 100,
+      [=] {
+        sessions->clear();
+        gc_collect_full();
+      },
+      [=] {
+        for (size_t r = 0; r < requests; r++) {
+          gc_region region;
+          build();
+          sessions->push_back(gc_new<Session>(site));
+        }
+        gc_collect_full();
+      });
+  sessions->clear();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Burst of per-request state
+
+// The state of a request is dropped at once, the peak includes the garbage
+// not freed yet. Compare tgc_bench with tgc_bench_rc (TGC_DEFERRED_RC), where
+// gc_delete frees the counted state at once.
+void benchBurst() {
+  auto run = [](const char* name, bool deleted) {
+    if (!enabled(name))
+      return;
+    auto requests = scaled(20000);
+    gc_collect_full();
+    size_t peak = 0;
+    auto start = nowNs();
+    for (size_t r = 0; r < requests; r++) {
+      if (deleted) {
+        auto state = gc_new_vector<int64_t>();
+        for (int i = 0; i < 100; i++)
+          state->push_back(gc_new_array<int64_t>(4));
+        gc_delete(state);
+      } else {
+        vector<gc<int64_t>> state;
+        for (int i = 0; i < 100; i++)
+          state.push_back(gc_new_array<int64_t>(4));
+      }
+      peak = max(peak, gc_stats().liveBytes);
+      if (r % 64 == 0)
+        gc_collect();
+    }
+    auto ns = nowNs() - start;
+    gc_collect_full();
+    addResult(name, requests * 100, (double)ns,
+              {{"peak_live_bytes", (double)peak}});
+  };
+  run("burst/request_state", false);
+  run("burst/request_state_gc_delete", true);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Versioned state: a new version per update, the old ones kept alive
+
+// Copying gc containers per version vs the persistent ones sharing nodes.
+void benchPersistent() {
+  auto versions = scaled(2000);
+  auto obj = gc_new<int>(1);
+
+  auto maps = make_shared<vector<gc_map<int, int>>>();
+  bench(
+      "persistent/map_copy_set", versions, [=] { maps->clear(); },
+      [=] {
+        auto m = gc_new_map<int, int>();
+        for (size_t i = 0; i < versions; i++) {
+          m = gc_new_map<int, int>(*m);
+          m[(int)i] = obj;
+          maps->push_back(m);
+        }
+        gc_collect_full();
+      },
+      [=] { maps->clear(); });
+
+  auto pmaps = make_shared<vector<gc_pmap<int, int>>>();
+  bench(
+      "persistent/pmap_set", versions, [=] { pmaps->clear(); },
+      [=] {
+        gc_pmap<int, int> m;
+        for (size_t i = 0; i < versions; i++) {
+          m = m.set((int)i, obj);
+          pmaps->push_back(m);
+        }
+        gc_collect_full();
+      },
+      [=] { pmaps->clear(); });
+
+  auto vecs = make_shared<vector<gc_vector<int>>>();
+  bench(
+      "persistent/vector_copy_push", versions, [=] { vecs->clear(); },
+      [=] {
+        auto v = gc_new_vector<int>();
+        for (size_t i = 0; i < versions; i++) {
+          v = gc_new_vector<int>(*v);
+          v->push_back(obj);
+          vecs->push_back(v);
+        }
+        gc_collect_full();
+      },
+      [=] { vecs->clear(); });
+
+  auto pvecs = make_shared<vector<gc_pvector<int>>>();
+  bench(
+      "persistent/pvector_push", versions, [=] { pvecs->clear(); },
+      [=] {
+        gc_pvector<int> v;
+        for (size_t i = 0; i < versions; i++) {
+          v = v.push_back(obj);
+          pvecs->push_back(v);
+        }
+        gc_collect_full();
+      },
+      [=] { pvecs->clear(); });
+
+  // updates of a large collection, only the last version kept.
+  auto n = scaled(100000);
+  bench("persistent/pmap_update", n, nullptr, [=] {
+    gc_pmap<int, int> m;
+    for (size_t i = 0; i < n; i++)
+      m = m.set((int)(i * 7919 % n), obj);
+    sink = (int64_t)m.size();
+  });
+  bench("persistent/pvector_update", n, nullptr, [=] {
+    gc_pvector<int> v;
+    for (size_t i = 0; i < 1024; i++)
+      v = v.push_back(obj);
+    for (size_t i = 0; i < n; i++)
+      v = v.set(i * 7919 % 1024, obj);
+    sink = (int64_t)v.size();
+  });
+  gc_collect_full();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Strings of a protocol layer: many duplicates of a few distinct ones
+
+// malloc bytes include the characters of std::string beyond its inline
+// buffer, and the root list growing with the pointers kept.
+
+void benchStrings() {
+  auto n = scaled(200000);
+  vector<string> words;
+  for (int i = 0; i < 1000; i++)
+    words.push_back("x-protocol-header-field-" + to_string(i));
+
+  auto make = [&](const char* name, auto newStr) {
+    if (!enabled(name))
+      return;
+    gc_collect_full();
+    using S = decltype(newStr(words[0]));
+    vector<S> strs;
+    strs.reserve(n);
+    auto used = mallocBytes();
+    auto live = gc_stats().liveBytes;
+    auto start = nowNs();
+    for (size_t i = 0; i < n; i++)
+      strs.push_back(newStr(words[i * 7919 % words.size()]));
+    auto ns = nowNs() - start;
+    auto heapBytes = (double)(gc_stats().liveBytes - live) / n;
+    auto mallocBytesPerStr = (double)(mallocBytes() - used) / n;
+    addResult(name, n, (double)ns,
+              {{"heap_bytes_per_str", heapBytes},
+               {"malloc_bytes_per_str", mallocBytesPerStr}});
+    strs.clear();
+    gc_collect_full();
+  };
+  make("string/gc_string_new", [](const string& s) { return gc_string(s); });
+  make("string/gc_str_new", [](const string& s) { return gc_str(s); });
+  make("string/gc_intern", [](const string& s) { return gc_intern(s); });
+
+  vector<gc_string> boxed;
+  auto strMap = gc_new_unordered_map<string, int>();
+  vector<gc_str> interned;
+  auto internMap = gc_new_unordered_map<gc_str, int>();
+  auto obj = gc_new<int>(1);
+  for (auto& w : words) {
+    strMap[w] = obj;
+    internMap[gc_intern(w)] = obj;
+  }
+  for (size_t i = 0; i < 1000; i++) {
+    boxed.push_back(gc_string(words[i * 7919 % words.size()]));
+    interned.push_back(gc_intern(words[i * 7919 % words.size()]));
+  }
+  bench("string/gc_string_lookup", n, nullptr, [&] {
+    int64_t found = 0;
+    for (size_t i = 0; i < n; i++)
+      found += strMap->count(boxed[i % boxed.size()]);
+    sink = found;
+  });
+  bench("string/gc_intern_lookup", n, nullptr, [&] {
+    int64_t found = 0;
+    for (size_t i = 0; i < n; i++)
+      found += internMap->count(interned[i % interned.size()]);
+    sink = found;
+  });
+  gc_collect_full();
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Multi-thread scaling of allocation
+
+void benchThreads() {
+#ifdef TGC_MULTI_THREADED
+  auto perThread = scaled(200000);
+  auto maxThreads = max(1u, thread::hardware_concurrency());
+  for (unsigned cnt = 1; cnt <= maxThreads && cnt <= 16; cnt *= 2) {
+    auto name = "threads/alloc_x" + to_string(cnt);
+    bench(name, perThread * cnt, gc_collect_full, [=] {
+      vector<thread> threads;
+      for (unsigned t = 0; t < cnt; t++) {
+        threads.emplace_back([=] {
+          for (size_t i = 0; i < perThread; i++)
+            gc_new<Small>();
+        });
+      }
+      for (auto& t : threads)
+        t.join();
+    });
+  }
+  gc_collect_full();
+#endif
+}
+
+bool writeJson(const char* path) {
+  auto* f = fopen(path, "w");
+  if (!f)
+    return false;
+#ifdef TGC_MULTI_THREADED
+  auto mt = "true";
+#else
+  auto mt = "false";
+#endif
+#ifdef TGC_COMPACT_HEADER
+  auto compact = "true";
+#else
+  auto compact = "false";
+#endif
+  fprintf(f, "{\n  \"context\": {\"multi_threaded\": %s, ", mt);
+#ifdef TGC_COMPRESSED_PTRS
+  auto compressed = "true";
+#else
+  auto compressed = "false";
+#endif
+#ifdef TGC_DEFERRED_RC
+  auto rc = "true";
+#else
+  auto rc = "false";
+#endif
+#ifdef TGC_STOP_THE_WORLD
+  auto stw = "true";
+#else
+  auto stw = "false";
+#endif
+  fprintf(f, "\"compact_header\": %s, \"deferred_rc\": %s, ", compact, rc);
+  fprintf(f, "\"stop_the_world\": %s, ", stw);
+  fprintf(f, "\"compressed_ptrs\": %s, \"scale\": %g, ", compressed, scale);
+  fprintf(f, "\"repetitions\": %d},\n  \"benchmarks\": [\n", reps);
+  for (size_t i = 0; i < results.size(); i++) {
+    auto& r = results[i];
+    fprintf(f,
+            "    {\"name\": \"%s\", \"iterations\": %zu, \"real_time\": %.3f, "
+            "\"time_unit\": \"ns\"",
+            r.name.c_str(), r.iterations, r.nsPerOp);
+    for (auto& c : r.counters)
+      fprintf(f, ", \"%s\": %.0f", c.first.c_str(), c.second);
+    fprintf(f, "}%s\n", i + 1 < results.size() ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+  return fclose(f) == 0;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const char* jsonPath = nullptr;
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (!strcmp(argv[i], "--json"))
+      jsonPath = argv[i + 1];
+    else if (!strcmp(argv[i], "--filter"))
+      filter = argv[i + 1];
+    else if (!strcmp(argv[i], "--scale"))
+      scale = atof(argv[i + 1]);
+    else if (!strcmp(argv[i], "--reps"))
+      reps = max(1, atoi(argv[i + 1]));
+    else {
+      printf("unknown option: %s\n", argv[i]);
+      return 1;
+    }
+  }
+
+  printf("%-32s %12s %17s\n", "benchmark", "iterations", "time");
+  benchAlloc();
+  benchPointers();
+  benchContainers();
+  benchMarkSweep();
+  benchPauses();
+  benchScheduler();
+  benchFootprint();
+  benchRegion();
+  benchBurst();
+  benchPersistent();
+  benchStrings();
+  benchThreads();
+
+  if (jsonPath && !writeJson(jsonPath)) {
+    printf("failed to write %s\n", jsonPath);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,291 @@
+// Offline analyzer of the snapshots written by gc_heap_snapshot().
+//
+// Builds the dominator tree of the object graph (Lengauer-Tarjan) rooted at a
+// virtual node holding all the root pointers, then reports the objects and
+// classes retaining the most memory.
+//
+// usage: heapsnap <snapshot> [top count]
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+struct Class {
+  uint64_t size = 0;
+  string name;
+};
+
+struct Snapshot {
+  vector<Class> classes;
+  // node 0 is the virtual root, objects start from 1.
+  vector<uint32_t> nodeClass;
+  vector<uint64_t> nodeBytes;
+  vector<uint64_t> edgeStart;
+  vector<uint32_t> edges;
+  vector<uint32_t> rootRefs;  // number of root pointers per node.
+};
+
+class Reader {
+ public:
+  Reader(FILE* f) : f(f) {}
+
+  uint64_t get() {
+    uint64_t v = 0;
+    for (int shift = 0;; shift += 7) {
+      auto b = fgetc(f);
+      if (b == EOF || shift > 63)
+        throw "truncated snapshot";
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        return v;
+    }
+  }
+
+  string getStr(size_t len) {
+    string s(len, '\0');
+    if (len && fread(&s[0], 1, len, f) != len)
+      throw "truncated snapshot";
+    return s;
+  }
+
+ private:
+  FILE* f;
+};
+
+static Snapshot load(const char* path) {
+  auto* f = fopen(path, "rb");
+  if (!f)
+    throw "can not open snapshot";
+
+  Snapshot s;
+  Reader r(f);
+  if (r.getStr(8) != "TGCSNAP1")
+    throw "not a tgc heap snapshot";
+
+  s.classes.resize(r.get());
+  for (auto& c : s.classes) {
+    c.size = r.get();
+    c.name = r.getStr(r.get());
+  }
+
+  auto nodeCnt = r.get() + 1;
+  s.nodeClass.assign(nodeCnt, 0);
+  s.nodeBytes.assign(nodeCnt, 0);
+  s.rootRefs.assign(nodeCnt, 0);
+  s.edgeStart.assign(nodeCnt + 1, 0);
+  vector<uint32_t> objEdges;
+  for (size_t i = 1; i < nodeCnt; i++) {
+    s.nodeClass[i] = (uint32_t)r.get();
+    s.nodeBytes[i] = r.get();
+    s.edgeStart[i] = objEdges.size();
+    for (auto n = r.get(); n > 0; n--)
+      objEdges.push_back((uint32_t)r.get() + 1);
+  }
+
+  // edges of the virtual root go first.
+  vector<uint32_t> roots;
+  for (auto n = r.get(); n > 0; n--) {
+    auto node = (uint32_t)r.get() + 1;
+    if (!s.rootRefs[node]++)
+      roots.push_back(node);
+  }
+  fclose(f);
+
+  s.edges = roots;
+  s.edges.insert(s.edges.end(), objEdges.begin(), objEdges.end());
+  for (size_t i = 1; i < nodeCnt; i++)
+    s.edgeStart[i] += roots.size();
+  s.edgeStart[0] = 0;
+  s.edgeStart[nodeCnt] = s.edges.size();
+  return s;
+}
+
+// Returns the immediate dominators, -1 for unreachable nodes.
+static vector<int64_t> dominators(const Snapshot& s, vector<uint32_t>& order) {
+  auto n = s.nodeBytes.size();
+  vector<int64_t> dfnum(n, -1), parent(n, -1), semi(n), idom(n, -1),
+      ancestor(n, -1), label(n);
+
+  // iterative dfs to get the preorder.
+  vector<pair<uint32_t, uint64_t>> stack{{0, s.edgeStart[0]}};
+  dfnum[0] = 0;
+  order.push_back(0);
+  while (stack.size()) {
+    auto& top = stack.back();
+    if (top.second == s.edgeStart[top.first + 1]) {
+      stack.pop_back();
+      continue;
+    }
+    auto w = s.edges[top.second++];
+    if (dfnum[w] >= 0)
+      continue;
+    dfnum[w] = order.size();
+    parent[w] = top.first;
+    order.push_back(w);
+    stack.push_back({w, s.edgeStart[w]});
+  }
+
+  // predecessors of the reachable nodes.
+  vector<uint64_t> predStart(n + 1, 0);
+  for (size_t v = 0; v < n; v++) {
+    if (dfnum[v] < 0)
+      continue;
+    for (auto e = s.edgeStart[v]; e < s.edgeStart[v + 1]; e++)
+      predStart[s.edges[e] + 1]++;
+  }
+  for (size_t v = 0; v < n; v++)
+    predStart[v + 1] += predStart[v];
+  vector<uint32_t> preds(predStart[n]);
+  auto fill = predStart;
+  for (size_t v = 0; v < n; v++) {
+    if (dfnum[v] < 0)
+      continue;
+    for (auto e = s.edgeStart[v]; e < s.edgeStart[v + 1]; e++)
+      preds[fill[s.edges[e]]++] = (uint32_t)v;
+  }
+
+  for (size_t v = 0; v < n; v++) {
+    semi[v] = dfnum[v];
+    label[v] = v;
+  }
+
+  vector<int64_t> path;
+  auto eval = [&](int64_t v) {
+    if (ancestor[v] < 0)
+      return v;
+    path.clear();
+    for (auto x = v; ancestor[ancestor[x]] >= 0; x = ancestor[x])
+      path.push_back(x);
+    for (auto i = path.rbegin(); i != path.rend(); ++i) {
+      auto a = ancestor[*i];
+      if (semi[label[a]] < semi[label[*i]])
+        label[*i] = label[a];
+      ancestor[*i] = ancestor[a];
+    }
+    return label[v];
+  };
+
+  vector<vector<uint32_t>> bucket(n);
+  for (auto i = order.size() - 1; i > 0; i--) {
+    auto w = order[i];
+    for (auto p = predStart[w]; p < predStart[w + 1]; p++) {
+      auto u = eval(preds[p]);
+      if (semi[u] < semi[w])
+        semi[w] = semi[u];
+    }
+    bucket[order[semi[w]]].push_back(w);
+    auto pw = parent[w];
+    ancestor[w] = pw;
+    for (auto v : bucket[pw]) {
+      auto u = eval(v);
+      idom[v] = semi[u] < semi[v] ? u : pw;
+    }
+    bucket[pw].clear();
+  }
+  for (size_t i = 1; i < order.size(); i++) {
+    auto w = order[i];
+    if (idom[w] != order[semi[w]])
+      idom[w] = idom[idom[w]];
+  }
+  return idom;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    printf("usage: %s <snapshot> [top count]\n", argv[0]);
+    return 1;
+  }
+  size_t topCnt = argc > 2 ? strtoul(argv[2], nullptr, 10) : 20;
+
+  try {
+    auto s = load(argv[1]);
+    auto n = s.nodeBytes.size();
+
+    vector<uint32_t> order;
+    auto idom = dominators(s, order);
+
+    // children are after their dominators in the preorder.
+    vector<uint64_t> retained = s.nodeBytes;
+    for (auto i = order.size() - 1; i > 0; i--)
+      retained[idom[order[i]]] += retained[order[i]];
+
+    uint64_t totalBytes = 0;
+    for (auto b : s.nodeBytes)
+      totalBytes += b;
+    printf("objects: %zu, bytes: %llu, reachable objects: %zu, bytes: %llu\n",
+           n - 1, (unsigned long long)totalBytes, order.size() - 1,
+           (unsigned long long)retained[0]);
+
+    auto name = [&](size_t v) {
+      auto c = s.nodeClass[v];
+      return c < s.classes.size() && s.classes[c].name.size()
+                 ? s.classes[c].name.c_str()
+                 : "<unknown>";
+    };
+
+    // objects directly held by roots, i.e. what the roots are pinning.
+    vector<size_t> top;
+    for (size_t v = 1; v < n; v++)
+      if (idom[v] == 0)
+        top.push_back(v);
+    sort(top.begin(), top.end(),
+         [&](size_t a, size_t b) { return retained[a] > retained[b]; });
+    printf("\n--- retained by roots ---\n");
+    printf("%14s %12s %6s  %s\n", "retained", "self", "roots", "type");
+    for (size_t i = 0; i < top.size() && i < topCnt; i++) {
+      auto v = top[i];
+      printf("%14llu %12llu %6u  %s\n", (unsigned long long)retained[v],
+             (unsigned long long)s.nodeBytes[v], s.rootRefs[v], name(v));
+    }
+
+    top.clear();
+    for (size_t v = 1; v < n; v++)
+      if (idom[v] >= 0)
+        top.push_back(v);
+    sort(top.begin(), top.end(),
+         [&](size_t a, size_t b) { return retained[a] > retained[b]; });
+    printf("\n--- largest dominators ---\n");
+    printf("%14s %12s  %s\n", "retained", "self", "type");
+    for (size_t i = 0; i < top.size() && i < topCnt; i++) {
+      auto v = top[i];
+      printf("%14llu %12llu  %s\n", (unsigned long long)retained[v],
+             (unsigned long long)s.nodeBytes[v], name(v));
+    }
+
+    struct ClassSum {
+      size_t cls, objs = 0;
+      uint64_t bytes = 0;
+    };
+    vector<ClassSum> classes(s.classes.size() + 1);
+    for (size_t i = 0; i < classes.size(); i++)
+      classes[i].cls = i;
+    for (size_t v = 1; v < n; v++) {
+      auto c = min<size_t>(s.nodeClass[v], s.classes.size());
+      classes[c].objs++;
+      classes[c].bytes += s.nodeBytes[v];
+    }
+    sort(classes.begin(), classes.end(),
+         [](auto& a, auto& b) { return a.bytes > b.bytes; });
+    printf("\n--- classes ---\n");
+    printf("%14s %12s  %s\n", "bytes", "objects", "type");
+    for (size_t i = 0; i < classes.size() && i < topCnt; i++) {
+      auto& c = classes[i];
+      if (!c.objs)
+        break;
+      auto* cname = c.cls < s.classes.size() && s.classes[c.cls].name.size()
+                        ? s.classes[c.cls].name.c_str()
+                        : "<unknown>";
+      printf("%14llu %12zu  %s\n", (unsigned long long)c.bytes, c.objs, cname);
+    }
+  } catch (const char* err) {
+    printf("error: %s\n", err);
+    return 1;
+  }
+  return 0;
+}
@@ -1,369 +1,1418 @@
-#include <assert.h>
-
-#include <chrono>
-#include <iostream>
-#include <string_view>
-
-#include "tgc.h"
-
-using namespace tgc;
-using namespace std;
-
-struct b1 {
-  b1(const string& s) : name(s) {
-    cout << "Creating b1(" << name << ")." << endl;
-  }
-  virtual ~b1() { cout << "Destroying b1(" << name << ")." << endl; }
-
-  string name;
-};
-
-struct b2 {
-  b2(const string& s) : name(s) {
-    cout << "Creating b2(" << name << ")." << endl;
-  }
-  virtual ~b2() { cout << "Destroying b2(" << name << ")." << endl; }
-
-  string name;
-};
-
-struct d1 : public b1 {
-  d1(const string& s) : b1(s) {
-    cout << "Creating d1(" << name << ")." << endl;
-  }
-  virtual ~d1() { cout << "Destroying d1(" << name << ")." << endl; }
-};
-
-struct d2 : public b1, public b2 {
-  d2(const string& s) : b1(s), b2(s) {
-    cout << "Creating d2(" << b1::name << ")." << endl;
-  }
-  virtual ~d2() { cout << "Destroying d2(" << b1::name << ")." << endl; }
-};
-
-struct rc {
-  int a = 11;
-  rc() {}
-  ~rc() { auto i = gc<rc>(this); }
-};
-
-void testPointerCast() {
-  {
-    gc<rc> prc = gc_new<rc>();
-    {
-      gc<d1> p2(gc_new<d1>("first"));
-      gc<b1> p3(p2);
-      gc<b1> p4(gc_new<d2>("second"));
-      gc<b2> pz(dynamic_cast<b2*>(&*p4));
-      if ((void*)&*p4 == (void*)&*pz)
-        throw std::runtime_error("unexpected");
-
-      p3 = p2;
-      gc_collect();
-    }
-  }
-  gc_collect();
-}
-
-struct circ {
-  circ(const string& s) : name(s) {
-    cout << "Creating circ(" << name << ")." << endl;
-  }
-  ~circ() { cout << "Destroying circ(" << name << ")." << endl; }
-
-  gc<circ> ptr;
-  string name;
-};
-
-void testCirc() {
-  {
-    auto p5 = gc_new<circ>("root");
-    {
-      auto p6 = gc_new<circ>("first");
-      auto p7 = gc_new<circ>("second");
-
-      p5->ptr = p6;
-
-      p6->ptr = p7;
-      p7->ptr = p6;
-
-      gc_collect();
-    }
-  }
-  gc_collect();
-}
-
-void testMoveCtor() {
-  {
-    auto f = [] {
-      auto t = gc_new<b1>("");
-      return std::move(t);
-    };
-
-    auto p = f();
-    gc<b1> p2 = p;
-    p2 = f();
-  }
-}
-
-void testMakeGcObj() {
-  { auto a = gc_new<b1>("test"); }
-}
-
-void testEmpty() {
-  {
-    gc<b1> p(gc_new<b1>("a"));
-    gc<b1> emptry;
-  }
-}
-
-struct ArrayTest {
-  gc_vector<rc> a;
-  gc_map<int, rc> b;
-  gc_map<int, rc> c;
-
-  void f() {
-    a = gc_new_vector<rc>();
-    a->push_back(gc_new<rc>());
-    b = gc_new_map<int, rc>();
-    (*b)[0] = gc_new<rc>();
-    b[1] = gc_new<rc>();
-
-    b->find(1);
-    bar(b);
-  }
-  void bar(gc_map<int, rc> cc) { cc->insert(std::make_pair(1, gc_new<rc>())); }
-};
-
-void testArray() {
-  gc<ArrayTest> a;
-  a = gc_new<ArrayTest>();
-  a->f();
-
-  a = gc_new<ArrayTest>();
-  gc_delete(a);
-}
-
-void testCircledContainer() {
-  static int delCnt = 0;
-  struct Node {
-    gc_map<int, Node> childs = gc_new_map<int, Node>();
-    ~Node() { delCnt++; }
-  };
-  {
-    auto node = gc_new<Node>();
-    node->childs[0] = node;
-  }
-  gc_collect();
-  assert(delCnt == 1);
-}
-
-bool operator<(rc& a, rc& b) {
-  return a.a < b.a;
-}
-
-void testSet() {
-  {
-    gc_set<rc> t = gc_new_set<rc>();
-    auto o = gc_new<rc>();
-    t->insert(o);
-  }
-  gc_collect(1);
-
-  auto t = gc_new_set<rc>();
-  gc_delete(t);
-}
-
-void testList() {
-  auto l = gc_new_list<int>();
-  l->push_back(gc_new<int>(1));
-  l->push_back(gc_new<int>(2));
-  l->pop_back();
-  assert(*l->back() == 1);
-
-  auto ll = gc_new_list<int>();
-  gc_delete(ll);
-}
-
-void testDeque() {
-  auto l = gc_new_deque<int>();
-  l->push_back(gc_new<int>(1));
-  l->push_back(gc_new<int>(2));
-  l->pop_back();
-  assert(*l->back() == 1);
-
-  auto ll = gc_new_deque<int>();
-  gc_delete(ll);
-}
-
-void testHashMap() {
-  auto l = gc_new_unordered_map<int, int>();
-  l[1] = gc_new<int>(1);
-  assert(l->size() == 1);
-  assert(*l[1] == 1);
-
-  auto ll = gc_new_unordered_map<int, int>();
-  gc_delete(ll);
-}
-
-void testLambda() {
-  gc_function<int()> ff;
-  {
-    auto l = gc_new<int>(1);
-    auto f = [=] { return *l; };
-
-    ff = f;
-  }
-
-  int i = ff();
-  assert(i == 1);
-}
-
-void testPrimaryImplicitCtor() {
-  gc<int> a(1), b = gc_new<int>(2);
-  assert(a < b);
-
-  auto v = gc_new_vector<int>();
-  v->push_back(1);
-  assert(v[0] == 1);
-
-  using namespace std::string_literals;
-
-  gc_string s = "213"s;
-  printf("%s", s->c_str());
-}
-
-void testGcFromThis() {
-  struct Base {
-    int i;
-    Base() {
-      auto p = gc_from(this);
-      assert(p);
-    }
-  };
-
-  struct Child : Base {
-    int b;
-  };
-
-  auto makeLowerBoundHasElemToCompare = gc_new<int>();
-  auto p = gc_new<Base>();
-}
-
-void testDynamicCast() {
-  struct BaseA {
-    int a;
-    virtual ~BaseA() {}
-  };
-  struct BaseB {
-    float f;
-    virtual ~BaseB() {}
-  };
-  struct Sub : BaseA, BaseB {
-    int c;
-  };
-  auto sub = gc_new<Sub>();
-  gc<BaseB> baseB = sub;
-  auto sub2 = gc_dynamic_pointer_cast<Sub>(baseB);
-  assert(sub == sub2);
-}
-
-void testException() {
-  struct Ctx {
-    int dctorCnt = 0, ctorCnt = 0;
-    int len = 3;
-  };
-
-  struct Test {
-    Ctx& c;
-    Test(Ctx& cc) : c(cc) {
-      c.ctorCnt++;
-      if (c.ctorCnt == c.len)
-        throw 1;
-    }
-    ~Test() { c.dctorCnt++; }
-  };
-
-  auto err = false;
-  Ctx c;
-  try {
-    auto i = gc_new_array<Test>(c.len, c);
-  } catch (int) {
-    err = true;
-  }
-  assert(err);
-  assert(c.dctorCnt == c.len - 1);
-  assert(details::ClassMeta::get<Test>()->isCreatingObj == 0);
-}
-
-void testCollection() {
-  struct Circled {
-    gc<Circled> child;
-  };
-
-  {
-    int cnt = 1000;
-    for (int i = 0; i < cnt; i++) {
-      auto s = gc_new<Circled>();
-      s->child = s;
-    }
-    gc_dumpStats();
-    gc_collect(cnt * 5);
-    gc_dumpStats();
-  }
-}
-
-const int profilingCounts = 10000 * 100;
-
-auto profiled = [](const char* tag, auto cb) {
-  auto start = std::chrono::high_resolution_clock::now();
-  for (int i = 0; i < profilingCounts; i++)
-    cb();
-  auto end = std::chrono::high_resolution_clock::now();
-  std::chrono::duration<double> elapsed_seconds = end - start;
-  printf("[%10s] elapsed time: %fs\n", tag, elapsed_seconds.count());
-};
-
-void profileAlloc() {
-#ifndef _DEBUG
-  vector<int*> rawPtrs;
-  rawPtrs.reserve(profilingCounts);
-  profiled("gc int", [] { gc<int> p(111); });
-  profiled("raw int", [&] { rawPtrs.push_back(new int(111)); });
-  for (auto* i : rawPtrs)
-    delete i;
-  gc_collect(profilingCounts * 2);
-  gc_dumpStats();
-#endif
-}
-
-int main() {
-  profileAlloc();
-  testCollection();
-  testException();
-  testDynamicCast();
-  testGcFromThis();
-  testCircledContainer();
-  testPrimaryImplicitCtor();
-  testSet();
-  testEmpty();
-  // testPointerCast();
-  testMoveCtor();
-  testCirc();
-  testArray();
-  testList();
-  testDeque();
-  testHashMap();
-  testLambda();
-
-  // there are some objects leaked from the upper tests, just dump them
-  // out.
-  gc_dumpStats();
-  gc_collect();
-  // there should be no objects exists after the collecting.
-  gc_dumpStats();
-
-  // leaking test, you should not see leaks in the output of VS.
-  auto i = gc_new<int>(100);
-  return 0;
-}
+#include <assert.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <string_view>
+#include <thread>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#define popen _popen
+#define pclose _pclose
+#else
+#include <unistd.h>
+#endif
+
+#include "tgc.h"
+
+using namespace tgc;
+using namespace std;
+
+struct b1 {
+  b1(const string& s) : name(s) {
+    cout << "Creating b1(" << name << ")." << endl;
+  }
+  virtual ~b1() { cout << "Destroying b1(" << name << ")." << endl; }
+
+  string name;
+};
+
+struct b2 {
+  b2(const string& s) : name(s) {
+    cout << "Creating b2(" << name << ")." << endl;
+  }
+  virtual ~b2() { cout << "Destroying b2(" << name << ")." << endl; }
+
+  string name;
+};
+
+struct d1 : public b1 {
+  d1(const string& s) : b1(s) {
+    cout << "Creating d1(" << name << ")." << endl;
+  }
+  virtual ~d1() { cout << "Destroying d1(" << name << ")." << endl; }
+};
+
+struct d2 : public b1, public b2 {
+  d2(const string& s) : b1(s), b2(s) {
+    cout << "Creating d2(" << b1::name << ")." << endl;
+  }
+  virtual ~d2() { cout << "Destroying d2(" << b1::name << ")." << endl; }
+};
+
+struct rc {
+  int a = 11;
+  rc() {}
+  ~rc() { auto i = gc<rc>(this); }
+};
+
+void testPointerCast() {
+  {
+    gc<rc> prc = gc_new<rc>();
+    {
+      gc<d1> p2(gc_new<d1>("first"));
+      gc<b1> p3(p2);
+      gc<b1> p4(gc_new<d2>("second"));
+      gc<b2> pz(dynamic_cast<b2*>(&*p4));
+      if ((void*)&*p4 == (void*)&*pz)
+        throw std::runtime_error("unexpected");
+
+      p3 = p2;
+      gc_collect();
+    }
+  }
+  gc_collect();
+}
+
+struct circ {
+  circ(const string& s) : name(s) {
+    cout << "Creating circ(" << name << ")." << endl;
+  }
+  ~circ() { cout << "Destroying circ(" << name << ")." << endl; }
+
+  gc<circ> ptr;
+  string name;
+};
+
+void testCirc() {
+  {
+    auto p5 = gc_new<circ>("root");
+    {
+      auto p6 = gc_new<circ>("first");
+      auto p7 = gc_new<circ>("second");
+
+      p5->ptr = p6;
+
+      p6->ptr = p7;
+      p7->ptr = p6;
+
+      gc_collect();
+    }
+  }
+  gc_collect();
+}
+
+void testMoveCtor() {
+  {
+    auto f = [] {
+      auto t = gc_new<b1>("");
+      return std::move(t);
+    };
+
+    auto p = f();
+    gc<b1> p2 = p;
+    p2 = f();
+  }
+}
+
+void testMakeGcObj() {
+  { auto a = gc_new<b1>("test"); }
+}
+
+void testEmpty() {
+  {
+    gc<b1> p(gc_new<b1>("a"));
+    gc<b1> emptry;
+  }
+}
+
+struct ArrayTest {
+  gc_vector<rc> a;
+  gc_map<int, rc> b;
+  gc_map<int, rc> c;
+
+  void f() {
+    a = gc_new_vector<rc>();
+    a->push_back(gc_new<rc>());
+    b = gc_new_map<int, rc>();
+    (*b)[0] = gc_new<rc>();
+    b[1] = gc_new<rc>();
+
+    b->find(1);
+    bar(b);
+  }
+  void bar(gc_map<int, rc> cc) { cc->insert(std::make_pair(1, gc_new<rc>())); }
+};
+
+void testArray() {
+  gc<ArrayTest> a;
+  a = gc_new<ArrayTest>();
+  a->f();
+
+  a = gc_new<ArrayTest>();
+  gc_delete(a);
+}
+
+void testCircledContainer() {
+  static int delCnt = 0;
+  struct Node {
+    gc_map<int, Node> childs = gc_new_map<int, Node>();
+    ~Node() { delCnt++; }
+  };
+  {
+    auto node = gc_new<Node>();
+    node->childs[0] = node;
+  }
+  gc_collect();
+  assert(delCnt == 1);
+}
+
+bool operator<(rc& a, rc& b) {
+  return a.a < b.a;
+}
+
+void testSet() {
+  {
+    gc_set<rc> t = gc_new_set<rc>();
+    auto o = gc_new<rc>();
+    t->insert(o);
+  }
+  gc_collect(1);
+
+  auto t = gc_new_set<rc>();
+  gc_delete(t);
+}
+
+void testList() {
+  auto l = gc_new_list<int>();
+  l->push_back(gc_new<int>(1));
+  l->push_back(gc_new<int>(2));
+  l->pop_back();
+  assert(*l->back() == 1);
+
+  auto ll = gc_new_list<int>();
+  gc_delete(ll);
+}
+
+void testDeque() {
+  auto l = gc_new_deque<int>();
+  l->push_back(gc_new<int>(1));
+  l->push_back(gc_new<int>(2));
+  l->pop_back();
+  assert(*l->back() == 1);
+
+  auto ll = gc_new_deque<int>();
+  gc_delete(ll);
+}
+
+void testHashMap() {
+  auto l = gc_new_unordered_map<int, int>();
+  l[1] = gc_new<int>(1);
+  assert(l->size() == 1);
+  assert(*l[1] == 1);
+
+  auto ll = gc_new_unordered_map<int, int>();
+  gc_delete(ll);
+}
+
+void testLambda() {
+  gc_function<int()> ff;
+  {
+    auto l = gc_new<int>(1);
+    auto f = [=] { return *l; };
+
+    ff = f;
+  }
+
+  int i = ff();
+  assert(i == 1);
+}
+
+void testPrimaryImplicitCtor() {
+  gc<int> a(1), b = gc_new<int>(2);
+  assert(a < b);
+
+  auto v = gc_new_vector<int>();
+  v->push_back(1);
+  assert(v[0] == 1);
+
+  using namespace std::string_literals;
+
+  gc_string s = "213"s;
+  printf("%s", s->c_str());
+}
+
+void testGcFromThis() {
+  struct Base {
+    int i;
+    Base() {
+      auto p = gc_from(this);
+      assert(p);
+    }
+  };
+
+  struct Child : Base {
+    int b;
+  };
+
+  auto makeLowerBoundHasElemToCompare = gc_new<int>();
+  auto p = gc_new<Base>();
+}
+
+void testDynamicCast() {
+  struct BaseA {
+    int a;
+    virtual ~BaseA() {}
+  };
+  struct BaseB {
+    float f;
+    virtual ~BaseB() {}
+  };
+  struct Sub : BaseA, BaseB {
+    int c;
+  };
+  auto sub = gc_new<Sub>();
+  gc<BaseB> baseB = sub;
+  auto sub2 = gc_dynamic_pointer_cast<Sub>(baseB);
+  assert(sub == sub2);
+}
+
+void testMisalignedTarget() {
+#ifdef TGC_COMPRESSED_PTRS
+  struct BaseA {
+    int a;
+  };
+  struct BaseB {
+    int b;
+  };
+  struct Sub : BaseA, BaseB {};
+  auto sub = gc_new<Sub>();
+  // BaseB is at offset 4, the offset can not be compressed.
+  auto err = false;
+  try {
+    gc<BaseB> b = sub;
+  } catch (invalid_argument&) {
+    err = true;
+  }
+  assert(err);
+#endif
+}
+
+void testException() {
+  struct Ctx {
+    int dctorCnt = 0, ctorCnt = 0;
+    int len = 3;
+  };
+
+  struct Test {
+    Ctx& c;
+    Test(Ctx& cc) : c(cc) {
+      c.ctorCnt++;
+      if (c.ctorCnt == c.len)
+        throw 1;
+    }
+    ~Test() { c.dctorCnt++; }
+  };
+
+  auto err = false;
+  Ctx c;
+  try {
+    auto i = gc_new_array<Test>(c.len, c);
+  } catch (int) {
+    err = true;
+  }
+  assert(err);
+  assert(c.dctorCnt == c.len - 1);
+  assert(details::ClassMeta::get<Test>()->isCreatingObj == 0);
+}
+
+void testNewBatch() {
+  struct Node {
+    gc<Node> next;
+    int v;
+    Node(int v) : v(v) {}
+  };
+
+  gc_collect_full();
+  auto s = gc_stats();
+  auto nodes = gc_new_batch<Node>(1000, 7);
+  assert(nodes.size() == 1000);
+  for (size_t i = 1; i < nodes.size(); i++) {
+    assert(nodes[i]->v == 7);
+    nodes[i]->next = nodes[i - 1];
+  }
+  // placed one after another.
+  auto addr = [&](size_t i) { return (char*)nodes[i].get(); };
+  auto stride = addr(1) - addr(0);
+  size_t adjacent = 0;
+  for (size_t i = 1; i < nodes.size(); i++)
+    adjacent += addr(i) - addr(i - 1) == stride;
+  assert(stride > 0 && stride <= 64 && adjacent > 990);
+  assert(gc_stats().allocatedObjs == s.allocatedObjs + 1000);
+
+  // collected independently.
+  gc<Node> mid = nodes[499];
+  nodes.clear();
+  gc_collect_full();
+  assert(gc_stats().liveObjs == s.liveObjs + 500);
+  assert(mid->next->next->v == 7);
+  mid = nullptr;
+  gc_collect_full();
+  assert(gc_stats().liveObjs == s.liveObjs);
+
+  struct Ctx {
+    int dctorCnt = 0, ctorCnt = 0;
+  };
+  struct Test {
+    Ctx& c;
+    Test(Ctx& cc) : c(cc) {
+      if (++c.ctorCnt == 3)
+        throw 1;
+    }
+    ~Test() { c.dctorCnt++; }
+  };
+  Ctx c;
+  try {
+    gc_new_batch<Test>(10, c);
+    assert(false);
+  } catch (int) {
+  }
+  gc_collect_full();
+  assert(c.dctorCnt == 2);
+  assert(details::ClassMeta::get<Test>()->isCreatingObj == 0);
+  assert(gc_stats().liveObjs == s.liveObjs);
+}
+
+void testCollection() {
+  struct Circled {
+    gc<Circled> child;
+  };
+
+  {
+    int cnt = 1000;
+    for (int i = 0; i < cnt; i++) {
+      auto s = gc_new<Circled>();
+      s->child = s;
+    }
+    gc_dumpStats();
+    gc_collect(cnt * 5);
+    gc_dumpStats();
+  }
+}
+
+void testStats() {
+  struct Leaf {
+    int v[4];
+  };
+
+  auto before = gc_stats();
+  {
+    for (int i = 0; i < 100; i++)
+      gc_new<Leaf>();
+  }
+  auto allocated = gc_stats();
+  assert(allocated.allocatedObjs == before.allocatedObjs + 100);
+  assert(allocated.liveBytes >= before.liveBytes + 100 * sizeof(Leaf));
+
+  gc_collect(100000);
+  auto after = gc_stats();
+  assert(after.freedObjs >= before.freedObjs + 100);
+  assert(after.cycles > before.cycles);
+  assert(after.phases[(int)GcStats::State::Sweeping].slices >
+         before.phases[(int)GcStats::State::Sweeping].slices);
+}
+
+// Files written by the tests are per process, the binaries of all the flavors
+// may run in parallel.
+string tempPath(const char* name) {
+  return name + ("." + to_string(getpid()));
+}
+
+void testPauseTrace() {
+  auto before = gc_pause_histogram();
+  gc_trace_start(16);
+  for (int i = 0; i < 100; i++) {
+    gc_new<int>(i);
+    gc_collect(10);
+  }
+  gc_trace_stop();
+
+  auto slices = gc_pause_histogram();
+  assert(slices.count() == before.count() + 100);
+  assert(slices.percentile(50) <= slices.percentile(99.9));
+  assert(slices.percentile(100) == slices.max());
+  assert(gc_pause_histogram(GcStats::State::Sweeping).count() > 0);
+
+  auto path = tempPath("tgc_trace_test.json");
+  assert(gc_trace_dump(path.c_str()));
+  auto* f = fopen(path.c_str(), "r");
+  assert(f);
+  char buf[32] = {};
+  fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  remove(path.c_str());
+  assert(string(buf).find("{\"traceEvents\":[") == 0);
+}
+
+struct Profiled {
+  char buf[100];
+};
+
+void testHeapProfiler() {
+  gc_heap_profiler_start(2);
+  {
+    vector<gc<Profiled>> objs;
+    for (int i = 0; i < 10; i++)
+      objs.push_back(gc_new<Profiled>());
+
+    auto cls = gc_class_stats();
+    auto it = find_if(cls.begin(), cls.end(), [](auto& c) {
+      return c.klass == details::ClassMeta::get<Profiled>();
+    });
+    assert(it != cls.end());
+    assert(it->liveObjs == 10);
+    assert(it->liveBytes >= 10 * sizeof(Profiled));
+    gc_heap_report();
+
+    auto path = tempPath("tgc_heap_test.prof");
+    assert(gc_heap_profile_dump(path.c_str()));
+    auto* f = fopen(path.c_str(), "r");
+    assert(f);
+    char buf[64] = {};
+    fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    remove(path.c_str());
+    assert(string(buf).find("heap profile: 10: ") == 0);
+  }
+  gc_heap_profiler_stop();
+  gc_collect(10000);
+
+  for (auto& c : gc_class_stats()) {
+    if (c.klass == details::ClassMeta::get<Profiled>())
+      assert(c.liveObjs == 0 && c.allocatedObjs == 10);
+  }
+}
+
+struct Buffered {
+  // declared before the containers using it.
+  gc_memory_resource res;
+  std::pmr::string name{&res};
+  std::pmr::vector<int> ints{&res};
+};
+
+void testMemoryResource() {
+  gc_collect_full();
+  auto s = gc_stats();
+  gc_weak<Buffered> weak;
+  {
+    auto kept = gc_new<Buffered>();
+    kept->name.assign(100, 'k');
+    {
+      auto b = gc_new<Buffered>();
+      b->name.assign(1000, 'x');
+      for (int i = 0; i < 100000; i++)
+        b->ints.push_back(i);
+      weak = b;
+
+      auto t = gc_stats();
+      assert(t.bufferBytes >= s.bufferBytes + 1000 + 100000 * sizeof(int));
+      assert(t.liveBytes - s.liveBytes >= t.bufferBytes - s.bufferBytes);
+      for (auto& c : gc_class_stats()) {
+        if (c.klass == details::ClassMeta::get<Buffered>())
+          assert(c.liveBytes >= b->res.size());
+      }
+    }
+    gc_collect_full();
+    gc_collect_full();
+    assert(weak.expired());
+    assert(gc_stats().bufferBytes == s.bufferBytes + kept->res.size());
+    assert(kept->name.size() == 100 && kept->name[99] == 'k');
+  }
+
+  // not in the gc heap, only counted in the stats.
+  gc_memory_resource res;
+  auto u = gc_stats();
+  {
+    std::pmr::vector<std::pmr::string> strs{&res};
+    for (int i = 0; i < 1000; i++)
+      strs.emplace_back(100, 'a' + i % 26);
+    assert(strs[999][0] == 'a' + 999 % 26);
+    assert(gc_stats().bufferBytes == u.bufferBytes + res.size());
+  }
+  gc_collect_full();
+  assert(res.size() == 0);
+  assert(gc_stats().bufferBytes == s.bufferBytes);
+  assert(gc_stats().liveBytes == s.liveBytes);
+}
+
+struct ImageNode {
+  gc<ImageNode> left, right;
+  gc<int> boxed;
+  int64_t v = 0;
+};
+TGC_DECL_RELOCATABLE(ImageNode)
+
+void testHeapImage() {
+  gc_image_register<ImageNode, int>();
+
+  auto root = gc_new<ImageNode>();
+  auto node = root;
+  for (int i = 1; i < 1000; i++) {
+    node->left = gc_new<ImageNode>();
+    node->right = root;
+    node->boxed = gc_int(i);
+    node = node->left;
+    node->v = i;
+  }
+
+  auto path = tempPath("tgc_heap_test.img");
+  assert(gc_image_save(root, path.c_str()));
+  auto image = gc_image_load<ImageNode>(path.c_str());
+  remove(path.c_str());
+  assert(image && image.get() != root.get());
+
+  // the loaded graph survives the collections as is.
+  root = nullptr;
+  node = nullptr;
+  gc_collect_full();
+  node = image;
+  for (int i = 1; i < 1000; i++) {
+    assert(node->right == image && *node->boxed == i);
+    node = node->left;
+    assert(node->v == i);
+  }
+  assert(!node->left);
+
+  // immortal, not destroyed.
+  node = image;
+  gc_delete(node);
+  assert(node == image && image->left->v == 1);
+
+  // classes not registered can not be saved.
+  struct Unregistered {
+    gc<int> v;
+  };
+  auto o = gc_new<Unregistered>();
+  assert(!gc_image_save(o, path.c_str()));
+}
+
+// Snapshot written by gc_heap_snapshot, the format is read by heapsnap.cpp.
+struct Snapshot {
+  struct Node {
+    uint64_t cls, bytes;
+    vector<uint64_t> edges;
+  };
+  vector<string> classes;
+  vector<Node> nodes;
+  vector<uint64_t> roots;
+};
+
+Snapshot readSnapshot(const string& path) {
+  auto* f = fopen(path.c_str(), "rb");
+  assert(f);
+  auto get = [f] {
+    uint64_t v = 0;
+    for (int shift = 0;; shift += 7) {
+      auto b = fgetc(f);
+      assert(b != EOF);
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        return v;
+    }
+  };
+
+  Snapshot s;
+  string magic(8, '\0');
+  fread(&magic[0], 1, magic.size(), f);
+  assert(magic == "TGCSNAP1");
+  s.classes.resize(get());
+  for (auto& c : s.classes) {
+    get();
+    c.resize(get());
+    fread(&c[0], 1, c.size(), f);
+  }
+  s.nodes.resize(get());
+  for (auto& n : s.nodes) {
+    n.cls = get();
+    n.bytes = get();
+    n.edges.resize(get());
+    for (auto& e : n.edges)
+      e = get();
+  }
+  s.roots.resize(get());
+  for (auto& r : s.roots)
+    r = get();
+  assert(fgetc(f) == EOF);
+  fclose(f);
+  return s;
+}
+
+void testHeapSnapshot() {
+  struct Tree {
+    gc<Tree> left, right;
+    char payload[64];
+  };
+
+  auto root = gc_new<Tree>();
+  root->left = gc_new<Tree>();
+  root->right = gc_new<Tree>();
+  root->left->left = gc_new<Tree>();
+
+  auto path = tempPath("tgc_heap_test.snap");
+  assert(gc_heap_snapshot(path.c_str()));
+  auto s = readSnapshot(path);
+  remove(path.c_str());
+
+  // objects left by the upper tests are in the snapshot too.
+  auto isTree = [&](uint64_t n) {
+    return s.classes[s.nodes[n].cls].find("Tree") != string::npos;
+  };
+  size_t trees = 0, edges = 0, roots = 0;
+  for (size_t n = 0; n < s.nodes.size(); n++) {
+    if (!isTree(n))
+      continue;
+    trees++;
+    assert(s.nodes[n].bytes >= sizeof(Tree));
+    for (auto e : s.nodes[n].edges)
+      edges += isTree(e);
+  }
+  for (auto r : s.roots)
+    roots += isTree(r);
+  assert(trees == 4 && edges == 3 && roots == 1);
+
+  // objects of the promoted regions and of the ones not exited yet.
+  {
+    gc_region region;
+    root->right->right = gc_new<Tree>();
+    root->right->right->left = gc_new<Tree>();
+  }
+  gc_region region;
+  root->left->right = gc_new<Tree>();
+  assert(gc_heap_snapshot(path.c_str()));
+  s = readSnapshot(path);
+  remove(path.c_str());
+  trees = edges = 0;
+  for (size_t n = 0; n < s.nodes.size(); n++) {
+    if (!isTree(n))
+      continue;
+    trees++;
+    for (auto e : s.nodes[n].edges)
+      edges += isTree(e);
+  }
+  assert(trees == 7 && edges == 6);
+}
+
+// Run by ctest with the path of heapsnap, checks the dominators it reports
+// for a diamond: root -> a, b -> c -> d.
+void testHeapsnap(const char* heapsnap) {
+  struct Node {
+    gc<Node> left, right;
+    char payload[48];
+  };
+
+  auto root = gc_new<Node>();
+  root->left = gc_new<Node>();
+  root->right = gc_new<Node>();
+  root->left->left = gc_new<Node>();
+  root->right->left = root->left->left;
+  root->left->left->left = gc_new<Node>();
+
+  auto path = tempPath("tgc_heapsnap_test.snap");
+  assert(gc_heap_snapshot(path.c_str()));
+  auto* out = popen((string(heapsnap) + " " + path).c_str(), "r");
+  assert(out);
+  vector<uint64_t> retained;
+  bool dominators = false;
+  char line[512];
+  while (fgets(line, sizeof(line), out)) {
+    unsigned long long bytes, self;
+    char type[256];
+    if (string(line).find("--- ") == 0)
+      dominators = string(line) == "--- largest dominators ---\n";
+    else if (dominators &&
+             sscanf(line, "%llu %llu %255[^\n]", &bytes, &self, type) == 3 &&
+             string(type).find("Node") != string::npos)
+      retained.push_back(bytes / self);
+  }
+  assert(pclose(out) == 0);
+  remove(path.c_str());
+
+  // c is reached through both a and b, so only the root dominates it.
+  sort(retained.begin(), retained.end());
+  assert((retained == vector<uint64_t>{1, 1, 1, 2, 5}));
+}
+
+void testWeakRef() {
+  struct Node {
+    gc<Node> next;
+  };
+  // finishes the cycle in progress and a whole new one.
+  auto fullCollect = [] {
+    for (int i = 0; i < 2; i++) {
+      auto cycles = gc_stats().cycles;
+      while (gc_stats().cycles == cycles)
+        gc_collect();
+    }
+  };
+
+  auto strong = gc_new<Node>();
+  gc_weak<Node> weak = strong;
+  fullCollect();
+  assert(weak.lock() == strong);
+  strong = nullptr;
+  fullCollect();
+  assert(weak.expired() && !weak.lock());
+
+  // the value refers to its key, which must not keep the entry alive.
+  auto cache = gc_new_weak_map<Node, Node>();
+  auto key = gc_new<Node>();
+  gc_weak<Node> value, deadValue;
+  {
+    auto v = gc_new<Node>();
+    v->next = key;
+    cache->set(key, v);
+    value = v;
+
+    auto deadKey = gc_new<Node>();
+    v = gc_new<Node>();
+    v->next = deadKey;
+    cache->set(deadKey, v);
+    deadValue = v;
+  }
+  assert(cache->size() == 2);
+  fullCollect();
+  assert(cache->size() == 1 && deadValue.expired());
+  assert(cache->get(key) == value.lock());
+
+  key = nullptr;
+  fullCollect();
+  assert(cache->size() == 0 && value.expired());
+}
+
+void testHeapLimit() {
+  struct Chunk {
+    gc<Chunk> next;
+    char buf[1000];
+  };
+
+  gc_collect_full();
+  auto base = gc_stats().liveBytes;
+  auto limit = base + 100 * 1024;
+  gc_set_heap_limit(limit);
+
+  // garbage is collected synchronously instead of exceeding the limit.
+  for (int i = 0; i < 1000; i++)
+    gc_new<Chunk>();
+  assert(gc_stats().liveBytes <= limit);
+
+  // live objects can not.
+  auto head = gc_new<Chunk>();
+  auto failed = false;
+  try {
+    for (int i = 0; i < 1000; i++) {
+      auto c = gc_new<Chunk>();
+      c->next = head;
+      head = c;
+    }
+  } catch (std::bad_alloc&) {
+    failed = true;
+  }
+  assert(failed && gc_stats().liveBytes <= limit);
+
+  // the soft target only makes allocations run collecting slices.
+  head = nullptr;
+  gc_set_heap_limit(0, base + 10 * 1024);
+  auto cycles = gc_stats().cycles;
+  for (int i = 0; i < 1000; i++)
+    gc_new<Chunk>();
+  assert(gc_stats().cycles > cycles);
+  gc_set_heap_limit(0);
+}
+
+void testLargeObject() {
+  struct Node {
+    gc<int> v;
+    int64_t pad;
+  };
+
+  // more than 65535 elements and far bigger than a heap page.
+  auto bigLen = (size_t)1 << 20;
+  auto big = gc_new_array<char>(bigLen);
+  assert(details::Heap::largeObjectBytes() >= bigLen);
+  big = nullptr;
+  gc_collect_full();
+  assert(details::Heap::largeObjectBytes() == 0);
+
+  // pointers of all the elements are traced.
+  auto nodes = gc_new_array<Node>(100000);
+  for (int i = 0; i < 100000; i++)
+    nodes.get()[i].v = gc_new<int>(i);
+  gc_collect_full();
+  for (int i = 0; i < 100000; i += 999)
+    assert(*nodes.get()[i].v == i);
+  nodes = nullptr;
+  gc_collect_full();
+
+  // the longer header of long arrays keeps the elements aligned.
+  struct alignas(details::MaxObjAlign) Cell {
+    char c;
+  };
+  for (auto len : {(size_t)1, (size_t)100000}) {
+    auto cells = gc_new_array<Cell>(len);
+    assert((uintptr_t)cells.get() % alignof(Cell) == 0);
+  }
+}
+
+void testScheduler() {
+  using namespace std::chrono;
+  struct Node {
+    gc<Node> next;
+  };
+
+  gc_collect_full();
+  gc_scheduler sched;
+  assert(!sched.hasWork());
+  assert(!sched.onIdle(milliseconds(1)));
+
+  auto s = gc_stats();
+  for (int i = 0; i < 10000; i++)
+    gc_new<Node>();
+  assert(sched.hasWork());
+  // no time for a slice.
+  assert(sched.runUntil(gc_scheduler::clock::now()));
+  assert(gc_stats().freedObjs == s.freedObjs);
+
+  // garbage is freed in the idle time.
+  while (sched.onIdle(microseconds(100)))
+    ;
+  assert(sched.steps() > 0 && sched.nsPerStep() > 0);
+  assert(gc_stats().freedObjs >= s.freedObjs + 10000);
+  assert(!sched.fallingBehind());
+
+  // cycles are not started for a few allocations.
+  gc<Node> kept = gc_new<Node>();
+  for (int i = 0; i < 10000; i++) {
+    auto n = gc_new<Node>();
+    n->next = kept;
+    kept = n;
+  }
+  while (sched.onIdle(milliseconds(10)))
+    ;
+  gc_new<Node>();
+  assert(!sched.hasWork());
+  kept = nullptr;
+  gc_collect_full();
+}
+
+void testLazySweep() {
+  struct Garbage {
+    int64_t v[4];
+  };
+
+#ifdef TGC_STOP_THE_WORLD
+  // cycles are never left in the middle.
+  return;
+#endif
+  gc_collect_full();
+  for (int i = 0; i < 10000; i++)
+    gc_new<Garbage>();
+  while (gc_stats().state != GcStats::State::Sweeping)
+    gc_collect(1);
+
+  // allocations sweep the pages of their own size class on demand.
+  auto freed = gc_stats().freedObjs;
+  for (int i = 0; i < 100; i++)
+    gc_new<Garbage>();
+  assert(gc_stats().freedObjs > freed);
+  assert(gc_stats().state == GcStats::State::Sweeping);
+
+  gc_collect_full();
+  assert(gc_stats().liveObjs < 100 + 10);
+
+  // so do the batches.
+  for (int i = 0; i < 10000; i++)
+    gc_new<Garbage>();
+  while (gc_stats().state != GcStats::State::Sweeping)
+    gc_collect(1);
+  freed = gc_stats().freedObjs;
+  gc_new_batch<Garbage>(100);
+  assert(gc_stats().freedObjs > freed);
+  gc_collect_full();
+}
+
+void testTrim() {
+  struct Chunk {
+    char buf[4000];
+  };
+
+  gc_set_trim_policy(SIZE_MAX);
+  gc_collect_full();
+  for (int i = 0; i < 1000; i++)
+    gc_new<Chunk>();
+  gc_collect_full();
+  gc_collect_full();
+
+  // empty pages are kept for reuse until trimmed.
+  auto s = gc_stats();
+  assert(s.heapRetainedBytes > 0);
+  auto released = gc_trim();
+  assert(released == s.heapRetainedBytes);
+  auto t = gc_stats();
+  assert(t.heapRetainedBytes == 0);
+  assert(t.heapCommittedBytes == s.heapCommittedBytes - released);
+  assert(t.heapTrimmedBytes == s.heapTrimmedBytes + released);
+
+  // or right after the sweeping frees them.
+  gc_set_trim_policy(0);
+  for (int i = 0; i < 1000; i++)
+    gc_new<Chunk>();
+  gc_collect_full();
+  gc_collect_full();
+  assert(gc_stats().heapRetainedBytes == 0);
+  assert(gc_stats().heapTrimmedBytes > t.heapTrimmedBytes);
+  gc_set_trim_policy(2);
+}
+
+void testRootList() {
+  auto v = gc_new_vector<int>();
+  for (int i = 0; i < 10000; i++)
+    v->push_back(gc_new<int>(i));
+
+  // elements are known to be interior once the vector is traced.
+  gc_collect_full();
+  auto rootSteps = [] {
+    return gc_stats().phases[(int)GcStats::State::RootMarking].steps;
+  };
+  auto before = rootSteps();
+  gc_collect_full();
+  assert(rootSteps() - before < 1000);
+  assert(gc_stats().pointers >= 10000);
+  assert(*(*v)[9999] == 9999);
+}
+
+void testRegion() {
+  struct Node {
+    gc<Node> next;
+    int v = 0;
+  };
+
+  gc_collect_full();
+  auto s = gc_stats();
+  gc_weak<Node> weak;
+  {
+    gc_region region;
+    gc<Node> head;
+    for (int i = 0; i < 1000; i++) {
+      auto n = gc_new<Node>();
+      n->v = i;
+      n->next = head;
+      head = n;
+    }
+    weak = head;
+    gc_collect_full();
+    assert(head->next->v == 998);
+  }
+  // nothing escaped, freed at once.
+  auto t = gc_stats();
+  assert(t.regionFreedObjs == s.regionFreedObjs + 1000);
+  assert(t.liveObjs == s.liveObjs);
+  assert(weak.expired());
+
+  gc<Node> escaped;
+  {
+    gc_region region;
+    auto n = gc_new<Node>();
+    n->next = gc_new<Node>();
+    n->next->v = 2;
+    gc_new<Node>();
+    escaped = n;
+  }
+  assert(gc_stats().regionPromotedObjs == t.regionPromotedObjs + 3);
+  gc_collect_full();
+  assert(escaped->next->v == 2);
+  escaped = nullptr;
+
+  // values of weak maps are not counted pointers, but escape as well.
+  auto key = gc_new<Node>();
+  auto map = gc_new_weak_map<Node, Node>();
+  {
+    gc_region region;
+    auto n = gc_new<Node>();
+    n->v = 3;
+    map->set(key, n);
+  }
+  gc_collect_full();
+  assert(map->get(key)->v == 3);
+  key = nullptr;
+  map = nullptr;
+
+  gc_collect_full();
+  assert(gc_stats().liveObjs == s.liveObjs);
+}
+
+void testPretenuring() {
+  struct Session {
+    int id = 0;
+  };
+  struct Temp {
+    gc<Session> session;
+  };
+  static gc_site site{"session"};
+
+  gc_collect_full();
+  vector<gc<Session>> sessions;
+  auto handle = [&](int id) {
+    gc_region region;
+    gc<Session> session = gc_new<Session>(site);
+    session->id = id;
+    for (int i = 0; i < 10; i++)
+      gc_new<Temp>()->session = session;
+    sessions.push_back(session);
+  };
+
+  // sessions escape and take the temporary objects along.
+  auto s = gc_stats();
+  for (int i = 0; i < (int)details::SurvivalStats::Window; i++) {
+    handle(i);
+    if (i % 16 == 15)
+      gc_collect_full();
+  }
+  gc_collect_full();
+  auto survival = site.survival();
+  assert(survival.pretenured);
+  assert(survival.survivedObjs == details::SurvivalStats::Window);
+  assert(site.allocatedObjs() == details::SurvivalStats::Window);
+  auto t = gc_stats();
+  assert(t.regionPromotedObjs > s.regionPromotedObjs);
+  assert(t.pretenuredObjs == s.pretenuredObjs);
+
+  // now allocated in the heap, the regions are freed at once.
+  handle(-1);
+  auto u = gc_stats();
+  assert(u.pretenuredObjs == t.pretenuredObjs + 1);
+  assert(u.regionPromotedObjs == t.regionPromotedObjs);
+  assert(u.regionFreedObjs == t.regionFreedObjs + 10);
+  gc_collect_full();
+  assert(sessions.back()->id == -1);
+
+  for (auto& c : gc_class_stats()) {
+    if (c.klass == details::ClassMeta::get<Temp>())
+      assert(!c.survival.pretenured && c.survival.diedObjs >= 1280);
+  }
+  sessions.clear();
+  gc_collect_full();
+}
+
+struct RcLeaf {
+  int v = 0;
+};
+TGC_DECL_ACYCLIC(RcLeaf)
+
+void testDeferredRc() {
+#ifdef TGC_DEFERRED_RC
+  struct Holder {
+    gc<RcLeaf> leaf;
+  };
+  struct Node {
+    gc<Node> next;
+  };
+
+  gc_collect_full();
+  auto s = gc_stats();
+  for (int i = 0; i < 10000; i++) {
+    gc_new<RcLeaf>();
+    gc<int> n(i);
+  }
+  // freed without tracing as the buffers fill up.
+  auto t = gc_stats();
+  assert(t.cycles == s.cycles);
+  assert(t.rcFreedObjs > s.rcFreedObjs + 20000 - 1024);
+  gc_collect(1);
+  assert(gc_stats().rcFreedObjs == s.rcFreedObjs + 20000);
+
+  auto h = gc_new<Holder>();
+  h->leaf = gc_new<RcLeaf>();
+  h->leaf->v = 1;
+  for (int i = 0; i < 10000; i++)
+    gc_new<RcLeaf>();
+  gc_collect(1);
+  assert(h->leaf->v == 1);
+  t = gc_stats();
+  h->leaf = nullptr;
+  gc_collect(1);
+  assert(gc_stats().rcFreedObjs == t.rcFreedObjs + 1);
+
+  // cycles are left to the tracing.
+  {
+    auto a = gc_new<Node>();
+    a->next = gc_new<Node>();
+    a->next->next = a;
+  }
+  t = gc_stats();
+  gc_collect_full();
+  assert(gc_stats().freedObjs >= t.freedObjs + 2);
+  assert(gc_stats().rcFreedObjs == t.rcFreedObjs);
+#endif
+}
+
+void testDeferredRcThreads() {
+#if defined(TGC_DEFERRED_RC) && defined(TGC_MULTI_THREADED)
+  // targets handed between the threads are not freed while referred to, the
+  // flushes run in between by the other threads.
+  std::mutex lock;
+  auto slot = gc_new<RcLeaf>();
+  slot->v = 1;
+  vector<thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&] {
+      for (int i = 0; i < 20000; i++) {
+        gc<RcLeaf> p;
+        {
+          lock_guard lk{lock};
+          p = slot;
+          if (i % 2) {
+            slot = gc_new<RcLeaf>();
+            slot->v = 1;
+          }
+        }
+        assert(p->v == 1);
+      }
+    });
+  }
+  for (auto& t : threads)
+    t.join();
+  assert(slot->v == 1);
+
+  gc_collect_full();
+  auto s = gc_stats();
+  slot = nullptr;
+  gc_collect(1);
+  assert(gc_stats().rcFreedObjs == s.rcFreedObjs + 1);
+#endif
+}
+
+void testDelete() {
+  static int delCnt = 0;
+  struct Obj {
+    ~Obj() { delCnt++; }
+  };
+
+  auto m = gc_new_map<int, Obj>();
+  m[1] = gc_new<Obj>();
+  m[2] = gc_new<Obj>();
+  auto kept = m[2];
+  gc_delete(m);
+  assert(delCnt == 2 && m->empty());
+  // referenced elsewhere, left to the collector.
+  assert(kept);
+  kept = nullptr;
+  gc_collect_full();
+
+#ifdef TGC_DEFERRED_RC
+  // reference counted ones no other pointer refers to are freed at once.
+  auto s = gc_stats();
+  auto leaf = gc_new<RcLeaf>();
+  gc_delete(leaf);
+  assert(!leaf);
+  assert(gc_stats().rcFreedObjs == s.rcFreedObjs + 1);
+
+  auto shared = gc_new<RcLeaf>();
+  auto other = shared;
+  gc_delete(shared);
+  assert(gc_stats().rcFreedObjs == s.rcFreedObjs + 1);
+  other = nullptr;
+  gc_collect(1);
+  assert(gc_stats().rcFreedObjs == s.rcFreedObjs + 2);
+
+  auto v = gc_new_vector<int>();
+  for (int i = 0; i < 100; i++)
+    v->push_back(gc_new<int>(i));
+  gc_delete(v);
+  assert(gc_stats().rcFreedObjs == s.rcFreedObjs + 102);
+#endif
+}
+
+void testPersistent() {
+  gc_collect_full();
+  auto s = gc_stats();
+  {
+    // shares the unchanged nodes, old versions stay intact.
+    vector<gc_pmap<int, int>> maps{gc_pmap<int, int>()};
+    for (int i = 0; i < 2000; i++)
+      maps.push_back(maps.back().set(i, gc_new<int>(i)));
+    auto m = maps.back().set(7, gc_new<int>(-7));
+    gc_collect_full();
+    for (int i = 0; i <= 2000; i += 100) {
+      assert(maps[i].size() == (size_t)i);
+      assert(!maps[i].contains(i));
+      if (i)
+        assert(*maps[i].get(i - 1) == i - 1);
+    }
+    assert(*m.get(7) == -7 && *maps.back().get(7) == 7);
+    assert(m.size() == 2000);
+
+    auto e = m;
+    for (int i = 0; i < 2000; i += 2)
+      e = e.erase(i);
+    assert(e.size() == 1000 && !e.contains(0) && *e.get(1) == 1);
+    assert(e.erase(0).size() == 1000 && m.size() == 2000);
+    for (int i = 1; i < 2000; i += 2)
+      e = e.erase(i);
+    assert(e.empty());
+
+    // all the keys collide.
+    struct BadHash {
+      size_t operator()(int) const { return 42; }
+    };
+    gc_pmap<int, int, BadHash> c;
+    for (int i = 0; i < 10; i++)
+      c = c.set(i, gc_new<int>(i));
+    assert(c.size() == 10 && *c.get(5) == 5);
+    c = c.erase(5);
+    assert(c.size() == 9 && !c.contains(5) && *c.get(9) == 9);
+    int sum = 0;
+    c.for_each([&](int k, const gc<int>& v) { sum += k + *v; });
+    assert(sum == (45 - 5) * 2);
+
+    gc_pvector<int> v;
+    vector<gc_pvector<int>> vecs;
+    for (int i = 0; i < 1500; i++) {
+      vecs.push_back(v);
+      v = v.push_back(gc_new<int>(i));
+    }
+    auto w = v.set(1000, gc_new<int>(-1)).set(1499, gc_new<int>(-2));
+    gc_collect_full();
+    for (int i = 0; i < 1500; i++)
+      assert(*v[i] == i);
+    assert(vecs[33].size() == 33 && *vecs[33][32] == 32);
+    assert(*w[1000] == -1 && *w.back() == -2 && *w[999] == 999);
+    while (w.size() > 1) {
+      w = w.pop_back();
+      auto i = (int)w.size() - 1;
+      assert(*w.back() == (i == 1000 ? -1 : i));
+    }
+    assert(*w[0] == 0 && w.pop_back().empty());
+  }
+  gc_collect_full();
+  assert(gc_stats().liveObjs == s.liveObjs);
+}
+
+void testString() {
+  gc_collect_full();
+  auto s = gc_stats();
+  {
+    gc_str a("hello"), b(string("hel") + "lo"), e;
+    assert(a == b && a.c_str() != b.c_str());
+    assert(a.size() == 5 && !strcmp(a.c_str(), "hello"));
+    assert(a.hash() == hash<string>()("hello"));
+    assert(e.empty() && e == gc_str("") && e != a && e < a);
+
+    auto chars = string(100, 'x');
+    gc_str l(chars);
+    assert(l.str() == chars && l.c_str()[100] == 0);
+
+    // equal interned strings are the same object.
+    auto i = gc_intern("hello"), j = gc_intern(b);
+    assert(i.interned() && !a.interned());
+    assert(i == j && i.c_str() == j.c_str() && i == a);
+    assert(gc_intern("world") != i);
+
+    auto m = gc_new_unordered_map<gc_str, int>();
+    m[gc_intern("k")] = gc_new<int>(1);
+    assert(m->count(gc_str("k")) && !m->count(gc_str("j")));
+
+    for (int n = 0; n < 3000; n++)
+      gc_intern(to_string(n));
+    gc_collect_full();
+    assert(gc_intern("hello").c_str() == i.c_str());
+  }
+  gc_collect_full();
+  // the keys of the map are roots until it's swept.
+  gc_collect_full();
+  assert(gc_stats().liveObjs == s.liveObjs);
+}
+
+const int profilingCounts = 10000 * 100;
+
+auto profiled = [](const char* tag, auto cb) {
+  auto start = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < profilingCounts; i++)
+    cb();
+  auto end = std::chrono::high_resolution_clock::now();
+  std::chrono::duration<double> elapsed_seconds = end - start;
+  printf("[%10s] elapsed time: %fs\n", tag, elapsed_seconds.count());
+};
+
+void profileAlloc() {
+#ifndef _DEBUG
+  vector<int*> rawPtrs;
+  rawPtrs.reserve(profilingCounts);
+  profiled("gc int", [] { gc<int> p(111); });
+  profiled("raw int", [&] { rawPtrs.push_back(new int(111)); });
+  for (auto* i : rawPtrs)
+    delete i;
+  gc_collect(profilingCounts * 2);
+  gc_dumpStats();
+#endif
+}
+
+int main(int argc, char** argv) {
+  if (argc == 3 && string(argv[1]) == "--heapsnap") {
+    testHeapsnap(argv[2]);
+    return 0;
+  }
+
+  profileAlloc();
+  testCollection();
+  testStats();
+  testPauseTrace();
+  testHeapProfiler();
+  testHeapSnapshot();
+  testHeapImage();
+  testWeakRef();
+  testHeapLimit();
+  testLargeObject();
+  testLazySweep();
+  testTrim();
+  testDeferredRc();
+  testDeferredRcThreads();
+  testDelete();
+  testPersistent();
+  testString();
+  testRootList();
+  testRegion();
+  testPretenuring();
+  testMemoryResource();
+  testException();
+  testNewBatch();
+  testScheduler();
+  testDynamicCast();
+  testMisalignedTarget();
+  testGcFromThis();
+  testCircledContainer();
+  testPrimaryImplicitCtor();
+  testSet();
+  testEmpty();
+  // testPointerCast();
+  testMoveCtor();
+  testCirc();
+  testArray();
+  testList();
+  testDeque();
+  testHashMap();
+  testLambda();
+
+  // there are some objects leaked from the upper tests, just dump them
+  // out.
+  gc_dumpStats();
+  gc_collect();
+  // there should be no objects exists after the collecting.
+  gc_dumpStats();
+
+  // leaking test, you should not see leaks in the output of VS.
+  auto i = gc_new<int>(100);
+  return 0;
+}
@@ -1,366 +1,2820 @@
-#include "tgc.h"
-
-#ifdef _WIN32
-#include <crtdbg.h>
-#endif
-
-namespace tgc {
-namespace details {
-
-#ifndef TGC_MULTI_THREADED
-shared_mutex ClassMeta::mutex;
-#endif
-atomic<int> ClassMeta::isCreatingObj = 0;
-ClassMeta ClassMeta::dummy;
-char* ObjMeta::dummyObjPtr = nullptr;
-Collector* Collector::inst = nullptr;
-
-static const char* StateStr[(int)Collector::State::MaxCnt] = {
-    "RootMarking", "LeafMarking", "Sweeping"};
-
-//////////////////////////////////////////////////////////////////////////
-
-char* ObjMeta::objPtr() const {
-  return klass == &ClassMeta::dummy ? dummyObjPtr
-                                    : (char*)this + sizeof(ObjMeta);
-}
-
-void ObjMeta::destroy() {
-  if (!arrayLength)
-    return;
-  klass->memHandler(klass, ClassMeta::MemRequest::Dctor, this);
-  arrayLength = 0;
-}
-
-void ObjMeta::operator delete(void* p) {
-  auto* m = (ObjMeta*)p;
-  m->klass->memHandler(m->klass, ClassMeta::MemRequest::Dealloc, m);
-}
-
-bool ObjMeta::operator<(ObjMeta& r) const {
-  return objPtr() + klass->size * arrayLength <
-         r.objPtr() + r.klass->size * r.arrayLength;
-}
-
-bool ObjMeta::containsPtr(char* p) {
-  auto* o = objPtr();
-  return o <= p && p < o + klass->size * arrayLength;
-}
-
-//////////////////////////////////////////////////////////////////////////
-
-const PtrBase* ObjPtrEnumerator::getNext() {
-  if (auto* subPtrs = meta->klass->subPtrOffsets) {
-    if (arrayElemIdx < meta->arrayLength && subPtrIdx < subPtrs->size()) {
-      auto* klass = meta->klass;
-      auto* obj = meta->objPtr() + arrayElemIdx * klass->size;
-      auto* subPtr = obj + (*klass->subPtrOffsets)[subPtrIdx];
-      if (subPtrIdx++ >= klass->subPtrOffsets->size())
-        arrayElemIdx++;
-      return (PtrBase*)subPtr;
-    }
-  }
-  return nullptr;
-}
-
-//////////////////////////////////////////////////////////////////////////
-
-PtrBase::PtrBase() : isRoot(1) {
-  auto* c = Collector::inst ? Collector::inst : Collector::get();
-  c->registerPtr(this);
-}
-
-PtrBase::PtrBase(void* obj) : isRoot(1) {
-  auto* c = Collector::inst ? Collector::inst : Collector::get();
-  meta = c->globalFindOwnerMeta(obj);
-  c->registerPtr(this);
-}
-
-PtrBase::~PtrBase() {
-  Collector::inst->unregisterPtr(this);
-}
-
-void PtrBase::onPtrChanged() {
-  Collector::inst->onPointerChanged(this);
-}
-
-//////////////////////////////////////////////////////////////////////////
-
-ObjMeta* ClassMeta::newMeta(size_t objCnt) {
-  assert(memHandler && "should not be called in global scope (before main)");
-  auto* meta = (ObjMeta*)memHandler(this, MemRequest::Alloc,
-                                    reinterpret_cast<void*>(objCnt));
-
-  try {
-    auto* c = Collector::inst ? Collector::inst : Collector::get();
-    // Allow using gc_from(this) in the constructor of the creating object.
-    c->addMeta(meta);
-  } catch (std::bad_alloc&) {
-    memHandler(this, MemRequest::Dealloc, meta);
-    throw;
-  }
-
-  isCreatingObj++;
-  return meta;
-}
-
-void ClassMeta::endNewMeta(ObjMeta* meta, bool failed) {
-  isCreatingObj--;
-  if (!failed) {
-    unique_lock lk{mutex};
-    state = ClassMeta::State::Registered;
-  }
-
-  {
-    auto* c = Collector::inst;
-    unique_lock lk{c->mutex, try_to_lock};
-    c->creatingObjs.remove(meta);
-    if (failed) {
-      c->metaSet.erase(meta);
-      memHandler(this, MemRequest::Dealloc, meta);
-    }
-  }
-}
-
-void ClassMeta::registerSubPtr(ObjMeta* owner, PtrBase* p) {
-  auto offset = (OffsetType)((char*)p - owner->objPtr());
-
-  {
-    shared_lock lk{mutex};
-
-    if (state == ClassMeta::State::Registered)
-      return;
-    // constructor recursed.
-    if (subPtrOffsets && offset <= subPtrOffsets->back())
-      return;
-  }
-
-  unique_lock lk{mutex};
-  if (!subPtrOffsets)
-    subPtrOffsets = new vector<OffsetType>();
-  subPtrOffsets->push_back(offset);
-}
-
-//////////////////////////////////////////////////////////////////////////
-
-Collector::Collector() {
-  pointers.reserve(1024 * 5);
-  grayObjs.reserve(1024 * 2);
-  metaSet.reserve(1024 * 5);
-}
-
-Collector::~Collector() {
-  for (auto i = metaSet.begin(); i != metaSet.end();) {
-    delete *i;
-    i = metaSet.erase(i);
-  }
-}
-
-Collector* Collector::get() {
-  if (!inst) {
-#ifdef _WIN32
-    _CrtSetDbgFlag(_CRTDBG_ALLOC_MEM_DF | _CRTDBG_LEAK_CHECK_DF);
-#endif
-
-    inst = new Collector();
-    atexit([] { delete inst; });
-  }
-  return inst;
-}
-
-void Collector::addMeta(ObjMeta* meta) {
-  unique_lock lk{mutex, try_to_lock};
-  metaSet.insert(meta);
-  creatingObjs.push_back(meta);
-}
-
-void Collector::registerPtr(PtrBase* p) {
-  p->index = pointers.size();
-  {
-    unique_lock lk{mutex, try_to_lock};
-    pointers.push_back(p);
-  }
-
-  if (ClassMeta::isCreatingObj > 0) {
-    if (auto* owner = findCreatingObj(p)) {
-      p->isRoot = 0;
-      owner->klass->registerSubPtr(owner, p);
-    }
-  }
-}
-
-void Collector::unregisterPtr(PtrBase* p) {
-  PtrBase* pointer;
-  {
-    unique_lock lk{mutex, try_to_lock};
-
-    if (p == pointers.back()) {
-      pointers.pop_back();
-      return;
-    } else {
-      swap(pointers[p->index], pointers.back());
-      pointer = pointers[p->index];
-      pointers.pop_back();
-      pointer->index = p->index;
-    }
-  }
-  if (!pointer->meta)
-    return;
-  shared_lock lk{mutex, try_to_lock};
-  if (state == State::RootMarking) {
-    if (p->index < nextRootMarking) {
-      tryMarkRoot(pointer);
-    }
-  }
-}
-
-void Collector::tryMarkRoot(PtrBase* p) {
-  if (p->isRoot == 1) {
-    if (p->meta->color == ObjMeta::Color::White) {
-      p->meta->color = ObjMeta::Color::Gray;
-
-      unique_lock lk{mutex, try_to_lock};
-      grayObjs.push_back(p->meta);
-    }
-  }
-}
-
-void Collector::onPointerChanged(PtrBase* p) {
-  if (!p->meta)
-    return;
-
-  shared_lock lk{mutex, try_to_lock};
-  switch (state) {
-    case State::RootMarking:
-      if (p->index < nextRootMarking)
-        tryMarkRoot(p);
-      break;
-    case State::LeafMarking:
-      tryMarkRoot(p);
-      break;
-    case State::Sweeping:
-      if (p->meta->color == ObjMeta::Color::White) {
-        // if (*p->meta < **nextSweeping) {
-        // already passed sweeping stage.
-        //} else {
-        // delay to the next collection.
-        p->meta->color = ObjMeta::Color::Black;
-        //}
-      }
-      break;
-  }
-}
-
-ObjMeta* Collector::findCreatingObj(PtrBase* p) {
-  shared_lock lk{mutex, try_to_lock};
-  // owner may not be the current one(e.g. constructor recursed)
-  for (auto i = creatingObjs.rbegin(); i != creatingObjs.rend(); ++i) {
-    if ((*i)->containsPtr((char*)p))
-      return *i;
-  }
-  return nullptr;
-}
-
-ObjMeta* Collector::globalFindOwnerMeta(void* obj) {
-  shared_lock lk{mutex, try_to_lock};
-  auto* meta = (ObjMeta*)((char*)obj - sizeof(ObjMeta));
-  return meta;
-}
-
-void Collector::collect(int stepCnt) {
-  unique_lock lk{mutex};
-
-  freeObjCntOfPrevGc = 0;
-
-  switch (state) {
-  _RootMarking:
-  case State::RootMarking:
-    for (; nextRootMarking < pointers.size() && stepCnt-- > 0;
-         nextRootMarking++) {
-      auto p = pointers[nextRootMarking];
-      auto meta = p->meta;
-      if (!meta)
-        continue;
-      // for containers
-      auto it = meta->klass->enumPtrs(meta);
-      for (; auto* ptr = it->getNext(); stepCnt--) {
-        ptr->isRoot = 0;
-      }
-      delete it;
-      tryMarkRoot(p);
-    }
-    if (nextRootMarking >= pointers.size()) {
-      state = State::LeafMarking;
-      nextRootMarking = 0;
-      goto _ChildMarking;
-    }
-    break;
-
-  _ChildMarking:
-  case State::LeafMarking:
-    while (grayObjs.size() && stepCnt-- > 0) {
-      ObjMeta* o = grayObjs.back();
-      grayObjs.pop_back();
-      o->color = ObjMeta::Color::Black;
-
-      auto cls = o->klass;
-      auto it = cls->enumPtrs(o);
-      for (; auto* ptr = it->getNext(); stepCnt--) {
-        auto* meta = ptr->meta;
-        if (!meta)
-          continue;
-        if (meta->color == ObjMeta::Color::White) {
-          meta->color = ObjMeta::Color::Gray;
-          grayObjs.push_back(meta);
-        }
-      }
-      delete it;
-    }
-    if (!grayObjs.size()) {
-      state = State::Sweeping;
-      nextSweeping = metaSet.begin();
-      goto _Sweeping;
-    }
-    break;
-
-  _Sweeping:
-  case State::Sweeping:
-    for (; nextSweeping != metaSet.end() && stepCnt-- > 0;) {
-      ObjMeta* meta = *nextSweeping;
-      if (meta->color == ObjMeta::Color::White) {
-        nextSweeping = metaSet.erase(nextSweeping);
-        delete meta;
-        freeObjCntOfPrevGc++;
-        continue;
-      }
-      meta->color = ObjMeta::Color::White;
-      ++nextSweeping;
-    }
-    if (nextSweeping == metaSet.end()) {
-      state = State::RootMarking;
-      if (metaSet.size())
-        goto _RootMarking;
-    }
-    break;
-  }
-}
-
-void Collector::dumpStats() {
-  shared_lock lk{mutex, try_to_lock};
-
-  printf("========= [gc] ========\n");
-  printf("[total pointers ] %3d\n", (unsigned)pointers.size());
-  printf("[total meta     ] %3d\n", (unsigned)metaSet.size());
-  printf("[total gray meta] %3d\n", (unsigned)grayObjs.size());
-  auto liveCnt = 0;
-  for (auto i : metaSet)
-    if (i->arrayLength)
-      liveCnt++;
-  printf("[live objects   ] %3d\n", liveCnt);
-  printf("[last freed objs] %3d\n", freeObjCntOfPrevGc);
-  printf("[collector state] %s\n", StateStr[(int)state]);
-  printf("=======================\n");
-}
-
-}  // namespace details
-}  // namespace tgc
+#include "tgc.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <crtdbg.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if __has_include(<execinfo.h>)
+#include <execinfo.h>
+#define TGC_HAS_EXECINFO
+#endif
+
+#if __has_include(<cxxabi.h>)
+#include <cxxabi.h>
+#define TGC_HAS_CXXABI
+#endif
+
+namespace tgc {
+namespace details {
+
+#ifndef TGC_MULTI_THREADED
+shared_mutex ClassMeta::mutex;
+#endif
+atomic<int> ClassMeta::isCreatingObj = 0;
+atomic<int> PtrBase::regionCnt = 0;
+ClassMeta ClassMeta::dummy;
+static ClassMeta* firstClassChunk[ClassMeta::TableChunkSize] = {
+    &ClassMeta::dummy};
+ClassMeta** ClassMeta::table[1024] = {firstClassChunk};
+char* ObjMeta::dummyObjPtr = nullptr;
+Collector* Collector::inst = nullptr;
+
+static const char* StateStr[(int)Collector::State::MaxCnt] = {
+    "RootMarking", "LeafMarking", "Sweeping"};
+static const char* TraceEventStr[(int)Collector::State::MaxCnt + 1] = {
+    "RootMarking", "LeafMarking", "Sweeping", "gc_collect"};
+
+// targets of the pointers in swept objects may be freed already, changes of
+// them are not tracked.
+static thread_local bool inSweep = false;
+
+#ifdef TGC_DEFERRED_RC
+// counting operations buffered by a thread before applying them.
+static const size_t RcLogCapacity = 1024;
+// the log of the thread is destroyed, e.g. pointers in thread_local objects.
+static thread_local bool rcLogDead = false;
+#ifdef TGC_MULTI_THREADED
+// log held by PtrBase::RcLogScope, flushed once released if it fills up.
+static thread_local Collector::RcLog* heldRcLog = nullptr;
+static thread_local bool rcFlushWanted = false;
+#endif
+#endif
+
+static uint64_t nowNs() {
+  return (uint64_t)chrono::duration_cast<chrono::nanoseconds>(
+             chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+char* ObjMeta::objPtr() const {
+  return klass() == &ClassMeta::dummy ? dummyObjPtr
+                                      : (char*)this + headerSize(arrayLength);
+}
+
+size_t ObjMeta::allocSize() const {
+  auto n = length();
+  return headerSize(n) + klass()->size * n;
+}
+
+void ObjMeta::destroy() {
+  if (destroyed)
+    return;
+  auto* cls = klass();
+  cls->memHandler(cls, ClassMeta::MemRequest::Dctor, this);
+  destroyed = true;
+}
+
+void ObjMeta::operator delete(void* p) {
+  auto* m = (ObjMeta*)p;
+  auto* cls = m->klass();
+  cls->memHandler(cls, ClassMeta::MemRequest::Dealloc, m);
+}
+
+bool ObjMeta::operator<(ObjMeta& r) const {
+  return objPtr() + klass()->size * length() <
+         r.objPtr() + r.klass()->size * r.length();
+}
+
+bool ObjMeta::containsPtr(char* p) {
+  auto* o = objPtr();
+  return o <= p && p < o + klass()->size * length();
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+char* Heap::base = nullptr;
+Heap::Page* Heap::pages = nullptr;
+
+namespace {
+
+struct SizeClass {
+  uint32_t size = 0;
+  void* freeList = nullptr;
+  // bump allocation in the last page.
+  char *cursor = nullptr, *end = nullptr;
+  vector<uint32_t> pages, unswept;
+};
+
+struct LargeObj {
+  size_t size;
+  bool unswept, buffer;
+};
+
+struct Image {
+  size_t size;
+  // sorted offsets of the objects.
+  vector<size_t> objs;
+  // owner of the arena chunks, objects not freed yet of adopted ones.
+  Heap::Arena* arena = nullptr;
+  size_t live = 0;
+};
+
+struct FreeSpan {
+  size_t first;
+  size_t freedCycle;
+  bool committed;
+};
+
+constexpr size_t UsedWords = Heap::PageSize / 16 / 64;
+
+mutex heapMutex;
+vector<SizeClass> sizeClasses, bufferClasses;
+// size in 16 bytes units -> size class.
+vector<unsigned char> sizeToClass;
+// page count -> span.
+multimap<size_t, FreeSpan> freeSpans;
+size_t nextPage = 1;  // page 0 is not used so ref 0 means null.
+map<char*, LargeObj> largeObjects;
+map<char*, Image> images;
+char* largeSweepCursor = nullptr;
+size_t largeBytes = 0;
+size_t cycle = 0, trimIdleCycles = 2, trimRetainedBytes = SIZE_MAX;
+size_t committedBytes = 0, retainedBytes = 0, trimmedBytes = 0;
+thread_local Heap::Arena* threadArena = nullptr;
+
+void* reserve(size_t size) {
+#ifdef _WIN32
+  return VirtualAlloc(nullptr, size, MEM_RESERVE, PAGE_NOACCESS);
+#else
+  auto* p = mmap(nullptr, size, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  return p == MAP_FAILED ? nullptr : p;
+#endif
+}
+
+bool commit(void* p, size_t size) {
+#ifdef _WIN32
+  return VirtualAlloc(p, size, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+#else
+  return mprotect(p, size, PROT_READ | PROT_WRITE) == 0;
+#endif
+}
+
+// returns the memory to the OS, the range stays reserved.
+void decommit(void* p, size_t size) {
+#ifdef _WIN32
+  VirtualFree(p, size, MEM_DECOMMIT);
+#else
+  madvise(p, size, MADV_DONTNEED);
+#endif
+}
+
+void protect(void* p, size_t size) {
+#ifdef _WIN32
+  DWORD old;
+  VirtualProtect(p, size, PAGE_READONLY, &old);
+#else
+  mprotect(p, size, PROT_READ);
+#endif
+}
+
+#ifndef TGC_COMPRESSED_PTRS
+void* mapLarge(size_t size) {
+#ifdef _WIN32
+  return VirtualAlloc(nullptr, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+  auto* p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return p == MAP_FAILED ? nullptr : p;
+#endif
+}
+
+void unmapLarge(void* p, size_t size) {
+#ifdef _WIN32
+  VirtualFree(p, 0, MEM_RELEASE);
+#else
+  munmap(p, size);
+#endif
+}
+#endif
+
+void releaseSpan(char* base, size_t cnt, FreeSpan& span) {
+  auto bytes = cnt << Heap::PageBits;
+  decommit(base + (span.first << Heap::PageBits), bytes);
+  span.committed = false;
+  committedBytes -= bytes;
+  retainedBytes -= bytes;
+  trimmedBytes += bytes;
+}
+
+void addFreeSpan(char* base, size_t cnt, FreeSpan span) {
+  if (span.committed)
+    retainedBytes += cnt << Heap::PageBits;
+  if (span.committed && !trimIdleCycles)
+    releaseSpan(base, cnt, span);
+  freeSpans.emplace(cnt, span);
+}
+
+size_t allocPages(char* base, size_t cnt) {
+  FreeSpan span{};
+  auto i = freeSpans.lower_bound(cnt);
+  if (i != freeSpans.end()) {
+    span = i->second;
+    auto avail = i->first;
+    freeSpans.erase(i);
+    if (span.committed)
+      retainedBytes -= avail << Heap::PageBits;
+    if (avail > cnt)
+      addFreeSpan(base, avail - cnt,
+                  {span.first + cnt, span.freedCycle, span.committed});
+    if (span.committed)
+      return span.first;
+  } else {
+    if ((nextPage + cnt) << Heap::PageBits > Heap::ReservedSize)
+      throw gc_heap_exhausted();
+    span.first = nextPage;
+    nextPage += cnt;
+  }
+  if (!commit(base + (span.first << Heap::PageBits), cnt << Heap::PageBits))
+    throw std::bad_alloc();
+  committedBytes += cnt << Heap::PageBits;
+  return span.first;
+}
+
+SizeClass& classOf(size_t size, bool buffer = false) {
+  return (buffer ? bufferClasses : sizeClasses)[sizeToClass[size / 16]];
+}
+
+size_t slotOf(const Heap::Page& page, size_t offset) {
+  return (size_t)(((uint64_t)(offset & (Heap::PageSize - 1)) * page.recip) >>
+                  32);
+}
+
+int lowestBit(uint64_t v) {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+  unsigned long i;
+  _BitScanForward64(&i, v);
+  return (int)i;
+#elif defined(_MSC_VER)
+  // no 64-bit scan on 32-bit targets.
+  unsigned long i;
+  if (_BitScanForward(&i, (uint32_t)v))
+    return (int)i;
+  _BitScanForward(&i, (uint32_t)(v >> 32));
+  return (int)i + 32;
+#else
+  return __builtin_ctzll(v);
+#endif
+}
+
+void prefetch(const void* p) {
+#ifdef _MSC_VER
+  PreFetchCacheLine(PF_TEMPORAL_LEVEL_1, p);
+#else
+  __builtin_prefetch(p);
+#endif
+}
+
+bool hasFreeSlot(const SizeClass& sc) {
+  return sc.freeList || sc.cursor + sc.size <= sc.end;
+}
+
+// the new page is the one of bump allocation.
+void addPage(char* base, Heap::Page* pages, SizeClass& sc, bool buffer) {
+  auto first = allocPages(base, 1);
+  auto* used = (uint64_t*)calloc(UsedWords, sizeof(uint64_t));
+  if (!used) {
+    addFreeSpan(base, 1, {first, cycle, true});
+    throw std::bad_alloc();
+  }
+  pages[first] = {sc.size,
+                  (uint32_t)((((uint64_t)1 << 32) + sc.size - 1) / sc.size),
+                  (uint32_t)first, false, buffer, used};
+  sc.pages.push_back((uint32_t)first);
+  sc.cursor = base + (first << Heap::PageBits);
+  sc.end = sc.cursor + Heap::PageSize;
+}
+
+void setUsed(char* base, Heap::Page* pages, char* p) {
+  auto offset = (size_t)(p - base);
+  auto& page = pages[offset >> Heap::PageBits];
+  auto slot = slotOf(page, offset);
+  page.used[slot / 64] |= (uint64_t)1 << (slot % 64);
+}
+
+bool isEmpty(const Heap::Page& page) {
+  for (size_t w = 0; w < UsedWords; w++) {
+    if (page.used[w])
+      return false;
+  }
+  return true;
+}
+
+void addFreeSlots(char* base, const Heap::Page& page, size_t idx,
+                  SizeClass& sc) {
+  auto* start = base + (idx << Heap::PageBits);
+  for (size_t slot = Heap::PageSize / page.slotSize; slot-- > 0;) {
+    if (!(page.used[slot / 64] & ((uint64_t)1 << (slot % 64)))) {
+      auto* p = start + slot * page.slotSize;
+      *(void**)p = sc.freeList;
+      sc.freeList = p;
+    }
+  }
+}
+
+template <typename F>
+void forEachUsed(char* base, const Heap::Page& page, size_t idx, F f) {
+  auto* start = base + (idx << Heap::PageBits);
+  for (size_t w = 0; w < UsedWords; w++) {
+    for (auto bits = page.used[w]; bits; bits &= bits - 1) {
+      auto slot = w * 64 + lowestBit(bits);
+      f((ObjMeta*)(start + slot * page.slotSize));
+    }
+  }
+}
+
+}  // namespace
+
+void Heap::init() {
+  // 16 bytes steps up to 256, then 4 classes per doubling.
+  sizeClasses.emplace_back();
+  for (uint32_t sz = 16, step = 16; sz <= MaxSmallSize; sz += step) {
+    sizeClasses.emplace_back();
+    sizeClasses.back().size = sz;
+    if (sz >= 256 && !(sz & (sz - 1)))
+      step = sz / 4;
+  }
+  sizeToClass.resize(MaxSmallSize / 16 + 1);
+  size_t cls = 1;
+  for (size_t i = 1; i < sizeToClass.size(); i++) {
+    while (sizeClasses[cls].size < i * 16)
+      cls++;
+    sizeToClass[i] = (unsigned char)cls;
+  }
+  bufferClasses = sizeClasses;
+
+  auto* p = (char*)reserve(ReservedSize + PageSize);
+  if (!p)
+    throw gc_heap_exhausted();
+  base = (char*)(((size_t)p + PageSize - 1) & ~(PageSize - 1));
+  pages = (Page*)calloc(ReservedSize >> PageBits, sizeof(Page));
+  if (!pages)
+    throw std::bad_alloc();
+}
+
+void* Heap::alloc(size_t size, bool buffer) {
+  unique_lock lk{heapMutex};
+  if (!base)
+    init();
+  return allocLocked(size, buffer);
+}
+
+void Heap::allocBatch(size_t size, size_t cnt, void** out) {
+  unique_lock lk{heapMutex};
+  if (!base)
+    init();
+
+  size = (size + 15) & ~(size_t)15;
+  size_t i = 0;
+  if (threadArena || size > MaxSmallSize) {
+    try {
+      for (; i < cnt; i++)
+        out[i] = allocLocked(size, false);
+    } catch (std::bad_alloc&) {
+      while (i > 0)
+        freeLocked(out[--i]);
+      throw;
+    }
+    return;
+  }
+
+  // free slots are left to single allocations.
+  auto& sc = classOf(size);
+  try {
+    for (; i < cnt; i++) {
+      if (sc.cursor + sc.size > sc.end)
+        addPage(base, pages, sc, false);
+      out[i] = sc.cursor;
+      sc.cursor += sc.size;
+      setUsed(base, pages, sc.cursor - sc.size);
+    }
+  } catch (std::bad_alloc&) {
+    while (i > 0)
+      freeLocked(out[--i]);
+    throw;
+  }
+}
+
+void* Heap::allocLocked(size_t size, bool buffer) {
+  size = (size + 15) & ~(size_t)15;
+  if (threadArena && !buffer)
+    return allocArena(*threadArena, size);
+  if (size > MaxSmallSize) {
+    auto mapped = (size + PageSize - 1) & ~(PageSize - 1);
+#ifdef TGC_COMPRESSED_PTRS
+    auto cnt = mapped >> PageBits;
+    auto first = allocPages(base, cnt);
+    for (size_t i = 0; i < cnt; i++)
+      pages[first + i] = {0, 0, (uint32_t)first, false, false, {nullptr}};
+    auto* p = base + (first << PageBits);
+#else
+    auto* p = (char*)mapLarge(mapped);
+    if (!p)
+      throw std::bad_alloc();
+    committedBytes += mapped;
+#endif
+    largeObjects.emplace(p, LargeObj{mapped, false, buffer});
+    if (!buffer)
+      largeBytes += mapped;
+    return p;
+  }
+
+  auto& sc = classOf(size, buffer);
+  char* p;
+  if ((p = (char*)sc.freeList)) {
+    sc.freeList = *(void**)p;
+  } else {
+    if (sc.cursor + sc.size > sc.end)
+      addPage(base, pages, sc, buffer);
+    p = sc.cursor;
+    sc.cursor += sc.size;
+  }
+  setUsed(base, pages, p);
+  return p;
+}
+
+void Heap::free(void* p) {
+  unique_lock lk{heapMutex};
+  freeLocked(p);
+}
+
+void Heap::freeLocked(void* p) {
+  auto offset = (size_t)((char*)p - base);
+  if (offset >= ReservedSize || !pages[offset >> PageBits].slotSize) {
+    auto i = largeObjects.find((char*)p);
+    if (i == largeObjects.end()) {
+      // objects of arenas not adopted are freed with them.
+      auto j = --images.upper_bound((char*)p);
+      if (!j->second.arena && !--j->second.live)
+        releaseArenaChunk(j->first);
+      return;
+    }
+    auto mapped = i->second.size;
+    if (!i->second.buffer)
+      largeBytes -= mapped;
+    largeObjects.erase(i);
+#ifdef TGC_COMPRESSED_PTRS
+    decommit(p, mapped);
+    auto first = offset >> PageBits, cnt = mapped >> PageBits;
+    for (auto j = first; j < first + cnt; j++)
+      pages[j].spanStart = 0;
+    committedBytes -= mapped;
+    addFreeSpan(base, cnt, {first, cycle, false});
+#else
+    unmapLarge(p, mapped);
+    committedBytes -= mapped;
+#endif
+    return;
+  }
+  auto& page = pages[offset >> PageBits];
+  auto slot = slotOf(page, offset);
+  page.used[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+  if (page.unswept)
+    return;
+  auto& sc = classOf(page.slotSize, page.buffer);
+  *(void**)p = sc.freeList;
+  sc.freeList = p;
+}
+
+size_t Heap::largeObjectBytes() {
+  unique_lock lk{heapMutex};
+  return largeBytes;
+}
+
+ObjMeta* Heap::findLargeMeta(const void* p) {
+  unique_lock lk{heapMutex};
+  auto i = largeObjects.upper_bound((char*)p);
+  if (i != largeObjects.begin() && (char*)p < (--i)->first + i->second.size)
+    return (ObjMeta*)i->first;
+
+  auto j = images.upper_bound((char*)p);
+  if (j == images.begin() || (char*)p >= (--j)->first + j->second.size)
+    return nullptr;
+  auto& objs = j->second.objs;
+  auto k = upper_bound(objs.begin(), objs.end(), (size_t)((char*)p - j->first));
+  return k == objs.begin() ? nullptr : (ObjMeta*)(j->first + *--k);
+}
+
+void Heap::getObjs(vector<ObjMeta*>& objs) {
+  unique_lock lk{heapMutex};
+  auto add = [&](ObjMeta* meta) { objs.push_back(meta); };
+  for (auto& sc : sizeClasses) {
+    for (auto idx : sc.pages)
+      forEachUsed(base, pages[idx], idx, add);
+    for (auto idx : sc.unswept)
+      forEachUsed(base, pages[idx], idx, add);
+  }
+  for (auto& i : largeObjects) {
+    if (!i.second.buffer)
+      objs.push_back((ObjMeta*)i.first);
+  }
+}
+
+void Heap::startSweep() {
+  unique_lock lk{heapMutex};
+  for (auto& sc : sizeClasses) {
+    assert(sc.unswept.empty() && "previous sweeping not finished");
+    // free slots are given back when their pages are swept.
+    sc.freeList = nullptr;
+    sc.cursor = sc.end = nullptr;
+    for (auto idx : sc.pages)
+      pages[idx].unswept = true;
+    sc.unswept.swap(sc.pages);
+  }
+  for (auto& i : largeObjects)
+    i.second.unswept = !i.second.buffer;
+  largeSweepCursor = nullptr;
+}
+
+size_t Heap::takeUnswept(size_t size, vector<ObjMeta*>& objs) {
+  unique_lock lk{heapMutex};
+  objs.clear();
+  SizeClass* sc = nullptr;
+  if (size) {
+    size = (size + 15) & ~(size_t)15;
+    if (!base || size > MaxSmallSize)
+      return 0;
+    sc = &classOf(size);
+    if (hasFreeSlot(*sc) || sc->unswept.empty())
+      return 0;
+  } else {
+    for (auto& i : sizeClasses) {
+      if (i.unswept.size()) {
+        sc = &i;
+        break;
+      }
+    }
+    if (!sc)
+      return 0;
+  }
+  auto idx = sc->unswept.back();
+  sc->unswept.pop_back();
+  forEachUsed(base, pages[idx], idx, [&](ObjMeta* m) { objs.push_back(m); });
+  return idx;
+}
+
+void Heap::endSweep(size_t idx) {
+  unique_lock lk{heapMutex};
+  auto& page = pages[idx];
+  auto& sc = classOf(page.slotSize);
+  page.unswept = false;
+
+  // keep one page for the class rather than taking a new one soon.
+  if (isEmpty(page) && hasFreeSlot(sc)) {
+    ::free(page.used);
+    page = {};
+    addFreeSpan(base, 1, {idx, cycle, true});
+    return;
+  }
+
+  addFreeSlots(base, page, idx, sc);
+  sc.pages.push_back((uint32_t)idx);
+}
+
+void Heap::setTrimPolicy(size_t idleCycles, size_t retainedBytes) {
+  unique_lock lk{heapMutex};
+  trimIdleCycles = idleCycles;
+  trimRetainedBytes = retainedBytes;
+}
+
+size_t Heap::trim() {
+  unique_lock lk{heapMutex};
+  auto before = trimmedBytes;
+  for (auto& i : freeSpans) {
+    if (i.second.committed)
+      releaseSpan(base, i.first, i.second);
+  }
+  return trimmedBytes - before;
+}
+
+void Heap::endCycle() {
+  unique_lock lk{heapMutex};
+  cycle++;
+  for (auto& sc : bufferClasses) {
+    auto empty = [&](uint32_t idx) { return isEmpty(pages[idx]); };
+    if (none_of(sc.pages.begin(), sc.pages.end(), empty))
+      continue;
+    // free lists are rebuilt without the released pages.
+    sc.freeList = nullptr;
+    sc.cursor = sc.end = nullptr;
+    vector<uint32_t> kept;
+    for (auto idx : sc.pages) {
+      auto& page = pages[idx];
+      if (isEmpty(page)) {
+        ::free(page.used);
+        page = {};
+        addFreeSpan(base, 1, {idx, cycle, true});
+        continue;
+      }
+      addFreeSlots(base, page, idx, sc);
+      kept.push_back(idx);
+    }
+    sc.pages.swap(kept);
+  }
+  vector<pair<size_t, FreeSpan*>> kept;
+  for (auto& i : freeSpans) {
+    auto& span = i.second;
+    if (!span.committed)
+      continue;
+    if (cycle - span.freedCycle >= trimIdleCycles)
+      releaseSpan(base, i.first, span);
+    else
+      kept.push_back({i.first, &span});
+  }
+  if (retainedBytes <= trimRetainedBytes)
+    return;
+  sort(kept.begin(), kept.end(), [](auto& a, auto& b) {
+    return a.second->freedCycle < b.second->freedCycle;
+  });
+  for (auto& i : kept) {
+    if (retainedBytes <= trimRetainedBytes)
+      break;
+    releaseSpan(base, i.first, *i.second);
+  }
+}
+
+Heap::Usage Heap::getUsage() {
+  unique_lock lk{heapMutex};
+  return {committedBytes, retainedBytes, trimmedBytes};
+}
+
+char* Heap::allocImage(size_t size, vector<size_t> objOffsets) {
+  unique_lock lk{heapMutex};
+  if (!base)
+    init();
+
+  auto mapped = ((size ? size : 1) + PageSize - 1) & ~(PageSize - 1);
+#ifdef TGC_COMPRESSED_PTRS
+  auto cnt = mapped >> PageBits;
+  auto first = allocPages(base, cnt);
+  for (size_t i = 0; i < cnt; i++)
+    pages[first + i] = {};
+  auto* p = base + (first << PageBits);
+#else
+  auto* p = (char*)mapLarge(mapped);
+  if (!p)
+    throw std::bad_alloc();
+  committedBytes += mapped;
+#endif
+  images.emplace(p, Image{mapped, move(objOffsets)});
+  return p;
+}
+
+void Heap::protectImage(char* p) {
+  unique_lock lk{heapMutex};
+  protect(p, images[p].size);
+}
+
+bool Heap::inImage(const void* p) {
+  unique_lock lk{heapMutex};
+  auto i = images.upper_bound((char*)p);
+  if (i == images.begin() || (char*)p >= (--i)->first + i->second.size)
+    return false;
+  // chunks of arenas, adopted or not, are kept along with the images.
+  return !i->second.arena && !i->second.live;
+}
+
+void Heap::freeImage(char* p) {
+  unique_lock lk{heapMutex};
+  auto i = images.find(p);
+  auto mapped = i->second.size;
+  images.erase(i);
+  committedBytes -= mapped;
+#ifdef TGC_COMPRESSED_PTRS
+  decommit(p, mapped);
+  addFreeSpan(base, mapped >> PageBits,
+              {(size_t)(p - base) >> PageBits, cycle, false});
+#else
+  unmapLarge(p, mapped);
+#endif
+}
+
+Heap::Arena* Heap::setArena(Arena* a) {
+  auto* prev = threadArena;
+  threadArena = a;
+  return prev;
+}
+
+Heap::Arena* Heap::currentArena() {
+  return threadArena;
+}
+
+void* Heap::allocArena(Arena& a, size_t size) {
+  if (a.cursor + size > a.end) {
+    // pages in the reservation are kept for reuse when released.
+    auto mapped = (size + PageSize - 1) & ~(PageSize - 1);
+    auto first = allocPages(base, mapped >> PageBits);
+    for (auto i = first; i < first + (mapped >> PageBits); i++) {
+      pages[i] = {};
+      pages[i].arena = &a;
+    }
+    auto* p = base + (first << PageBits);
+    auto& image = images[p];
+    image.size = mapped;
+    image.arena = &a;
+    a.chunks.push_back(p);
+    a.cursor = p;
+    a.end = p + mapped;
+    a.objs = &image.objs;
+  }
+  auto* p = a.cursor;
+  a.objs->push_back((size_t)(p - a.chunks.back()));
+  a.cursor += size;
+  return p;
+}
+
+void Heap::freeArena(Arena& a) {
+  unique_lock lk{heapMutex};
+  for (auto* p : a.chunks)
+    releaseArenaChunk(p);
+  a = {};
+}
+
+void Heap::adoptArena(Arena& a) {
+  unique_lock lk{heapMutex};
+  for (auto* p : a.chunks) {
+    auto i = images.find(p);
+    i->second.arena = nullptr;
+    i->second.live = i->second.objs.size();
+    auto first = (size_t)(p - base) >> PageBits;
+    for (auto j = first; j < first + (i->second.size >> PageBits); j++)
+      pages[j].arena = nullptr;
+  }
+  a = {};
+}
+
+void Heap::releaseArenaChunk(char* p) {
+  auto i = images.find(p);
+  auto first = (size_t)(i->first - base) >> PageBits;
+  auto cnt = i->second.size >> PageBits;
+  for (auto j = first; j < first + cnt; j++)
+    pages[j] = {};
+  addFreeSpan(base, cnt, {first, cycle, true});
+  images.erase(i);
+}
+
+ObjMeta* Heap::takeUnsweptLarge() {
+  unique_lock lk{heapMutex};
+  for (auto i = largeObjects.lower_bound(largeSweepCursor);
+       i != largeObjects.end(); ++i) {
+    if (i->second.unswept) {
+      i->second.unswept = false;
+      largeSweepCursor = i->first;
+      return (ObjMeta*)i->first;
+    }
+  }
+  largeSweepCursor = nullptr;
+  return nullptr;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+size_t PauseHistogram::bucketOf(uint64_t ns) {
+  if (ns < SubBucketCnt)
+    return (size_t)ns;
+  int msb = 0;
+  for (auto v = ns; v >>= 1;)
+    msb++;
+  auto shift = msb - SubBucketBits;
+  auto sub = (ns >> shift) & (SubBucketCnt - 1);
+  return SubBucketCnt + shift * SubBucketCnt + (size_t)sub;
+}
+
+uint64_t PauseHistogram::bucketUpperBound(size_t idx) {
+  if (idx < SubBucketCnt)
+    return idx;
+  auto shift = (idx - SubBucketCnt) / SubBucketCnt;
+  auto sub = (uint64_t)((idx - SubBucketCnt) % SubBucketCnt);
+  auto lower = (1ull << (shift + SubBucketBits)) | (sub << shift);
+  return lower + (1ull << shift) - 1;
+}
+
+void PauseHistogram::record(uint64_t ns) {
+  buckets[bucketOf(ns)]++;
+  totalCnt++;
+  totalNs += ns;
+  if (ns > maxNs)
+    maxNs = ns;
+}
+
+void PauseHistogram::reset() {
+  *this = PauseHistogram();
+}
+
+uint64_t PauseHistogram::percentile(double pct) const {
+  if (!totalCnt)
+    return 0;
+  auto target = (uint64_t)(pct / 100 * totalCnt + 0.5);
+  if (target < 1)
+    target = 1;
+  uint64_t cnt = 0;
+  for (size_t i = 0; i < BucketCnt; i++) {
+    cnt += buckets[i];
+    if (cnt >= target) {
+      auto v = bucketUpperBound(i);
+      return v < maxNs ? v : maxNs;
+    }
+  }
+  return maxNs;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+void SurvivalStats::add(bool survived) {
+  if (survived)
+    survivedObjs++;
+  else
+    diedObjs++;
+  windowSurvived += survived;
+  if (++windowObjs == Window) {
+    pretenured = windowSurvived * 10 >= Window * 9;
+    windowObjs = windowSurvived = 0;
+  }
+}
+
+size_t gc_site::allocatedObjs() const {
+  auto* c = Collector::get();
+  unique_lock lk{c->mutex};
+  return allocCnt;
+}
+
+SurvivalStats gc_site::survival() const {
+  auto* c = Collector::get();
+  unique_lock lk{c->mutex};
+  return stats;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+void HeapProfiler::addClass(ClassMeta* cls) {
+  assert(cls->index == classes.size());
+  classes.emplace_back();
+  classes.back().klass = cls;
+}
+
+void HeapProfiler::onAlloc(ObjMeta* meta, gc_site* site) {
+  auto& c = classes[meta->klass()->index];
+  auto sz = meta->allocSize();
+  c.allocatedObjs++;
+  c.allocatedBytes += sz;
+  c.liveObjs++;
+  c.liveBytes += sz;
+
+  if (site) {
+    if (!site->listed) {
+      site->listed = true;
+      tagSites.push_back(site);
+    }
+    site->allocCnt++;
+    meta->sited = 1;
+    sitedObjs[meta] = site;
+  }
+
+  if (sampling && ++allocsSinceSample >= sampleInterval) {
+    allocsSinceSample = 0;
+    sample(meta);
+  }
+}
+
+void HeapProfiler::onFree(ObjMeta* meta) {
+  auto& c = classes[meta->klass()->index];
+  auto sz = meta->allocSize();
+  c.liveObjs--;
+  c.liveBytes -= sz;
+
+  if (meta->sampled) {
+    auto i = sampledObjs.find(meta);
+    auto& site = sites[i->second];
+    site.liveObjs--;
+    site.liveBytes -= sz;
+    sampledObjs.erase(i);
+  }
+
+  if (!meta->aged) {
+    c.survival.add(false);
+    if (meta->sited) {
+      auto i = sitedObjs.find(meta);
+      i->second->stats.add(false);
+      sitedObjs.erase(i);
+    }
+  }
+}
+
+void HeapProfiler::onSurvived(ObjMeta* meta) {
+  meta->aged = 1;
+  classes[meta->klass()->index].survival.add(true);
+  if (meta->sited) {
+    meta->sited = 0;
+    auto i = sitedObjs.find(meta);
+    i->second->stats.add(true);
+    sitedObjs.erase(i);
+  }
+}
+
+bool HeapProfiler::isPretenured(ClassMeta* cls, gc_site* site) {
+  if (site)
+    return site->stats.pretenured;
+  return classes[cls->index].survival.pretenured;
+}
+
+void HeapProfiler::onBufferAlloc(ObjMeta* owner, size_t bytes) {
+  auto& c = classes[owner->klass()->index];
+  c.allocatedBytes += bytes;
+  c.liveBytes += bytes;
+}
+
+void HeapProfiler::onBufferFree(ObjMeta* owner, size_t bytes) {
+  classes[owner->klass()->index].liveBytes -= bytes;
+}
+
+void HeapProfiler::sample(ObjMeta* meta) {
+  void* frames[Site::MaxFrames];
+  int frameCnt = 0;
+#if defined(TGC_HAS_EXECINFO)
+  frameCnt = backtrace(frames, Site::MaxFrames);
+#elif defined(_WIN32)
+  frameCnt = RtlCaptureStackBackTrace(0, Site::MaxFrames, frames, nullptr);
+#endif
+
+  // FNV-1a over the frames and the class.
+  size_t key = 14695981039346656037ull;
+  auto mix = [&](size_t v) { key = (key ^ v) * 1099511628211ull; };
+  mix((size_t)meta->klass());
+  for (int i = 0; i < frameCnt; i++)
+    mix((size_t)frames[i]);
+
+  auto& site = sites[key];
+  if (!site.klass) {
+    site.klass = meta->klass();
+    site.frameCnt = frameCnt;
+    copy(frames, frames + frameCnt, site.frames);
+  }
+  auto sz = meta->allocSize();
+  site.allocatedObjs++;
+  site.allocatedBytes += sz;
+  site.liveObjs++;
+  site.liveBytes += sz;
+
+  meta->sampled = 1;
+  sampledObjs[meta] = key;
+}
+
+void HeapProfiler::start(size_t interval) {
+  for (auto& i : sampledObjs)
+    i.first->sampled = 0;
+  sampledObjs.clear();
+  sites.clear();
+  sampleInterval = interval ? interval : 1;
+  allocsSinceSample = 0;
+  sampling = true;
+}
+
+void HeapProfiler::stop() {
+  sampling = false;
+}
+
+vector<HeapProfiler::ClassStats> HeapProfiler::getClassStats() {
+  return vector<ClassStats>(classes.begin() + 1, classes.end());
+}
+
+string HeapProfiler::className(ClassMeta* cls) {
+  auto* name = cls->typeInfo().name();
+#ifdef TGC_HAS_CXXABI
+  int status = 0;
+  if (auto* s = abi::__cxa_demangle(name, nullptr, nullptr, &status)) {
+    string r = s;
+    free(s);
+    return r;
+  }
+#endif
+  return name;
+}
+
+void HeapProfiler::report() {
+  auto cls = getClassStats();
+  sort(cls.begin(), cls.end(), [](auto& a, auto& b) {
+    return a.liveBytes > b.liveBytes;
+  });
+
+  // share of the objects surviving their first sweep, * for pretenured.
+  auto survival = [](const SurvivalStats& s) {
+    char buf[16] = "-";
+    if (auto n = s.survivedObjs + s.diedObjs)
+      snprintf(buf, sizeof(buf), "%zu%%%s", s.survivedObjs * 100 / n,
+               s.pretenured ? "*" : "");
+    return string(buf);
+  };
+
+  printf("========= [gc heap] ========\n");
+  printf("%10s %12s %10s %12s %9s  %s\n", "live objs", "live bytes", "objs",
+         "bytes", "survived", "type");
+  for (auto& c : cls) {
+    printf("%10zu %12zu %10zu %12zu %9s  %s\n", c.liveObjs, c.liveBytes,
+           c.allocatedObjs, c.allocatedBytes, survival(c.survival).c_str(),
+           className(c.klass).c_str());
+  }
+
+  if (tagSites.size()) {
+    printf("--------- gc_site ---------\n");
+    for (auto* site : tagSites) {
+      printf("%10s %12s %10zu %12s %9s  %s\n", "", "", site->allocCnt, "",
+             survival(site->stats).c_str(), site->name);
+    }
+  }
+
+  if (sites.size()) {
+    vector<Site*> top;
+    for (auto& i : sites)
+      top.push_back(&i.second);
+    sort(top.begin(), top.end(),
+         [](auto* a, auto* b) { return a->liveBytes > b->liveBytes; });
+    if (top.size() > 10)
+      top.resize(10);
+
+    printf("--------- sampled sites (1 of %zu allocations) ---------\n",
+           sampleInterval);
+    for (auto* site : top) {
+      printf("%10zu %12zu %10zu %12zu  %s\n", site->liveObjs * sampleInterval,
+             site->liveBytes * sampleInterval,
+             site->allocatedObjs * sampleInterval,
+             site->allocatedBytes * sampleInterval,
+             className(site->klass).c_str());
+#ifdef TGC_HAS_EXECINFO
+      auto* symbols = backtrace_symbols(site->frames, site->frameCnt);
+      for (int i = 0; symbols && i < site->frameCnt; i++)
+        printf("%14s%s\n", "", symbols[i]);
+      free(symbols);
+#endif
+    }
+  }
+  printf("============================\n");
+}
+
+bool HeapProfiler::dumpPprof(const char* path) {
+  auto* f = fopen(path, "w");
+  if (!f)
+    return false;
+
+  // counts are already scaled so pprof should not rescale ("heapprofile").
+  auto n = sampleInterval;
+  size_t liveObjs = 0, liveBytes = 0, objs = 0, bytes = 0;
+  for (auto& i : sites) {
+    liveObjs += i.second.liveObjs * n;
+    liveBytes += i.second.liveBytes * n;
+    objs += i.second.allocatedObjs * n;
+    bytes += i.second.allocatedBytes * n;
+  }
+  fprintf(f, "heap profile: %zu: %zu [%zu: %zu] @ heapprofile\n", liveObjs,
+          liveBytes, objs, bytes);
+  for (auto& i : sites) {
+    auto& site = i.second;
+    fprintf(f, "%zu: %zu [%zu: %zu] @", site.liveObjs * n,
+            site.liveBytes * n, site.allocatedObjs * n,
+            site.allocatedBytes * n);
+    for (int j = 0; j < site.frameCnt; j++)
+      fprintf(f, " %p", site.frames[j]);
+    fprintf(f, "\n");
+  }
+
+  // pprof needs the mappings to symbolize the addresses.
+  if (auto* maps = fopen("/proc/self/maps", "r")) {
+    fprintf(f, "\nMAPPED_LIBRARIES:\n");
+    char buf[4096];
+    while (auto len = fread(buf, 1, sizeof(buf), maps))
+      fwrite(buf, 1, len, f);
+    fclose(maps);
+  }
+  return fclose(f) == 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+const PtrBase* ObjPtrEnumerator::getNext() {
+  auto* klass = meta->klass();
+  auto* subPtrs = klass->subPtrOffsets;
+  if (!subPtrs || subPtrs->empty())
+    return nullptr;
+  if (subPtrIdx == subPtrs->size()) {
+    subPtrIdx = 0;
+    arrayElemIdx++;
+  }
+  if (arrayElemIdx >= meta->length())
+    return nullptr;
+  auto* obj = meta->objPtr() + arrayElemIdx * klass->size;
+  return (PtrBase*)(obj + (*subPtrs)[subPtrIdx++]);
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+PtrBase::PtrBase() : isRoot(1) {
+  auto* c = Collector::inst ? Collector::inst : Collector::get();
+  c->registerPtr(this);
+}
+
+PtrBase::PtrBase(void* obj) : isRoot(1) {
+  auto* c = Collector::inst ? Collector::inst : Collector::get();
+  setObj(obj, c->globalFindOwnerMeta(obj));
+  c->registerPtr(this);
+}
+
+PtrBase::~PtrBase() {
+  auto* c = Collector::inst;
+#ifdef TGC_DEFERRED_RC
+  if (!inSweep && c->rcEnabled) {
+#else
+  if (!inSweep && regionCnt) {
+#endif
+    auto* m = getMeta();
+    if (isTracked(m))
+      onTargetChanged(nullptr, m);
+  }
+  c->unregisterPtr(this);
+}
+
+void PtrBase::onTargetChanged(ObjMeta* cur, ObjMeta* old) {
+  auto* c = Collector::inst;
+#ifdef TGC_DEFERRED_RC
+  auto counted = [](ObjMeta* m) {
+    return m && m->refCnt != ObjMeta::NotCounted;
+  };
+  if (counted(cur) || counted(old))
+    c->logRc(counted(cur) ? cur : nullptr, counted(old) ? old : nullptr);
+#endif
+  if ((cur && cur->inRegion) || (old && old->inRegion))
+    c->onRegionRef(this, cur && cur->inRegion ? cur : nullptr,
+                   old && old->inRegion ? old : nullptr);
+}
+
+#if defined(TGC_DEFERRED_RC) && defined(TGC_MULTI_THREADED)
+void PtrBase::lockRcLog() {
+  auto* log = Collector::inst->threadRcLog();
+  log->lock.lock();
+  heldRcLog = log;
+}
+
+void PtrBase::unlockRcLog() {
+  heldRcLog->lock.unlock();
+  heldRcLog = nullptr;
+  if (rcFlushWanted) {
+    rcFlushWanted = false;
+    Collector::inst->flushRc();
+  }
+}
+#endif
+
+#ifndef TGC_STOP_THE_WORLD
+void PtrBase::onPtrChanged() {
+  Collector::inst->onPointerChanged(this);
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+
+WeakPtrBase::WeakPtrBase(ObjMeta* m, void* o) : meta(m), obj(o) {
+  auto* c = Collector::inst ? Collector::inst : Collector::get();
+  unique_lock lk{c->mutex};
+  index = c->weakPtrs.size();
+  c->weakPtrs.push_back(this);
+}
+
+WeakPtrBase::WeakPtrBase(const WeakPtrBase& r) : WeakPtrBase() {
+  *this = r;
+}
+
+WeakPtrBase::~WeakPtrBase() {
+  auto* c = Collector::inst;
+  unique_lock lk{c->mutex};
+  auto& ptrs = c->weakPtrs;
+  ptrs[index] = ptrs.back();
+  ptrs[index]->index = index;
+  ptrs.pop_back();
+}
+
+WeakPtrBase& WeakPtrBase::operator=(const WeakPtrBase& r) {
+  unique_lock lk{Collector::inst->mutex};
+  meta = r.meta;
+  obj = r.obj;
+  return *this;
+}
+
+void WeakPtrBase::reset(ObjMeta* m, void* o) {
+  unique_lock lk{Collector::inst->mutex};
+  meta = m;
+  obj = o;
+}
+
+bool WeakPtrBase::expired() const {
+  unique_lock lk{Collector::inst->mutex};
+  return !meta || meta->destroyed;
+}
+
+void WeakPtrBase::pin(PtrBase& r) const {
+  auto* c = Collector::inst;
+  unique_lock lk{c->mutex};
+  if (meta && !meta->destroyed)
+    c->pinPtr(&r, meta, obj);
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+// Entries of the collected strings are dropped when met by lookups, or all
+// at once when the table doubles.
+struct InternTable {
+  mutex mtx;
+  unordered_multimap<size_t, gc_weak<StrData>> strs;
+  size_t pruneSize = 1024;
+};
+
+InternTable& internTable() {
+  // never destroyed, the weak refs must not outlive the collector.
+  static auto* t = new InternTable;
+  return *t;
+}
+
+}  // namespace
+
+gc_str gc_str::intern(string_view s) {
+  auto h = hashOf(s);
+  auto& t = internTable();
+  unique_lock lk{t.mtx};
+  auto range = t.strs.equal_range(h);
+  for (auto i = range.first; i != range.second;) {
+    auto d = i->second.lock();
+    if (!d) {
+      i = t.strs.erase(i);
+    } else if (d->len == s.size() && !memcmp(d->chars(), s.data(), s.size())) {
+      return d;
+    } else {
+      ++i;
+    }
+  }
+
+  if (t.strs.size() >= t.pruneSize) {
+    for (auto i = t.strs.begin(); i != t.strs.end();)
+      i = i->second.expired() ? t.strs.erase(i) : next(i);
+    t.pruneSize = max<size_t>(1024, t.strs.size() * 2);
+  }
+  auto d = alloc<InternedStrData>(s, h);
+  t.strs.emplace(h, d);
+  return d;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+EphemeronTableBase::EphemeronTableBase() {
+  auto* c = Collector::inst ? Collector::inst : Collector::get();
+  owner = c->findCreatingObj(this);
+  unique_lock lk{c->mutex};
+  index = c->ephemeronTables.size();
+  c->ephemeronTables.push_back(this);
+}
+
+EphemeronTableBase::~EphemeronTableBase() {
+  auto* c = Collector::inst;
+  unique_lock lk{c->mutex};
+  auto& tables = c->ephemeronTables;
+  tables[index] = tables.back();
+  tables[index]->index = index;
+  tables.pop_back();
+}
+
+size_t EphemeronTableBase::size() const {
+  unique_lock lk{Collector::inst->mutex};
+  return entries.size();
+}
+
+void EphemeronTableBase::clear() {
+  unique_lock lk{Collector::inst->mutex};
+  entries.clear();
+}
+
+void EphemeronTableBase::set(ObjMeta* key, ObjMeta* valueMeta, void* value) {
+  if (!key)
+    return;
+  unique_lock lk{Collector::inst->mutex};
+#ifdef TGC_DEFERRED_RC
+  // not counted by the reference of the table, left to the tracing.
+  if (valueMeta)
+    valueMeta->refCnt = ObjMeta::NotCounted;
+#endif
+  // the values are held raw, those of a region must be promoted with it.
+  if (valueMeta && valueMeta->inRegion) {
+    auto* arena = Heap::arenaOf(valueMeta);
+    if (!owner || Heap::arenaOf(owner) != arena)
+      static_cast<Collector::Region*>(arena)->escaped = true;
+  }
+  if (valueMeta)
+    entries[key] = {valueMeta, value};
+  else
+    entries.erase(key);
+}
+
+void EphemeronTableBase::get(ObjMeta* key, PtrBase& r) const {
+  auto* c = Collector::inst;
+  unique_lock lk{c->mutex};
+  auto i = entries.find(key);
+  if (i != entries.end())
+    c->pinPtr(&r, i->second.meta, i->second.value);
+}
+
+bool EphemeronTableBase::erase(ObjMeta* key) {
+  unique_lock lk{Collector::inst->mutex};
+  return entries.erase(key) > 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+gc_memory_resource::gc_memory_resource() {
+  auto* c = Collector::get();
+  if (ClassMeta::isCreatingObj > 0)
+    owner = c->findCreatingObj(this);
+}
+
+gc_memory_resource::~gc_memory_resource() {
+  assert(!bytes && "buffers should be freed before the resource");
+}
+
+void* gc_memory_resource::do_allocate(size_t size, size_t align) {
+  auto* c = Collector::inst;
+  c->reserveHeap(size);
+  // slots are only 16 bytes aligned.
+  auto* p = align > 16 ? ::operator new(size, std::align_val_t(align))
+                       : Heap::alloc(size ? size : 1, true);
+  bytes += size;
+  c->onBufferAlloc(owner, size);
+  return p;
+}
+
+void gc_memory_resource::do_deallocate(void* p, size_t size, size_t align) {
+  if (align > 16)
+    ::operator delete(p, size, std::align_val_t(align));
+  else
+    Heap::free(p);
+  bytes -= size;
+  Collector::inst->onBufferFree(owner, size);
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+bool gc_scheduler::hasWork() const {
+  auto s = gc_stats();
+  if (s.state != GcStats::State::RootMarking)
+    return true;
+  auto allocated = s.allocatedBytes - s.cycleEndAllocatedBytes;
+  auto threshold = s.cycleEndLiveBytes * growth;
+  if (s.heapSoftTarget)
+    threshold = min(threshold,
+                    s.heapSoftTarget > s.cycleEndLiveBytes
+                        ? (s.heapSoftTarget - s.cycleEndLiveBytes) / 2.0
+                        : 0.0);
+  return allocated && allocated >= threshold;
+}
+
+bool gc_scheduler::fallingBehind() const {
+  auto s = gc_stats();
+  if (s.state == GcStats::State::RootMarking)
+    return false;
+  return s.allocatedBytes - s.cycleEndAllocatedBytes > s.cycleEndLiveBytes ||
+         (s.heapSoftTarget && s.liveBytes > s.heapSoftTarget);
+}
+
+bool gc_scheduler::runUntil(clock::time_point deadline) {
+  auto* c = Collector::get();
+  auto stepsOf = [](const GcStats& s) {
+    size_t n = 0;
+    for (auto& p : s.phases)
+      n += p.steps;
+    return n;
+  };
+
+  while (hasWork()) {
+    auto now = clock::now();
+    if (now >= deadline)
+      return true;
+    auto leftNs = (double)chrono::duration_cast<chrono::nanoseconds>(
+                      deadline - now)
+                      .count();
+    // a half of the time left, so the last slice does not overrun much.
+    auto steps = stepNs ? leftNs / 2 / stepNs : minSteps;
+    if (steps < minSteps) {
+      // not even a minimal slice fits.
+      if (stepNs && leftNs < minSteps * stepNs)
+        return true;
+      steps = minSteps;
+    }
+
+    auto before = stepsOf(c->getStats());
+    c->collect(steps > INT_MAX ? INT_MAX : (int)steps, true);
+    auto ran = stepsOf(c->getStats()) - before;
+    auto ns = (double)chrono::duration_cast<chrono::nanoseconds>(
+                  clock::now() - now)
+                  .count();
+    totalSteps += ran;
+    if (ran) {
+      auto cur = ns / ran;
+      stepNs = stepNs ? stepNs * 0.75 + cur * 0.25 : cur;
+    }
+  }
+  return false;
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+namespace {
+
+// Objects of pretenured classes and sites skip the arena of the gc_region.
+struct ArenaBypass {
+  explicit ArenaBypass(bool on)
+      : arena(on ? Heap::setArena(nullptr) : nullptr) {}
+  ~ArenaBypass() {
+    if (arena)
+      Heap::setArena(arena);
+  }
+  Heap::Arena* arena;
+};
+
+}  // namespace
+
+ObjMeta* ClassMeta::newMeta(size_t objCnt, gc_site* site) {
+  assert(memHandler && "should not be called in global scope (before main)");
+  auto* c = Collector::inst ? Collector::inst : Collector::get();
+  if (!index)
+    c->registerClass(this);
+  if (objCnt && size > (SIZE_MAX - ObjMeta::headerSize(objCnt)) / objCnt)
+    throw std::bad_alloc();
+  auto bytes = allocSize(objCnt);
+  c->reserveHeap(bytes);
+
+  // the sweeper must not see objects allocated but not added yet.
+  unique_lock lk{c->mutex};
+  c->sweepFor(bytes);
+  ArenaBypass bypass{Heap::currentArena() &&
+                     c->profiler.isPretenured(this, site)};
+  ObjMeta* meta;
+  try {
+    meta = (ObjMeta*)memHandler(this, MemRequest::Alloc,
+                                reinterpret_cast<void*>(objCnt));
+  } catch (std::bad_alloc&) {
+    // the heap may be full of garbage.
+    if (!c->collectFull())
+      throw;
+    meta = (ObjMeta*)memHandler(this, MemRequest::Alloc,
+                                reinterpret_cast<void*>(objCnt));
+  }
+  // the collector may enumerate the pointers of an object under
+  // construction, the unconstructed ones must be null.
+  if (subPtrOffsets)
+    memset(meta->objPtr(), 0, size * objCnt);
+
+  try {
+    // Allow using gc_from(this) in the constructor of the creating object.
+    c->addMeta(meta, site);
+  } catch (std::bad_alloc&) {
+    memHandler(this, MemRequest::Dealloc, meta);
+    throw;
+  }
+  if (bypass.arena)
+    c->stats.pretenuredObjs++;
+
+  isCreatingObj++;
+  return meta;
+}
+
+void ClassMeta::endNewMeta(ObjMeta* meta, bool failed) {
+  isCreatingObj--;
+  if (!failed) {
+    unique_lock lk{mutex};
+    state = ClassMeta::State::Registered;
+  }
+
+  {
+    auto* c = Collector::inst;
+    unique_lock lk{c->mutex};
+    c->creatingObjs.remove(meta);
+    if (failed)
+      discardMeta(meta);
+  }
+}
+
+void ClassMeta::newMetas(size_t cnt, Batch& b) {
+  assert(memHandler && "should not be called in global scope (before main)");
+  auto* c = Collector::inst ? Collector::inst : Collector::get();
+  if (!index)
+    c->registerClass(this);
+  auto bytes = allocSize(1);
+  if (cnt > SIZE_MAX / bytes)
+    throw std::bad_alloc();
+  c->reserveHeap(bytes * cnt);
+
+  b.metas.resize(cnt);
+  unique_lock lk{c->mutex};
+  // the batch takes slots of the same size class as a single allocation.
+  c->sweepFor(bytes);
+  ArenaBypass bypass{Heap::currentArena() &&
+                     c->profiler.isPretenured(this, nullptr)};
+  try {
+    memHandler(this, MemRequest::AllocBatch, &b.metas);
+  } catch (std::bad_alloc&) {
+    if (!c->collectFull())
+      throw;
+    memHandler(this, MemRequest::AllocBatch, &b.metas);
+  }
+  // offsets may be registered by the first object only.
+  if (subPtrOffsets || state != State::Registered) {
+    for (auto* meta : b.metas)
+      memset(meta->objPtr(), 0, size);
+  }
+
+  try {
+    c->addBatch(b);
+  } catch (std::bad_alloc&) {
+    for (auto* meta : b.metas)
+      memHandler(this, MemRequest::Dealloc, meta);
+    throw;
+  }
+  if (bypass.arena)
+    c->stats.pretenuredObjs += cnt;
+  isCreatingObj++;
+}
+
+void ClassMeta::endNewMetas(Batch& b, bool failed) {
+  isCreatingObj--;
+  if (b.next) {
+    unique_lock lk{mutex};
+    state = ClassMeta::State::Registered;
+  }
+
+  auto* c = Collector::inst;
+  unique_lock lk{c->mutex};
+  auto& batches = c->batches;
+  batches.erase(find(batches.begin(), batches.end(), &b));
+  if (failed) {
+    for (size_t i = b.next; i < b.metas.size(); i++)
+      discardMeta(b.metas[i]);
+  }
+}
+
+void ClassMeta::discardMeta(ObjMeta* meta) {
+  auto* c = Collector::inst;
+  if (meta->inRegion) {
+    auto& objs = static_cast<Collector::Region*>(Heap::arenaOf(meta))->objs;
+    objs.erase(find(objs.begin(), objs.end(), meta));
+  }
+  c->onMetaFreed(meta);
+  memHandler(this, MemRequest::Dealloc, meta);
+}
+
+void ClassMeta::registerSubPtr(ObjMeta* owner, PtrBase* p) {
+  // offsets are relative to the element for arrays.
+  auto offset = (OffsetType)(((char*)p - owner->objPtr()) % size);
+
+  {
+    shared_lock lk{mutex};
+
+    if (state == ClassMeta::State::Registered)
+      return;
+    // constructor recursed.
+    if (subPtrOffsets && offset <= subPtrOffsets->back())
+      return;
+  }
+
+  unique_lock lk{mutex};
+  if (!subPtrOffsets)
+    subPtrOffsets = new vector<OffsetType>();
+  subPtrOffsets->push_back(offset);
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+Collector::Collector() {
+  roots.reserve(1024 * 5);
+  grayObjs.reserve(1024 * 2);
+#ifdef TGC_DEFERRED_RC
+  rcLogs.push_back(&orphanRcLog);
+#endif
+}
+
+Collector::~Collector() {
+#ifdef TGC_DEFERRED_RC
+  rcEnabled = false;
+#endif
+  vector<ObjMeta*> metas;
+  Heap::getObjs(metas);
+  metas.insert(metas.end(), promotedObjs.begin(), promotedObjs.end());
+  for (auto* meta : metas)
+    delete meta;
+}
+
+Collector* Collector::get() {
+  if (!inst) {
+#ifdef _WIN32
+    _CrtSetDbgFlag(_CRTDBG_ALLOC_MEM_DF | _CRTDBG_LEAK_CHECK_DF);
+#endif
+
+    inst = new Collector();
+    atexit([] { delete inst; });
+  }
+  return inst;
+}
+
+void Collector::addMeta(ObjMeta* meta, gc_site* site) {
+  unique_lock lk{mutex};
+  creatingObjs.push_back(meta);
+  onMetaAdded(meta, site);
+}
+
+void Collector::addBatch(ClassMeta::Batch& b) {
+  unique_lock lk{mutex};
+  batches.push_back(&b);
+  for (auto* meta : b.metas)
+    onMetaAdded(meta, nullptr);
+}
+
+void Collector::onMetaAdded(ObjMeta* meta, gc_site* site) {
+  if (auto* r = static_cast<Region*>(Heap::currentArena())) {
+    meta->inRegion = 1;
+#ifdef TGC_DEFERRED_RC
+    meta->refCnt = ObjMeta::NotCounted;
+#endif
+    r->objs.push_back(meta);
+  }
+  stats.allocatedObjs++;
+  stats.allocatedBytes += meta->allocSize();
+  profiler.onAlloc(meta, site);
+}
+
+void Collector::registerClass(ClassMeta* cls) {
+  unique_lock lk{mutex};
+  if (cls->index)
+    return;
+
+  static ClassMeta::IndexType classCnt = 1;
+  auto i = classCnt++;
+  assert((i >> ClassMeta::TableChunkBits) < 1024 && "too many classes");
+  auto& chunk = ClassMeta::table[i >> ClassMeta::TableChunkBits];
+  if (!chunk)
+    chunk = new ClassMeta*[ClassMeta::TableChunkSize]();
+  chunk[i & (ClassMeta::TableChunkSize - 1)] = cls;
+  cls->index = i;
+  profiler.addClass(cls);
+}
+
+void Collector::onMetaFreed(ObjMeta* meta) {
+  stats.freedObjs++;
+  stats.freedBytes += meta->allocSize();
+  profiler.onFree(meta);
+}
+
+void Collector::onBufferAlloc(ObjMeta* owner, size_t bytes) {
+  unique_lock lk{mutex};
+  stats.allocatedBytes += bytes;
+  stats.bufferBytes += bytes;
+  if (owner)
+    profiler.onBufferAlloc(owner, bytes);
+}
+
+void Collector::onBufferFree(ObjMeta* owner, size_t bytes) {
+  unique_lock lk{mutex};
+  stats.freedBytes += bytes;
+  stats.bufferBytes -= bytes;
+  if (owner)
+    profiler.onBufferFree(owner, bytes);
+}
+
+void Collector::registerPtr(PtrBase* p) {
+  ObjMeta* owner = nullptr;
+  if (ClassMeta::isCreatingObj > 0)
+    owner = findCreatingObj(p);
+
+  {
+    unique_lock lk{mutex};
+    if (owner) {
+      p->isRoot = 0;
+      interiorPtrs++;
+    } else {
+      p->index = roots.size();
+      roots.push_back(p);
+    }
+  }
+  if (owner)
+    owner->klass()->registerSubPtr(owner, p);
+}
+
+void Collector::unregisterPtr(PtrBase* p) {
+  unique_lock lk{mutex};
+  if (p->isRoot)
+    removeRoot(p);
+  else
+    interiorPtrs--;
+}
+
+void Collector::removeRoot(PtrBase* p) {
+  auto* last = roots.back();
+  roots[p->index] = last;
+  last->index = p->index;
+  roots.pop_back();
+  // the moved one would be skipped by the root marking in progress.
+  if (last != p && state == State::RootMarking && p->index < nextRootMarking &&
+      last->getObj())
+    tryMarkRoot(last);
+}
+
+void Collector::demoteRoot(PtrBase* p) {
+  removeRoot(p);
+  p->isRoot = 0;
+  interiorPtrs++;
+#ifdef TGC_STOP_THE_WORLD
+  rootsDemoted = true;
+#endif
+}
+
+void Collector::tryMarkRoot(PtrBase* p) {
+  if (p->isRoot == 1) {
+    auto* meta = p->getMeta();
+    if (meta->color == ObjMeta::Color::White) {
+      meta->color = ObjMeta::Color::Gray;
+
+      unique_lock lk{mutex};
+      grayObjs.push_back(meta);
+    }
+  }
+}
+
+void Collector::onPointerChanged(PtrBase* p) {
+  if (!p->getObj())
+    return;
+
+  unique_lock lk{mutex};
+  switch (state) {
+    case State::RootMarking:
+      if (p->isRoot && p->index < nextRootMarking)
+        tryMarkRoot(p);
+      break;
+    case State::LeafMarking: {
+      // shade non-root pointers as well, the target may be moved from an
+      // unmarked object into a marked one.
+      auto* meta = p->getMeta();
+      if (meta->color == ObjMeta::Color::White) {
+        meta->color = ObjMeta::Color::Gray;
+        grayObjs.push_back(meta);
+      }
+    } break;
+    default:
+      // white objects not swept yet are unreachable and new objects are in
+      // swept pages, so nothing to do while sweeping.
+      break;
+  }
+}
+
+void Collector::pinPtr(PtrBase* p, ObjMeta* meta, void* obj) {
+  p->setObj(obj, meta);
+  onPointerChanged(p);
+}
+
+void Collector::markGrayObjs(int& stepCnt) {
+  // The headers of the children are prefetched when they are found and
+  // checked a few children later, so the cache misses of large graphs
+  // overlap instead of stalling every step. Pending ones are shaded before
+  // returning, nothing is kept across slices.
+  constexpr size_t FifoSize = 8;
+  ObjMeta* fifo[FifoSize];
+  size_t head = 0, cnt = 0;
+  auto shadeOldest = [&] {
+    auto* meta = fifo[head];
+    head = (head + 1) % FifoSize;
+    cnt--;
+    if (meta->color == ObjMeta::Color::White) {
+      meta->color = ObjMeta::Color::Gray;
+      grayObjs.push_back(meta);
+    }
+  };
+
+  for (;;) {
+    if (grayObjs.empty()) {
+      if (!cnt)
+        break;
+      shadeOldest();
+      continue;
+    }
+    if (stepCnt-- <= 0)
+      break;
+    ObjMeta* o = grayObjs.back();
+    grayObjs.pop_back();
+    o->color = ObjMeta::Color::Black;
+
+    auto cls = o->klass();
+    auto it = cls->enumPtrs(o);
+    for (; auto* ptr = it->getNext(); stepCnt--) {
+      // e.g. elements of containers, created outside of their owners.
+      if (ptr->isRoot)
+        demoteRoot(const_cast<PtrBase*>(ptr));
+      if (!ptr->getObj())
+        continue;
+      auto* meta = ptr->getMeta();
+      prefetch(meta);
+      if (cnt == FifoSize)
+        shadeOldest();
+      fifo[(head + cnt++) % FifoSize] = meta;
+    }
+    delete it;
+  }
+  while (cnt)
+    shadeOldest();
+}
+
+bool Collector::markEphemerons(int& stepCnt) {
+  auto found = false;
+  for (auto* t : ephemeronTables) {
+    if (t->owner && t->owner->color == ObjMeta::Color::White)
+      continue;
+    for (auto& i : t->entries) {
+      stepCnt--;
+      auto* v = i.second.meta;
+      if (i.first->color != ObjMeta::Color::White &&
+          v->color == ObjMeta::Color::White) {
+        v->color = ObjMeta::Color::Gray;
+        grayObjs.push_back(v);
+        found = true;
+      }
+    }
+  }
+  return found;
+}
+
+void Collector::clearRefsTo(const vector<ObjMeta*>& sortedObjs) {
+  auto isFreed = [&](ObjMeta* m) {
+    return binary_search(sortedObjs.begin(), sortedObjs.end(), m);
+  };
+  for (auto* w : weakPtrs) {
+    if (w->meta && isFreed(w->meta)) {
+      w->meta = nullptr;
+      w->obj = nullptr;
+    }
+  }
+  for (auto* t : ephemeronTables) {
+    auto& entries = t->entries;
+    for (auto* m : sortedObjs)
+      entries.erase(m);
+    for (auto i = entries.begin(); i != entries.end();)
+      i = isFreed(i->second.meta) ? entries.erase(i) : next(i);
+  }
+}
+
+void Collector::enterRegion(Region& r) {
+  unique_lock lk{mutex};
+  r.prev = Heap::setArena(&r);
+  regions.push_back(&r);
+  PtrBase::regionCnt++;
+}
+
+void Collector::exitRegion(Region& r) {
+  unique_lock lk{mutex};
+  Heap::setArena(r.prev);
+  regions.erase(find(regions.begin(), regions.end(), &r));
+  PtrBase::regionCnt--;
+
+  bool referred;
+  {
+    unique_lock rlk{regionLock};
+    referred = r.externalRefs || r.escaped;
+  }
+  if (referred) {
+    for (auto* m : r.objs) {
+      m->inRegion = 0;
+      promotedObjs.push_back(m);
+    }
+    stats.regionPromotedObjs += r.objs.size();
+    Heap::adoptArena(r);
+    return;
+  }
+
+  // destructors may allocate or collect.
+  auto wasCollecting = collecting;
+  collecting = true;
+  auto sorted = r.objs;
+  sort(sorted.begin(), sorted.end());
+  grayObjs.erase(remove_if(grayObjs.begin(), grayObjs.end(),
+                           [&](ObjMeta* m) {
+                             return binary_search(sorted.begin(),
+                                                  sorted.end(), m);
+                           }),
+                 grayObjs.end());
+  clearRefsTo(sorted);
+  inSweep = true;
+  for (auto i = r.objs.rbegin(); i != r.objs.rend(); ++i) {
+    onMetaFreed(*i);
+    (*i)->destroy();
+  }
+  inSweep = false;
+  stats.regionFreedObjs += r.objs.size();
+  Heap::freeArena(r);
+  collecting = wasCollecting;
+}
+
+void Collector::onRegionRef(PtrBase* p, ObjMeta* inc, ObjMeta* dec) {
+  // pointers inside the arena are not counted.
+  auto* owner = Heap::arenaOf(p);
+  auto* incArena = inc ? Heap::arenaOf(inc) : nullptr;
+  auto* decArena = dec ? Heap::arenaOf(dec) : nullptr;
+  if (incArena == owner && decArena == owner)
+    return;
+
+  // the collector mutex would be taken after the counting log, see applyRc.
+  unique_lock lk{regionLock};
+  if (incArena && incArena != owner)
+    static_cast<Region*>(incArena)->externalRefs++;
+  auto* r = static_cast<Region*>(decArena);
+  if (r && r != owner && r->externalRefs)
+    r->externalRefs--;
+}
+
+void Collector::clearWeakRefs() {
+  for (auto* w : weakPtrs) {
+    if (w->meta && w->meta->color == ObjMeta::Color::White) {
+      w->meta = nullptr;
+      w->obj = nullptr;
+    }
+  }
+  for (auto* t : ephemeronTables) {
+    auto& entries = t->entries;
+    for (auto i = entries.begin(); i != entries.end();) {
+      if (i->first->color == ObjMeta::Color::White)
+        i = entries.erase(i);
+      else
+        ++i;
+    }
+  }
+}
+
+void Collector::sweepObj(ObjMeta* meta) {
+  if (meta->color == ObjMeta::Color::White) {
+    onMetaFreed(meta);
+    inSweep = true;
+    delete meta;
+    inSweep = false;
+    freeObjCntOfPrevGc++;
+  } else {
+    meta->color = ObjMeta::Color::White;
+    if (!meta->aged)
+      profiler.onSurvived(meta);
+  }
+}
+
+bool Collector::sweepPage(int& stepCnt) {
+  if (auto page = Heap::takeUnswept(0, sweepingObjs)) {
+    for (auto* meta : sweepingObjs)
+      sweepObj(meta);
+    stepCnt -= (int)sweepingObjs.size() + 1;
+    Heap::endSweep(page);
+    return true;
+  }
+  if (auto* meta = Heap::takeUnsweptLarge()) {
+    sweepObj(meta);
+    stepCnt--;
+    return true;
+  }
+  if (promotedCursor) {
+    auto* meta = promotedObjs[--promotedCursor];
+    if (meta->color == ObjMeta::Color::White) {
+      promotedObjs[promotedCursor] = promotedObjs.back();
+      promotedObjs.pop_back();
+    }
+    sweepObj(meta);
+    stepCnt--;
+    return true;
+  }
+  return false;
+}
+
+void Collector::sweepFor(size_t bytes) {
+  // destructors run by the sweeping may allocate, let them pass.
+  if (state != State::Sweeping || collecting)
+    return;
+  collecting = true;
+  while (auto page = Heap::takeUnswept(bytes, sweepingObjs)) {
+    for (auto* meta : sweepingObjs)
+      sweepObj(meta);
+    Heap::endSweep(page);
+  }
+  collecting = false;
+}
+
+#ifdef TGC_DEFERRED_RC
+Collector::RcLog* Collector::threadRcLog() {
+  struct Owner {
+    RcLog log;
+    Owner() {
+      unique_lock lk{inst->mutex};
+      inst->rcLogs.push_back(&log);
+    }
+    ~Owner() {
+      unique_lock lk{inst->mutex};
+      auto& logs = inst->rcLogs;
+      logs.erase(find(logs.begin(), logs.end(), &log));
+      auto& o = inst->orphanRcLog;
+      unique_lock olk{o.lock};
+      o.incs.insert(o.incs.end(), log.incs.begin(), log.incs.end());
+      o.decs.insert(o.decs.end(), log.decs.begin(), log.decs.end());
+      rcLogDead = true;
+    }
+  };
+
+  if (rcLogDead)
+    return &orphanRcLog;
+  static thread_local Owner owner;
+  return &owner.log;
+}
+
+void Collector::logRc(ObjMeta* inc, ObjMeta* dec) {
+  if (!rcEnabled)
+    return;
+  if (inSweep)
+    dec = nullptr;
+  if (!inc && !dec)
+    return;
+
+#ifdef TGC_MULTI_THREADED
+  // the flush would wait for the log held by the thread itself.
+  if (auto* log = heldRcLog) {
+    if (inc)
+      log->incs.push_back(inc);
+    if (dec)
+      log->decs.push_back(dec);
+    if (log->incs.size() + log->decs.size() >= RcLogCapacity)
+      rcFlushWanted = true;
+    return;
+  }
+#endif
+
+  auto* log = threadRcLog();
+  size_t n;
+  {
+    unique_lock lk{log->lock};
+    if (inc)
+      log->incs.push_back(inc);
+    if (dec)
+      log->decs.push_back(dec);
+    n = log->incs.size() + log->decs.size();
+  }
+  if (n >= RcLogCapacity)
+    flushRc();
+}
+
+void Collector::flushRc() {
+  unique_lock lk{mutex};
+  if (collecting)
+    return;
+  collecting = true;
+  applyRc();
+  collecting = false;
+}
+
+void Collector::applyRc() {
+  for (;;) {
+    for (auto* l : rcLogs)
+      l->lock.lock();
+    for (auto* l : rcLogs) {
+      rcIncs.insert(rcIncs.end(), l->incs.begin(), l->incs.end());
+      rcDecs.insert(rcDecs.end(), l->decs.begin(), l->decs.end());
+      l->incs.clear();
+      l->decs.clear();
+    }
+    for (auto* l : rcLogs)
+      l->lock.unlock();
+    if (rcIncs.empty() && rcDecs.empty())
+      break;
+
+    // increments first, the counts never drop below the real ones.
+    for (auto* m : rcIncs) {
+      if (m->refCnt != ObjMeta::NotCounted)
+        m->refCnt++;
+    }
+    for (auto* m : rcDecs) {
+      if (m->refCnt != ObjMeta::NotCounted && !--m->refCnt)
+        rcZeros.push_back(m);
+    }
+    rcIncs.clear();
+    rcDecs.clear();
+    // destructors may log more operations.
+    freeRc(rcZeros);
+    rcZeros.clear();
+  }
+}
+
+void Collector::freeRc(vector<ObjMeta*>& objs) {
+  auto last = remove_if(objs.begin(), objs.end(), [&](ObjMeta* m) {
+    // marked ones may be reached by the pointers being scanned.
+    return m->refCnt || m->color != ObjMeta::Color::White || isCreating(m);
+  });
+  objs.erase(last, objs.end());
+  if (objs.empty())
+    return;
+
+  sort(objs.begin(), objs.end());
+  clearRefsTo(objs);
+
+  // unswept objects may point to swept ones.
+  auto sweeping = state == State::Sweeping;
+  for (auto* m : objs) {
+    onMetaFreed(m);
+    inSweep = sweeping;
+    delete m;
+    inSweep = false;
+    stats.rcFreedObjs++;
+  }
+}
+
+bool Collector::isCreating(ObjMeta* m) {
+  if (find(creatingObjs.begin(), creatingObjs.end(), m) != creatingObjs.end())
+    return true;
+  for (auto* b : batches) {
+    if (find(b->metas.begin(), b->metas.end(), m) != b->metas.end())
+      return true;
+  }
+  return false;
+}
+#endif
+
+bool Collector::markCreatingObjs() {
+  auto found = false;
+  for (auto* meta : creatingObjs) {
+    if (meta->color == ObjMeta::Color::White) {
+      meta->color = ObjMeta::Color::Gray;
+      grayObjs.push_back(meta);
+      found = true;
+    }
+  }
+  for (auto* b : batches) {
+    for (auto* meta : b->metas) {
+      if (meta->color == ObjMeta::Color::White) {
+        meta->color = ObjMeta::Color::Gray;
+        grayObjs.push_back(meta);
+        found = true;
+      }
+    }
+  }
+  return found;
+}
+
+ObjMeta* Collector::findCreatingObj(const void* p) {
+  unique_lock lk{mutex};
+  // owner may not be the current one(e.g. constructor recursed)
+  for (auto i = creatingObjs.rbegin(); i != creatingObjs.rend(); ++i) {
+    if ((*i)->containsPtr((char*)p))
+      return *i;
+  }
+  for (auto* b : batches) {
+    size_t i = b->next;
+    if (i < b->metas.size() && b->metas[i]->containsPtr((char*)p))
+      return b->metas[i];
+  }
+  return nullptr;
+}
+
+ObjMeta* Collector::globalFindOwnerMeta(void* obj) {
+  return Heap::findMeta(obj);
+}
+
+void Collector::setHeapLimit(size_t hardLimit, size_t softTarget) {
+  unique_lock lk{mutex};
+  heapLimit = hardLimit;
+  heapSoftTarget = softTarget;
+}
+
+void Collector::reserveHeap(size_t bytes) {
+  unique_lock lk{mutex};
+  // destructors run by the sweeping may allocate, let them pass.
+  if (collecting)
+    return;
+
+  auto live = stats.allocatedBytes - stats.freedBytes + bytes;
+  if (heapLimit && live > heapLimit) {
+    collectFull();
+    if (stats.allocatedBytes - stats.freedBytes + bytes > heapLimit)
+      throw std::bad_alloc();
+  } else if (heapSoftTarget && live > heapSoftTarget) {
+    collect(256);
+  }
+}
+
+bool Collector::collectFull() {
+  unique_lock lk{mutex};
+  if (collecting)
+    return false;
+  // objects marked by the cycle in progress may be garbage already.
+  if (state != State::RootMarking || nextRootMarking)
+    collect(INT_MAX, true);
+  collect(INT_MAX, true);
+  return true;
+}
+
+void Collector::deleteObj(PtrBase& p, [[maybe_unused]] bool reclaim) {
+  auto* meta = p.getMeta();
+  // images are mapped read-only.
+  if (!meta || Heap::inImage(meta))
+    return;
+  meta->destroy();
+#ifdef TGC_DEFERRED_RC
+  // may be freed as soon as the pointer is cleared.
+  auto counted = meta->refCnt != ObjMeta::NotCounted;
+  p.setObj(nullptr, nullptr);
+  if (counted && reclaim)
+    flushRc();
+#else
+  p.setObj(nullptr, nullptr);
+#endif
+}
+
+void Collector::reclaimDeleted() {
+#ifdef TGC_DEFERRED_RC
+  flushRc();
+#endif
+}
+
+void Collector::adoptPtrs(const PtrBase& p) {
+  auto* meta = p.getMeta();
+  if (!meta)
+    return;
+  unique_lock lk{mutex};
+  auto it = meta->klass()->enumPtrs(meta);
+  while (auto* ptr = it->getNext())
+    if (ptr->isRoot)
+      demoteRoot(const_cast<PtrBase*>(ptr));
+  delete it;
+}
+
+void Collector::collect(int stepCnt, bool stopAtCycleEnd) {
+  unique_lock lk{mutex};
+  if (collecting)
+    return;
+  collecting = true;
+#ifdef TGC_DEFERRED_RC
+  applyRc();
+#endif
+#ifdef TGC_STOP_THE_WORLD
+  // not resumable, the mutator has no write barrier.
+  stepCnt = INT_MAX;
+#endif
+
+  freeObjCntOfPrevGc = 0;
+
+  auto phase = state;
+  auto sliceStart = nowNs(), phaseStart = sliceStart;
+  auto sliceSteps = stepCnt, phaseSteps = stepCnt;
+  auto endPhase = [&](State next) {
+    auto now = nowNs();
+    auto ns = now - phaseStart;
+    auto steps = phaseSteps > stepCnt ? phaseSteps - stepCnt : 0;
+    auto& s = stats.phases[(int)phase];
+    s.slices++;
+    s.steps += steps;
+    s.totalPauseNs += ns;
+    if (ns > s.maxPauseNs)
+      s.maxPauseNs = ns;
+    pauseHists[(int)phase].record(ns);
+    if (tracing)
+      addTraceEvent((int)phase, phaseStart, now, steps);
+    phase = next;
+    phaseStart = now;
+    phaseSteps = stepCnt;
+  };
+
+  switch (state) {
+  _RootMarking:
+  case State::RootMarking:
+    for (; nextRootMarking < roots.size() && stepCnt-- > 0;
+         nextRootMarking++) {
+      auto p = roots[nextRootMarking];
+      if (p->getObj())
+        tryMarkRoot(p);
+    }
+    if (nextRootMarking >= roots.size()) {
+      state = State::LeafMarking;
+      nextRootMarking = 0;
+      endPhase(state);
+      goto _ChildMarking;
+    }
+    break;
+
+  _ChildMarking:
+  case State::LeafMarking:
+    markGrayObjs(stepCnt);
+    if (!grayObjs.size()) {
+      // objects under construction are not referenced by roots yet, values
+      // of ephemerons are reachable through their marked keys.
+      if (markCreatingObjs() || markEphemerons(stepCnt))
+        goto _ChildMarking;
+#ifdef TGC_DEFERRED_RC
+      // the buffered decrements may refer to the objects to be swept.
+      applyRc();
+      if (grayObjs.size())
+        goto _ChildMarking;
+#endif
+      // must be done before the targets are swept.
+      clearWeakRefs();
+      state = State::Sweeping;
+      Heap::startSweep();
+      // objects of the regions are freed with them.
+      for (auto* r : regions) {
+        for (auto* m : r->objs)
+          m->color = ObjMeta::Color::White;
+      }
+      promotedCursor = promotedObjs.size();
+      endPhase(state);
+      goto _Sweeping;
+    }
+    break;
+
+  _Sweeping:
+  case State::Sweeping:
+    while (stepCnt > 0 && sweepPage(stepCnt))
+      ;
+    if (stepCnt > 0) {
+      state = State::RootMarking;
+      stats.cycles++;
+      stats.cycleEndAllocatedBytes = stats.allocatedBytes;
+      stats.cycleEndLiveBytes = stats.allocatedBytes - stats.freedBytes;
+      Heap::endCycle();
+#ifdef TGC_STOP_THE_WORLD
+      // targets of the demoted roots may be garbage already.
+      auto again = rootsDemoted;
+      rootsDemoted = false;
+#else
+      auto again = stats.allocatedObjs != stats.freedObjs;
+#endif
+      if (again && !stopAtCycleEnd) {
+        endPhase(state);
+        goto _RootMarking;
+      }
+    }
+    break;
+
+  default:
+    break;
+  }
+  endPhase(state);
+
+  pauseHists[(int)State::MaxCnt].record(phaseStart - sliceStart);
+  if (tracing)
+    addTraceEvent((int)State::MaxCnt, sliceStart, phaseStart,
+                  sliceSteps > stepCnt ? sliceSteps - stepCnt : 0);
+  collecting = false;
+}
+
+void Collector::addTraceEvent(int name,
+                              uint64_t beginNs,
+                              uint64_t endNs,
+                              int steps) {
+  static thread_local auto tid =
+      (unsigned)hash<thread::id>()(this_thread::get_id());
+
+  traceEvents[nextTraceEvent] = {name, steps, tid, beginNs, endNs};
+  if (++nextTraceEvent == traceEvents.size())
+    nextTraceEvent = 0;
+}
+
+PauseHistogram Collector::getPauseHistogram(State phase) {
+  unique_lock lk{mutex};
+  return pauseHists[(int)phase];
+}
+
+void Collector::startTrace(size_t capacity) {
+  unique_lock lk{mutex};
+  traceEvents.assign(capacity ? capacity : 1, TraceEvent{-1, 0, 0, 0, 0});
+  nextTraceEvent = 0;
+  tracing = true;
+}
+
+void Collector::stopTrace() {
+  unique_lock lk{mutex};
+  tracing = false;
+}
+
+bool Collector::dumpTrace(const char* path) {
+  unique_lock lk{mutex};
+
+  auto* f = fopen(path, "w");
+  if (!f)
+    return false;
+
+  auto pid = (int)getpid();
+  auto first = true;
+  fprintf(f, "{\"traceEvents\":[\n");
+  // oldest events first.
+  for (size_t i = 0; i < traceEvents.size(); i++) {
+    auto& e = traceEvents[(nextTraceEvent + i) % traceEvents.size()];
+    if (e.name < 0)
+      continue;
+    fprintf(f,
+            "%s{\"name\":\"%s\",\"cat\":\"tgc\",\"ph\":\"X\",\"ts\":%.3f,"
+            "\"dur\":%.3f,\"pid\":%d,\"tid\":%u,\"args\":{\"steps\":%d}}",
+            first ? "" : ",\n", TraceEventStr[e.name], e.beginNs / 1e3,
+            (e.endNs - e.beginNs) / 1e3, pid, e.tid, e.steps);
+    first = false;
+  }
+  fprintf(f, "\n],\"displayTimeUnit\":\"ns\"}\n");
+  return fclose(f) == 0;
+}
+
+Collector::Stats Collector::getStats() {
+  unique_lock lk{mutex};
+
+  auto s = stats;
+  s.liveObjs = s.allocatedObjs - s.freedObjs;
+  s.liveBytes = s.allocatedBytes - s.freedBytes;
+  s.pointers = roots.size() + interiorPtrs;
+  s.metas = s.liveObjs;
+  s.grayObjs = grayObjs.size();
+  s.lastFreedObjs = freeObjCntOfPrevGc;
+  s.state = state;
+  s.heapLimit = heapLimit;
+  s.heapSoftTarget = heapSoftTarget;
+  auto usage = Heap::getUsage();
+  s.heapCommittedBytes = usage.committedBytes;
+  s.heapRetainedBytes = usage.retainedBytes;
+  s.heapTrimmedBytes = usage.trimmedBytes;
+  return s;
+}
+
+void Collector::startHeapProfiler(size_t sampleInterval) {
+  unique_lock lk{mutex};
+  profiler.start(sampleInterval);
+}
+
+void Collector::stopHeapProfiler() {
+  unique_lock lk{mutex};
+  profiler.stop();
+}
+
+vector<HeapProfiler::ClassStats> Collector::getClassStats() {
+  unique_lock lk{mutex};
+  return profiler.getClassStats();
+}
+
+void Collector::heapReport() {
+  unique_lock lk{mutex};
+  profiler.report();
+}
+
+bool Collector::dumpHeapProfile(const char* path) {
+  unique_lock lk{mutex};
+  return profiler.dumpPprof(path);
+}
+
+// Snapshot format, all integers are LEB128 varints:
+//   "TGCSNAP1"
+//   classCnt, {size, nameLen, name}...      class 0 is unknown.
+//   nodeCnt, {class, bytes, edgeCnt, {node}...}...
+//   rootCnt, {node}...
+bool Collector::dumpHeapSnapshot(const char* path) {
+  unique_lock lk{mutex};
+
+  auto* f = fopen(path, "wb");
+  if (!f)
+    return false;
+
+  auto put = [f](uint64_t v) {
+    do {
+      auto b = (int)(v & 0x7f);
+      v >>= 7;
+      fputc(v ? b | 0x80 : b, f);
+    } while (v);
+  };
+
+  fwrite("TGCSNAP1", 1, 8, f);
+
+  auto classes = profiler.getClassStats();
+  put(classes.size() + 1);
+  put(0);
+  put(0);
+  for (auto& c : classes) {
+    auto name = HeapProfiler::className(c.klass);
+    put(c.klass->size);
+    put(name.size());
+    fwrite(name.data(), 1, name.size(), f);
+  }
+
+  vector<ObjMeta*> metas;
+  Heap::getObjs(metas);
+  // objects of the regions are not on the heap pages.
+  metas.insert(metas.end(), promotedObjs.begin(), promotedObjs.end());
+  for (auto* r : regions)
+    metas.insert(metas.end(), r->objs.begin(), r->objs.end());
+  unordered_map<ObjMeta*, uint64_t> ids;
+  ids.reserve(metas.size());
+  for (auto* meta : metas)
+    ids.emplace(meta, ids.size());
+
+  // pointers reached from objects are interior, all the others are roots.
+  unordered_set<const PtrBase*> interiors;
+  vector<uint64_t> edges;
+  put(metas.size());
+  for (auto* meta : metas) {
+    edges.clear();
+    if (!meta->destroyed) {
+      auto it = meta->klass()->enumPtrs(meta);
+      while (auto* ptr = it->getNext()) {
+        interiors.insert(ptr);
+        auto i = ptr->getObj() ? ids.find(ptr->getMeta()) : ids.end();
+        if (i != ids.end())
+          edges.push_back(i->second);
+      }
+      delete it;
+    }
+    put(meta->klass()->index);
+    put(meta->allocSize());
+    put(edges.size());
+    for (auto e : edges)
+      put(e);
+  }
+
+  edges.clear();
+  for (auto* p : roots) {
+    if (!p->getObj() || interiors.count(p))
+      continue;
+    auto i = ids.find(p->getMeta());
+    if (i != ids.end())
+      edges.push_back(i->second);
+  }
+  put(edges.size());
+  for (auto e : edges)
+    put(e);
+
+  return fclose(f) == 0;
+}
+
+void Collector::registerImageClass(ClassMeta* cls) {
+  registerClass(cls);
+  unique_lock lk{mutex};
+  imageClasses[cls->typeInfo().name()] = cls;
+}
+
+namespace {
+
+struct ImageObj {
+  uint64_t meta, cls, length;
+};
+
+// targets are offsets in the image data, meta is UINT64_MAX for null.
+struct ImageReloc {
+  uint64_t loc, meta, obj;
+};
+
+const uint64_t ImageLayout[] = {sizeof(void*), sizeof(ObjMeta),
+                                sizeof(PtrBase)};
+
+}  // namespace
+
+bool Collector::saveImage(const PtrBase& root, const char* path) {
+  unique_lock lk{mutex};
+  if (!root.getObj())
+    return false;
+
+  vector<ClassMeta*> classes;
+  unordered_map<ClassMeta*, uint64_t> classIds;
+  vector<ObjMeta*> metas;
+  unordered_map<ObjMeta*, uint64_t> offsets;
+  uint64_t dataBytes = 0;
+  auto add = [&](ObjMeta* meta) {
+    if (offsets.count(meta))
+      return true;
+    auto* cls = meta->klass();
+    auto i = imageClasses.find(cls->typeInfo().name());
+    if (meta->destroyed || i == imageClasses.end() || i->second != cls)
+      return false;
+    if (classIds.emplace(cls, classes.size()).second)
+      classes.push_back(cls);
+    offsets.emplace(meta, dataBytes);
+    metas.push_back(meta);
+    dataBytes += (meta->allocSize() + 15) & ~(uint64_t)15;
+    return true;
+  };
+
+  if (!add(root.getMeta()))
+    return false;
+  vector<ImageObj> objs;
+  vector<ImageReloc> relocs;
+  // the list grows while walking, the root is the first one.
+  for (size_t i = 0; i < metas.size(); i++) {
+    auto* meta = metas[i];
+    auto offset = offsets[meta];
+    objs.push_back({offset, classIds[meta->klass()], meta->length()});
+    auto it = meta->klass()->enumPtrs(meta);
+    while (auto* ptr = it->getNext()) {
+      ImageReloc r{offset + ((char*)ptr - (char*)meta), UINT64_MAX, 0};
+      if (auto* obj = (char*)ptr->getObj()) {
+        auto* target = ptr->getMeta();
+        if (!add(target)) {
+          delete it;
+          return false;
+        }
+        r.meta = offsets[target];
+        r.obj = r.meta + (obj - (char*)target);
+      }
+      relocs.push_back(r);
+    }
+    delete it;
+  }
+
+  auto* f = fopen(path, "wb");
+  if (!f)
+    return false;
+  auto put = [f](uint64_t v) { fwrite(&v, sizeof(v), 1, f); };
+
+  fwrite("TGCIMG1", 1, 8, f);
+  fwrite(ImageLayout, sizeof(ImageLayout), 1, f);
+  put(classes.size());
+  put(objs.size());
+  put(relocs.size());
+  put(dataBytes);
+  put(offsets[root.getMeta()] + ((char*)root.getObj() - (char*)root.getMeta()));
+  for (auto* cls : classes) {
+    string name = cls->typeInfo().name();
+    put(name.size());
+    fwrite(name.data(), 1, name.size(), f);
+    put(cls->size);
+    auto cnt = cls->subPtrOffsets ? cls->subPtrOffsets->size() : 0;
+    put(cnt);
+    if (cnt)
+      fwrite(cls->subPtrOffsets->data(), sizeof(ClassMeta::OffsetType), cnt, f);
+  }
+  fwrite(objs.data(), sizeof(ImageObj), objs.size(), f);
+  fwrite(relocs.data(), sizeof(ImageReloc), relocs.size(), f);
+
+  char pad[16] = {};
+  for (auto* meta : metas) {
+    auto size = meta->allocSize();
+    fwrite(meta, 1, size, f);
+    fwrite(pad, 1, ((size + 15) & ~(size_t)15) - size, f);
+  }
+  return fclose(f) == 0;
+}
+
+ObjMeta* Collector::loadImage(ClassMeta* rootCls,
+                              const char* path,
+                              void** rootObj) {
+  unique_lock lk{mutex};
+
+  auto* f = fopen(path, "rb");
+  if (!f)
+    return nullptr;
+  unique_ptr<FILE, int (*)(FILE*)> closer{f, fclose};
+  auto get = [f](void* p, size_t size) {
+    return !size || fread(p, size, 1, f) == 1;
+  };
+  auto getInt = [&] {
+    uint64_t v = 0;
+    return get(&v, sizeof(v)) ? v : UINT64_MAX;
+  };
+
+  char magic[8];
+  uint64_t layout[size(ImageLayout)];
+  if (!get(magic, 8) || memcmp(magic, "TGCIMG1", 8) ||
+      !get(layout, sizeof(layout)) ||
+      memcmp(layout, ImageLayout, sizeof(layout)))
+    return nullptr;
+  auto classCnt = getInt(), objCnt = getInt(), relocCnt = getInt();
+  auto dataBytes = getInt(), rootOffset = getInt();
+  if (!objCnt || objCnt == UINT64_MAX || relocCnt == UINT64_MAX ||
+      dataBytes == UINT64_MAX || classCnt > objCnt || rootOffset >= dataBytes)
+    return nullptr;
+
+  vector<ClassMeta*> classes;
+  for (uint64_t i = 0; i < classCnt; i++) {
+    auto len = getInt();
+    if (len > 4096)
+      return nullptr;
+    string name(len, '\0');
+    if (!get(&name[0], len))
+      return nullptr;
+    auto size = getInt(), cnt = getInt();
+    if (cnt > size)
+      return nullptr;
+    vector<ClassMeta::OffsetType> subPtrs(cnt);
+    if (!get(subPtrs.data(), cnt * sizeof(ClassMeta::OffsetType)))
+      return nullptr;
+
+    auto c = imageClasses.find(name);
+    if (c == imageClasses.end() || c->second->size != size)
+      return nullptr;
+    auto* cls = c->second;
+    unique_lock clk{cls->mutex};
+    if (cls->state == ClassMeta::State::Registered) {
+      auto* offsets = cls->subPtrOffsets;
+      if ((offsets ? *offsets : vector<ClassMeta::OffsetType>{}) != subPtrs)
+        return nullptr;
+    } else if (!cls->subPtrOffsets) {
+      // never constructed in this process.
+      if (cnt)
+        cls->subPtrOffsets = new vector<ClassMeta::OffsetType>(subPtrs);
+      cls->state = ClassMeta::State::Registered;
+    }
+    classes.push_back(cls);
+  }
+
+  vector<ImageObj> objs(objCnt);
+  vector<ImageReloc> relocs(relocCnt);
+  if (!get(objs.data(), objCnt * sizeof(ImageObj)) ||
+      !get(relocs.data(), relocCnt * sizeof(ImageReloc)))
+    return nullptr;
+  if (objs[0].cls >= classes.size() || classes[objs[0].cls] != rootCls)
+    return nullptr;
+  vector<size_t> offsets;
+  for (auto& o : objs) {
+    if (o.cls >= classes.size() || o.meta >= dataBytes)
+      return nullptr;
+    offsets.push_back(o.meta);
+  }
+  sort(offsets.begin(), offsets.end());
+
+  auto* data = Heap::allocImage(dataBytes, offsets);
+  auto fail = [&] {
+    Heap::freeImage(data);
+    return nullptr;
+  };
+  if (!get(data, dataBytes))
+    return fail();
+
+  for (auto& o : objs) {
+    auto* cls = classes[o.cls];
+    auto bytes = ObjMeta::headerSize(o.length) + cls->size * o.length;
+    if (o.length > dataBytes || dataBytes - o.meta < bytes)
+      return fail();
+    auto* meta = new (data + o.meta) ObjMeta(cls, o.length);
+    // immortal, never traced nor swept.
+    meta->color = ObjMeta::Color::Black;
+    meta->aged = 1;
+  }
+  for (auto& r : relocs) {
+    if (r.loc > dataBytes || dataBytes - r.loc < sizeof(PtrBase) ||
+        (r.meta != UINT64_MAX && (r.meta >= dataBytes || r.obj >= dataBytes)))
+      return fail();
+    auto* p = (PtrBase*)(data + r.loc);
+    p->isRoot = 0;
+    p->index = 0;
+    if (r.meta == UINT64_MAX)
+      p->assignObj(nullptr, nullptr);
+    else
+      p->assignObj(data + r.obj, (ObjMeta*)(data + r.meta));
+  }
+  Heap::protectImage(data);
+
+  *rootObj = data + rootOffset;
+  return (ObjMeta*)(data + objs[0].meta);
+}
+
+void Collector::dumpStats() {
+  auto s = getStats();
+
+  printf("========= [gc] ========\n");
+  printf("[total pointers ] %3zu\n", s.pointers);
+  printf("[total meta     ] %3zu\n", s.metas);
+  printf("[total gray meta] %3zu\n", s.grayObjs);
+  printf("[live objects   ] %3zu\n", s.liveObjs);
+  printf("[live bytes     ] %3zu\n", s.liveBytes);
+  printf("[last freed objs] %3zu\n", s.lastFreedObjs);
+  printf("[heap committed ] %3zu\n", s.heapCommittedBytes);
+  printf("[heap retained  ] %3zu\n", s.heapRetainedBytes);
+  printf("[heap trimmed   ] %3zu\n", s.heapTrimmedBytes);
+  printf("[total cycles   ] %3zu\n", s.cycles);
+  printf("[collector state] %s\n", StateStr[(int)s.state]);
+  for (int i = 0; i < (int)State::MaxCnt; i++) {
+    auto& p = s.phases[i];
+    printf("[%-15s] slices %zu, steps %zu, pause %.3fms (max %.3fms)\n",
+           StateStr[i], p.slices, p.steps, p.totalPauseNs / 1e6,
+           p.maxPauseNs / 1e6);
+  }
+  printf("=======================\n");
+}
+
+}  // namespace details
+}  // namespace tgc
@@ -1,758 +1,2312 @@
-/*
-
-TGC: Tiny incremental mark & sweep Garbage Collector.
-
-//////////////////////////////////////////////////////////////////////////
-
-Copyright (C) 2018 soniced@sina.com
-
-Permission is hereby granted, free of charge, to any person obtaining a copy of
-this software and associated documentation files (the "Software"), to deal in
-the Software without restriction, including without limitation the rights to
-use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
-the Software, and to permit persons to whom the Software is furnished to do so,
-subject to the following conditions:
-
-The above copyright notice and this permission notice shall be included in all
-copies or substantial portions of the Software.
-
-THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
-IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
-FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
-COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
-IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
-CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
-
-*/
-
-#pragma once
-
-//#define TGC_MULTI_THREADED
-
-#include <cassert>
-#include <memory>
-#include <set>
-#include <typeinfo>
-#include <vector>
-#ifdef TGC_MULTI_THREADED
-#include <atomic>
-#include <shared_mutex>
-#endif
-
-// for STL wrappers
-#include <deque>
-#include <list>
-#include <map>
-#include <string>
-#include <unordered_map>
-#include <unordered_set>
-
-namespace tgc {
-namespace details {
-
-using namespace std;
-
-#ifndef TGC_MULTI_THREADED
-
-constexpr int try_to_lock = 0;
-
-struct shared_mutex {};
-struct unique_lock {
-  unique_lock(...) {}
-};
-struct shared_lock {
-  shared_lock(...) {}
-};
-template <typename T>
-struct atomic {
-  T value;
-  atomic(T v) : value{v} {}
-  void operator++(int) { value++; }
-  void operator--(int) { value--; }
-  operator const T&() const { return value; }
-  bool operator==(const T& r) const { return value == r; }
-};
-
-#endif
-
-class ObjMeta;
-class ClassMeta;
-class PtrBase;
-class IPtrEnumerator;
-
-//////////////////////////////////////////////////////////////////////////
-
-class ObjMeta {
- public:
-  enum class Color : unsigned char { White, Gray, Black };
-  using LengthType = unsigned short;
-  struct Less {
-    bool operator()(ObjMeta* x, ObjMeta* y) const { return *x < *y; }
-  };
-
-  ClassMeta* klass = nullptr;
-  atomic<Color> color = Color::White;
-  LengthType arrayLength = 0;
-
-  static char* dummyObjPtr;
-
-  ObjMeta(ClassMeta* c, char* o, size_t n)
-      : klass(c), arrayLength((LengthType)n) {}
-  ~ObjMeta() {
-    if (arrayLength)
-      destroy();
-  }
-  void operator delete(void* c);
-  bool operator<(ObjMeta& r) const;
-  bool containsPtr(char* p);
-  char* objPtr() const;
-  void destroy();
-};
-
-static_assert(sizeof(ObjMeta) <= sizeof(void*) * 2,
-              "too large for small allocation");
-
-//////////////////////////////////////////////////////////////////////////
-
-class IPtrEnumerator {
- public:
-  virtual ~IPtrEnumerator() {}
-  virtual const PtrBase* getNext() = 0;
-
-  void* operator new(size_t sz) {
-    static char buf[255];
-    assert(sz <= sizeof(buf));
-    return buf;
-  }
-  void operator delete(void*) {}
-};
-
-class ObjPtrEnumerator : public IPtrEnumerator {
-  size_t subPtrIdx = 0, arrayElemIdx = 0;
-  ObjMeta* meta = nullptr;
-
- public:
-  ObjPtrEnumerator(ObjMeta* m) : meta(m) {}
-  const PtrBase* getNext() override;
-};
-
-template <typename T>
-struct PtrEnumerator : ObjPtrEnumerator {
-  using ObjPtrEnumerator::ObjPtrEnumerator;
-};
-
-//////////////////////////////////////////////////////////////////////////
-
-class ClassMeta {
- public:
-  enum class State : unsigned char { Unregistered, Registered };
-  enum class MemRequest { Alloc, Dctor, Dealloc, NewPtrEnumerator };
-  using MemHandler = void* (*)(ClassMeta* cls, MemRequest r, void* param);
-  using OffsetType = unsigned short;
-  using SizeType = unsigned short;
-
-  MemHandler memHandler = nullptr;
-  vector<OffsetType>* subPtrOffsets = nullptr;
-  State state = State::Unregistered;
-  SizeType size = 0;
-
-#ifdef TGC_MULTI_THREADED
-  shared_mutex mutex;
-#else
-  static shared_mutex mutex;
-#endif
-
-  static atomic<int> isCreatingObj;
-  static ClassMeta dummy;
-
-  ClassMeta() {}
-  ClassMeta(MemHandler h, SizeType sz) : memHandler(h), size(sz) {}
-  ~ClassMeta() { delete subPtrOffsets; }
-
-  ObjMeta* newMeta(size_t objCnt);
-  void registerSubPtr(ObjMeta* owner, PtrBase* p);
-  void endNewMeta(ObjMeta* meta, bool failed);
-  IPtrEnumerator* enumPtrs(ObjMeta* m) {
-    return (IPtrEnumerator*)memHandler(this, MemRequest::NewPtrEnumerator, m);
-  }
-
-  template <typename T>
-  static ClassMeta* get() {
-    return &Holder<T>::inst;
-  }
-
- private:
-  template <typename T>
-  struct Holder {
-    static void* MemHandler(ClassMeta* cls, MemRequest r, void* param) {
-      switch (r) {
-        case MemRequest::Alloc: {
-          auto cnt = (size_t)param;
-          auto* p = new char[cls->size * cnt + sizeof(ObjMeta)];
-          return new (p) ObjMeta(cls, p + sizeof(ObjMeta), cnt);
-        }
-        case MemRequest::Dealloc: {
-          auto meta = (ObjMeta*)param;
-          delete[](char*) meta;
-        } break;
-        case MemRequest::Dctor: {
-          auto meta = (ObjMeta*)param;
-          auto p = (T*)meta->objPtr();
-          for (size_t i = 0; i < meta->arrayLength; i++, p++) {
-            p->~T();
-          }
-        } break;
-        case MemRequest::NewPtrEnumerator: {
-          auto meta = (ObjMeta*)param;
-          return new PtrEnumerator<T>(meta);
-        } break;
-      }
-      return nullptr;
-    }
-
-    static ClassMeta inst;
-  };
-};
-
-template <typename T>
-ClassMeta ClassMeta::Holder<T>::inst{MemHandler, sizeof(T)};
-
-#ifndef TGC_MULTI_THREADED
-static_assert(sizeof(ClassMeta) <= sizeof(void*) * 3,
-              "too large for lambda heavy programs");
-#endif
-
-//////////////////////////////////////////////////////////////////////////
-
-class PtrBase {
-  friend class Collector;
-  friend class ClassMeta;
-
- public:
-  ObjMeta* getMeta() { return meta; }
-
- protected:
-  PtrBase();
-  PtrBase(void* obj);
-  ~PtrBase();
-  void onPtrChanged();
-
- protected:
-  ObjMeta* meta = nullptr;
-  mutable unsigned int isRoot : 1;
-  unsigned int index : 31;
-};
-
-template <typename T>
-class GcPtr : public PtrBase {
- public:
-  using pointee = T;
-  using element_type = T;  // compatible with std::shared_ptr
-
-  template <typename U>
-  friend class GcPtr;
-
- public:
-  // Constructors
-
-  GcPtr() {}
-  GcPtr(ObjMeta* meta) { reset((T*)meta->objPtr(), meta); }
-  explicit GcPtr(T* obj) : PtrBase(obj), p(obj) {}
-  template <typename U>
-  GcPtr(const GcPtr<U>& r) {
-    reset(static_cast<T*>(r.p), r.meta);
-  }
-  GcPtr(const GcPtr& r) { reset(r.p, r.meta); }
-  GcPtr(GcPtr&& r) {
-    reset(r.p, r.meta);
-    r = nullptr;
-  }
-
-  // Operators
-
-  template <typename U>
-  GcPtr& operator=(const GcPtr<U>& r) {
-    reset(r.p, r.meta);
-    return *this;
-  }
-  GcPtr& operator=(const GcPtr& r) {
-    reset(r.p, r.meta);
-    return *this;
-  }
-  GcPtr& operator=(GcPtr&& r) {
-    reset(r.p, r.meta);
-    r.meta = 0;
-    r.p = 0;
-    return *this;
-  }
-  T* operator->() const { return p; }
-  T& operator*() const { return *p; }
-  explicit operator bool() const { return p && meta; }
-  bool operator==(const GcPtr& r) const { return p == r.p; }
-  bool operator!=(const GcPtr& r) const { return p != r.p; }
-  GcPtr& operator=(T* ptr) = delete;
-  GcPtr& operator=(nullptr_t) {
-    meta = 0;
-    p = 0;
-    return *this;
-  }
-  bool operator<(const GcPtr& r) const { return *p < *r.p; }
-
-  // Methods
-
-  void reset(T* o, ObjMeta* n) {
-    p = o;
-    meta = n;
-    onPtrChanged();
-  }
-
- protected:
-  T* p = nullptr;
-};
-
-static_assert(sizeof(GcPtr<int>) <= sizeof(void*) * 3,
-              "too large for small object");
-
-template <typename T>
-class gc : public GcPtr<T> {
-  using base = GcPtr<T>;
-
- public:
-  using GcPtr<T>::GcPtr;
-  gc() {}
-  gc(nullptr_t) {}
-  gc(ObjMeta* o) : base(o) {}
-  explicit gc(T* o) : base(o) {}
-};
-
-#define TGC_DECL_AUTO_BOX(T, GcAliasName)                    \
-  template <>                                                \
-  class details::gc<T> : public details::GcPtr<T> {          \
-   public:                                                   \
-    using GcPtr<T>::GcPtr;                                   \
-    gc(const T& i) : GcPtr(details::gc_new_meta<T>(1, i)) {} \
-    gc() {}                                                  \
-    gc(nullptr_t) {}                                         \
-    operator T&() { return operator*(); }                    \
-    operator T&() const { return operator*(); }              \
-  };                                                         \
-  using GcAliasName = gc<T>;
-
-//////////////////////////////////////////////////////////////////////////
-
-class Collector {
-  friend class ClassMeta;
-  friend class PtrBase;
-
- public:
-  static Collector* get();
-  void onPointerChanged(PtrBase* p);
-  void registerPtr(PtrBase* p);
-  void unregisterPtr(PtrBase* p);
-  ObjMeta* globalFindOwnerMeta(void* obj);
-  void collect(int stepCnt);
-  void dumpStats();
-
-  enum class State { RootMarking, LeafMarking, Sweeping, MaxCnt };
-
- private:
-  Collector();
-  ~Collector();
-
-  void tryMarkRoot(PtrBase* p);
-  ObjMeta* findCreatingObj(PtrBase* p);
-  void addMeta(ObjMeta* meta);
-
- private:
-  using MetaSet = unordered_set<ObjMeta*>;
-
-  vector<PtrBase*> pointers;
-  vector<ObjMeta*> grayObjs;
-  MetaSet metaSet;
-  // stack is no feasible for multi-threaded version.
-  list<ObjMeta*> creatingObjs;
-  MetaSet::iterator nextSweeping;
-  size_t nextRootMarking = 0;
-  State state = State::RootMarking;
-  shared_mutex mutex;
-  int freeObjCntOfPrevGc;
-
-  static Collector* inst;
-};
-
-inline void gc_collect(int steps = 256) {
-  Collector::get()->collect(steps);
-}
-
-inline void gc_dumpStats() {
-  Collector::get()->dumpStats();
-}
-
-template <typename T, typename... Args>
-ObjMeta* gc_new_meta(size_t len, Args&&... args) {
-  auto* cls = ClassMeta::get<T>();
-  auto* meta = cls->newMeta(len);
-
-  size_t i = 0;
-  auto* p = (T*)meta->objPtr();
-  try {
-    for (; i < len; i++, p++)
-      new (p) T(forward<Args>(args)...);
-  } catch (...) {
-    for (auto j = i; j > 0; j--, p--) {
-      p->~T();
-    }
-    cls->endNewMeta(meta, true);
-    throw;
-  }
-
-  cls->endNewMeta(meta, false);
-  return meta;
-}
-
-template <typename T>
-void gc_delete(gc<T>& c) {
-  if (c) {
-    c.getMeta()->destroy();
-    c = nullptr;
-  }
-}
-
-// used as shared_from_this
-template <typename T>
-gc<T> gc_from(T* o) {
-  return gc<T>(o);
-}
-
-// used as std::shared_ptr
-template <typename To, typename From>
-gc<To> gc_static_pointer_cast(gc<From>& from) {
-  return from;
-}
-
-// used as std::shared_ptr
-template <typename To, typename From>
-gc<To> gc_dynamic_pointer_cast(gc<From>& from) {
-  gc<To> r;
-  r.reset(dynamic_cast<To*>(from.operator->()), from.getMeta());
-  return r;
-}
-
-template <typename T, typename... Args>
-gc<T> gc_new(Args&&... args) {
-  return gc_new_meta<T>(1, forward<Args>(args)...);
-}
-
-template <typename T, typename... Args>
-gc<T> gc_new_array(size_t len, Args&&... args) {
-  return gc_new_meta<T>(len, forward<Args>(args)...);
-}
-
-//////////////////////////////////////////////////////////////////////////
-/// Function
-
-template <typename T>
-class gc_function;
-
-template <typename R, typename... A>
-class gc_function<R(A...)> {
- public:
-  gc_function() {}
-
-  template <typename F>
-  gc_function(F&& f) : callable(gc_new_meta<Imp<F>>(1, forward<F>(f))) {}
-
-  template <typename F>
-  gc_function& operator=(F&& f) {
-    callable = gc_new_meta<Imp<F>>(1, forward<F>(f));
-    return *this;
-  }
-
-  template <typename... U>
-  R operator()(U&&... a) const {
-    return callable->call(forward<U>(a)...);
-  }
-
-  explicit operator bool() const { return (bool)callable; }
-  bool operator==(const gc_function& r) const { return callable == r.callable; }
-  bool operator!=(const gc_function& r) const { return callable != r.callable; }
-
- private:
-  struct Callable {
-    virtual ~Callable() {}
-    virtual R call(A... a) = 0;
-  };
-
-  template <typename F>
-  struct Imp : Callable {
-    F f;
-    Imp(F&& ff) : f(ff) {}
-    R call(A... a) override { return f(a...); }
-  };
-
- private:
-  gc<Callable> callable;
-};
-
-//////////////////////////////////////////////////////////////////////////
-// Wrap STL Containers
-//////////////////////////////////////////////////////////////////////////
-
-template <typename C>
-struct ContainerPtrEnumerator : IPtrEnumerator {
-  C* o;
-  typename C::iterator it;
-  ContainerPtrEnumerator(ObjMeta* m) : o((C*)m->objPtr()), it(o->begin()) {}
-  bool hasNext() { return it != o->end(); }
-};
-
-//////////////////////////////////////////////////////////////////////////
-/// Vector
-/// vector elements are not stored contiguously due to implementation
-/// limitation. use gc_new_array for better performance.
-
-template <typename T>
-class gc_vector : public gc<vector<gc<T>>> {
- public:
-  using gc<vector<gc<T>>>::gc;
-  gc<T>& operator[](int idx) { return (*this->p)[idx]; }
-};
-
-template <typename T>
-struct PtrEnumerator<vector<gc<T>>> : ContainerPtrEnumerator<vector<gc<T>>> {
-  using ContainerPtrEnumerator<vector<gc<T>>>::ContainerPtrEnumerator;
-
-  const PtrBase* getNext() override {
-    if (!this->hasNext())
-      return nullptr;
-    return &*this->it++;
-  }
-};
-
-template <typename T, typename... Args>
-gc_vector<T> gc_new_vector(Args&&... args) {
-  return gc_new_meta<vector<gc<T>>>(1, forward<Args>(args)...);
-}
-
-template <typename T>
-void gc_delete(gc_vector<T>& p) {
-  for (auto& i : *p) {
-    gc_delete(i);
-  }
-  p->clear();
-}
-
-//////////////////////////////////////////////////////////////////////////
-/// Deque
-
-template <typename T>
-class gc_deque : public gc<deque<gc<T>>> {
- public:
-  using gc<deque<gc<T>>>::gc;
-  gc<T>& operator[](int idx) { return (*this->p)[idx]; }
-};
-
-template <typename T>
-struct PtrEnumerator<deque<gc<T>>> : ContainerPtrEnumerator<deque<gc<T>>> {
-  using ContainerPtrEnumerator<deque<gc<T>>>::ContainerPtrEnumerator;
-
-  const PtrBase* getNext() override {
-    if (!this->hasNext())
-      return nullptr;
-    return &*this->it++;
-  }
-};
-
-template <typename T, typename... Args>
-gc_deque<T> gc_new_deque(Args&&... args) {
-  return gc_new_meta<deque<gc<T>>>(1, forward<Args>(args)...);
-}
-
-template <typename T>
-void gc_delete(gc_deque<T>& p) {
-  for (auto& i : *p) {
-    gc_delete(i);
-  }
-  p->clear();
-}
-
-//////////////////////////////////////////////////////////////////////////
-/// List
-
-template <typename T>
-using gc_list = gc<list<gc<T>>>;
-
-template <typename T>
-struct PtrEnumerator<list<gc<T>>> : ContainerPtrEnumerator<list<gc<T>>> {
-  using ContainerPtrEnumerator<list<gc<T>>>::ContainerPtrEnumerator;
-
-  const PtrBase* getNext() override {
-    if (!this->hasNext())
-      return nullptr;
-    return &*this->it++;
-  }
-};
-
-template <typename T, typename... Args>
-gc_list<T> gc_new_list(Args&&... args) {
-  return gc_new_meta<list<gc<T>>>(1, forward<Args>(args)...);
-}
-
-template <typename T>
-void gc_delete(gc_list<T>& p) {
-  for (auto& i : *p) {
-    gc_delete(i);
-  }
-  p->clear();
-}
-
-//////////////////////////////////////////////////////////////////////////
-/// Map
-/// TODO: NOT support using gc object as key...
-
-template <typename K, typename V>
-class gc_map : public gc<map<K, gc<V>>> {
- public:
-  using gc<map<K, gc<V>>>::gc;
-  gc<V>& operator[](const K& k) { return (*this->p)[k]; }
-};
-
-template <typename K, typename V>
-struct PtrEnumerator<map<K, gc<V>>> : ContainerPtrEnumerator<map<K, gc<V>>> {
-  using ContainerPtrEnumerator<map<K, gc<V>>>::ContainerPtrEnumerator;
-
-  const PtrBase* getNext() override {
-    if (!this->hasNext())
-      return nullptr;
-    auto* ret = &this->it->second;
-    ++this->it;
-    return ret;
-  }
-};
-
-template <typename K, typename V, typename... Args>
-gc_map<K, V> gc_new_map(Args&&... args) {
-  return gc_new_meta<map<K, gc<V>>>(1, forward<Args>(args)...);
-}
-
-template <typename K, typename V>
-void gc_delete(gc_map<K, V>& p) {
-  for (auto& i : *p) {
-    gc_delete(i->value);
-  }
-  p->clear();
-}
-
-//////////////////////////////////////////////////////////////////////////
-/// HashMap
-/// TODO: NOT support using gc object as key...
-
-template <typename K, typename V>
-class gc_unordered_map : public gc<unordered_map<K, gc<V>>> {
- public:
-  using gc<unordered_map<K, gc<V>>>::gc;
-  gc<V>& operator[](const K& k) { return (*this->p)[k]; }
-};
-
-template <typename K, typename V>
-struct PtrEnumerator<unordered_map<K, gc<V>>>
-    : ContainerPtrEnumerator<unordered_map<K, gc<V>>> {
-  using ContainerPtrEnumerator<unordered_map<K, gc<V>>>::ContainerPtrEnumerator;
-
-  const PtrBase* getNext() override {
-    if (!this->hasNext())
-      return nullptr;
-    auto* ret = &this->it->second;
-    ++this->it;
-    return ret;
-  }
-};
-
-template <typename K, typename V, typename... Args>
-gc_unordered_map<K, V> gc_new_unordered_map(Args&&... args) {
-  return gc_new_meta<unordered_map<K, gc<V>>>(1, forward<Args>(args)...);
-}
-template <typename K, typename V>
-void gc_delete(gc_unordered_map<K, V>& p) {
-  for (auto& i : *p) {
-    gc_delete(i.second);
-  }
-  p->clear();
-}
-
-//////////////////////////////////////////////////////////////////////////
-/// Set
-
-template <typename V>
-using gc_set = gc<set<gc<V>>>;
-
-template <typename V>
-struct PtrEnumerator<set<gc<V>>> : ContainerPtrEnumerator<set<gc<V>>> {
-  using ContainerPtrEnumerator<set<gc<V>>>::ContainerPtrEnumerator;
-
-  const PtrBase* getNext() override {
-    if (!this->hasNext())
-      return nullptr;
-    return &*this->it++;
-  }
-};
-
-template <typename V, typename... Args>
-gc_set<V> gc_new_set(Args&&... args) {
-  return gc_new_meta<set<gc<V>>>(1, forward<Args>(args)...);
-}
-
-template <typename T>
-void gc_delete(gc_set<T>& p) {
-  for (auto i : *p) {
-    gc_delete(i);
-  }
-  p->clear();
-}
-
-}  // namespace details
-
-//////////////////////////////////////////////////////////////////////////
-// Public APIs
-
-using details::gc;
-using details::gc_collect;
-using details::gc_dumpStats;
-using details::gc_dynamic_pointer_cast;
-using details::gc_from;
-using details::gc_function;
-using details::gc_new;
-using details::gc_new_array;
-using details::gc_static_pointer_cast;
-
-using details::gc_new_vector;
-using details::gc_vector;
-
-using details::gc_deque;
-using details::gc_new_deque;
-
-using details::gc_list;
-using details::gc_new_list;
-
-using details::gc_map;
-using details::gc_new_map;
-
-using details::gc_new_set;
-using details::gc_set;
-
-using details::gc_new_unordered_map;
-using details::gc_unordered_map;
-
-TGC_DECL_AUTO_BOX(char, gc_char);
-TGC_DECL_AUTO_BOX(unsigned char, gc_uchar);
-TGC_DECL_AUTO_BOX(short, gc_short);
-TGC_DECL_AUTO_BOX(unsigned short, gc_ushort);
-TGC_DECL_AUTO_BOX(int, gc_int);
-TGC_DECL_AUTO_BOX(unsigned int, gc_uint);
-TGC_DECL_AUTO_BOX(float, gc_float);
-TGC_DECL_AUTO_BOX(double, gc_double);
-TGC_DECL_AUTO_BOX(long, gc_long);
-TGC_DECL_AUTO_BOX(unsigned long, gc_ulong);
-TGC_DECL_AUTO_BOX(std::string, gc_string);
-
-}  // namespace tgc
+/*
+
+TGC: Tiny incremental mark & sweep Garbage Collector.
+
+//////////////////////////////////////////////////////////////////////////
+
+Copyright (C) 2018 soniced@sina.com
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of
+this software and associated documentation files (the "Software"), to deal in
+the Software without restriction, including without limitation the rights to
+use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+the Software, and to permit persons to whom the Software is furnished to do so,
+subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+*/
+
+#pragma once
+
+//#define TGC_MULTI_THREADED
+
+// 8 bytes object header referring the class by index, instead of 16.
+//#define TGC_COMPACT_HEADER
+
+// 8 bytes GC pointers referring objects by 32-bit offsets in a reserved heap,
+// pointing to a target not 8 aligned throws std::invalid_argument.
+//#define TGC_COMPRESSED_PTRS
+
+// acyclic objects (see TGC_DECL_ACYCLIC) are freed as soon as they are not
+// referenced, tracing is still needed by the others.
+//#define TGC_DEFERRED_RC
+
+// each collecting call runs a whole cycle, so pointer stores need no write
+// barrier. Mutators must not run while collecting, hence single-threaded.
+//#define TGC_STOP_THE_WORLD
+
+// address space reserved for the small objects (for all the objects with
+// TGC_COMPRESSED_PTRS, at most 32GB), 32GB on 64-bit and 256MB on 32-bit by
+// default. It caps the heap: allocations beyond it throw gc_heap_exhausted.
+// Only the touched pages are committed.
+//#define TGC_HEAP_RESERVE (64ull << 30)
+
+#if defined(TGC_STOP_THE_WORLD) && defined(TGC_MULTI_THREADED)
+#error "stop-the-world collecting can not stop the other threads"
+#endif
+
+#include <bitset>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <memory_resource>
+#include <set>
+#include <stdexcept>
+#include <string_view>
+#include <typeinfo>
+#include <vector>
+#ifdef TGC_MULTI_THREADED
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#endif
+
+// for STL wrappers
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace tgc {
+namespace details {
+
+using namespace std;
+
+#ifndef TGC_MULTI_THREADED
+
+struct mutex {
+  void lock() {}
+  void unlock() {}
+};
+struct shared_mutex {};
+struct recursive_mutex {};
+struct unique_lock {
+  unique_lock(...) {}
+};
+struct shared_lock {
+  shared_lock(...) {}
+};
+template <typename T>
+struct atomic {
+  T value;
+  atomic(T v) : value{v} {}
+  void operator++(int) { value++; }
+  void operator--(int) { value--; }
+  operator const T&() const { return value; }
+  bool operator==(const T& r) const { return value == r; }
+};
+
+#endif
+
+class ObjMeta;
+class ClassMeta;
+class PtrBase;
+class IPtrEnumerator;
+class WeakPtrBase;
+class EphemeronTableBase;
+class gc_memory_resource;
+class gc_site;
+
+//////////////////////////////////////////////////////////////////////////
+
+class alignas(8) ObjMeta {
+ public:
+  enum class Color : unsigned char { White, Gray, Black };
+  using LengthType = unsigned short;
+  // longer lengths are stored in a 64-bit word after the header.
+  static constexpr LengthType LongLength = 0xffff;
+  struct Less {
+    bool operator()(ObjMeta* x, ObjMeta* y) const { return *x < *y; }
+  };
+
+#ifdef TGC_COMPACT_HEADER
+  // slot in the class table, see ClassMeta::fromIndex.
+  uint32_t classIndex = 0;
+#else
+  ClassMeta* classPtr = nullptr;
+#endif
+  atomic<Color> color = Color::White;
+  unsigned char destroyed : 1;
+  unsigned char sampled : 1;
+  // allocated in a gc_region not exited yet.
+  unsigned char inRegion : 1;
+  // swept once and survived, see HeapProfiler::onSurvived.
+  unsigned char aged : 1;
+  // allocated by gc_new(site, ...) and not aged yet.
+  unsigned char sited : 1;
+  LengthType arrayLength = 0;
+#ifdef TGC_DEFERRED_RC
+  static constexpr uint32_t NotCounted = UINT32_MAX;
+  // changed in batches by Collector::flushRc.
+  uint32_t refCnt = NotCounted;
+#endif
+
+  static char* dummyObjPtr;
+
+  ObjMeta(ClassMeta* c, size_t n);
+  ~ObjMeta() { destroy(); }
+  ClassMeta* klass() const;
+  void operator delete(void* c);
+  bool operator<(ObjMeta& r) const;
+  bool containsPtr(char* p);
+  char* objPtr() const;
+  size_t length() const {
+    return arrayLength == LongLength ? *(uint64_t*)(this + 1) : arrayLength;
+  }
+  size_t allocSize() const;
+  void destroy();
+
+  static size_t headerSize(size_t n);
+};
+
+#if defined(TGC_COMPACT_HEADER) && !defined(TGC_DEFERRED_RC)
+static_assert(sizeof(ObjMeta) == 8, "compact header should be 8 bytes");
+#elif !defined(TGC_DEFERRED_RC)
+static_assert(sizeof(ObjMeta) <= sizeof(void*) * 2,
+              "too large for small allocation");
+#else
+static_assert(sizeof(ObjMeta) <= 16, "too large for small allocation");
+#endif
+
+// objects follow the header in 16 bytes aligned slots, e.g. only 8 bytes
+// aligned with TGC_COMPACT_HEADER.
+constexpr size_t MaxObjAlign = sizeof(ObjMeta) % 16 ? 8 : 16;
+
+inline size_t ObjMeta::headerSize(size_t n) {
+  // the long length is padded to keep the objects aligned.
+  return sizeof(ObjMeta) + (n >= LongLength ? MaxObjAlign : 0);
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+#ifndef TGC_HEAP_RESERVE
+#define TGC_HEAP_RESERVE (sizeof(void*) == 8 ? 32ull << 30 : 256ull << 20)
+#endif
+
+// Thrown when TGC_HEAP_RESERVE is used up or can not be reserved, even after
+// a full collection.
+class gc_heap_exhausted : public std::bad_alloc {
+ public:
+  const char* what() const noexcept override {
+    return "tgc: heap reservation exhausted, see TGC_HEAP_RESERVE";
+  }
+};
+
+// Small objects are carved from pages of size classes in one reserved
+// address range, the header is found from any address inside an object by
+// the page table.
+//
+// Large objects are mapped separately & unmapped as soon as they are freed.
+// When TGC_COMPRESSED_PTRS is defined they are spans of pages in the range
+// instead, so references can always be 32-bit offsets (in 8 bytes granules)
+// from the base.
+//
+// Sweeping is lazy: after marking, allocations only take slots from swept
+// pages, a size class running out of slots sweeps its own pages first.
+class Heap {
+ public:
+  using Ref = uint32_t;
+  static constexpr int PageBits = 16;
+  static constexpr size_t PageSize = (size_t)1 << PageBits;
+  static constexpr size_t MaxSmallSize = PageSize / 2;
+  static constexpr size_t ReservedSize = TGC_HEAP_RESERVE;
+#ifdef TGC_COMPRESSED_PTRS
+  static_assert(ReservedSize <= (8ull << 32), "32-bit refs of 8 bytes units");
+#endif
+
+  // Arenas of gc_region, objects are bump allocated in chunks found like the
+  // ones of heap images. The chunks are released at once, or adopted and
+  // released when all their objects are freed.
+  struct Arena {
+    vector<char*> chunks;
+    char *cursor = nullptr, *end = nullptr;
+    // offsets of the objects in the last chunk.
+    vector<size_t>* objs = nullptr;
+  };
+
+  struct Page {
+    // 0 for pages of large objects.
+    uint32_t slotSize;
+    // ceil(2^32 / slotSize), offset * recip >> 32 is the slot index.
+    uint32_t recip;
+    // first page of the large object, 0 for heap images.
+    uint32_t spanStart;
+    // free slots of unswept pages are not in the free list.
+    bool unswept;
+    // holds buffers of gc_memory_resource rather than objects.
+    bool buffer;
+    union {
+      // bitmap of the allocated slots.
+      uint64_t* used;
+      // owner of the arena chunks.
+      Arena* arena;
+    };
+  };
+
+  // Buffers are kept in their own pages, never swept nor seen as objects,
+  // empty pages of them are released at the end of cycles.
+  static void* alloc(size_t size, bool buffer = false);
+  // slots are bump allocated in fresh pages, i.e. contiguous when possible.
+  static void allocBatch(size_t size, size_t cnt, void** out);
+  static void free(void* p);
+  static size_t largeObjectBytes();
+  static void getObjs(vector<ObjMeta*>& objs);
+
+  // Objects of an unswept page are listed by takeUnswept and the free slots
+  // are given back by endSweep. Pass size 0 to take a page of any class,
+  // otherwise a page is taken only if the size class has no free slot.
+  static void startSweep();
+  static size_t takeUnswept(size_t size, vector<ObjMeta*>& objs);
+  static void endSweep(size_t page);
+  static ObjMeta* takeUnsweptLarge();
+
+  // Empty pages are kept for reuse and returned to the OS after staying free
+  // for idleCycles collecting cycles (0 for immediately), the oldest ones go
+  // earlier when more than retainedBytes are kept.
+  static void setTrimPolicy(size_t idleCycles, size_t retainedBytes);
+  // returns all the empty pages to the OS, returns the released bytes.
+  static size_t trim();
+  static void endCycle();
+
+  struct Usage {
+    size_t committedBytes, retainedBytes, trimmedBytes;
+  };
+  static Usage getUsage();
+
+  // Regions of restored heap images are never swept, objects inside are
+  // found by their offsets.
+  static char* allocImage(size_t size, vector<size_t> objOffsets);
+  static void protectImage(char* p);
+  static void freeImage(char* p);
+  static bool inImage(const void* p);
+
+  // allocations of the calling thread go to the arena while it is set,
+  // returns the previous one.
+  static Arena* setArena(Arena* a);
+  static Arena* currentArena();
+  static Arena* arenaOf(const void* p) {
+    auto offset = (size_t)((const char*)p - base);
+    if (offset >= ReservedSize)
+      return nullptr;
+    auto& page = pages[offset >> PageBits];
+    return page.slotSize || page.spanStart ? nullptr : page.arena;
+  }
+  static void freeArena(Arena& a);
+  static void adoptArena(Arena& a);
+
+  static Ref encode(const void* p) {
+    // e.g. a base class at offset 4 of the object, the low bits would be lost.
+    if ((size_t)p & 7)
+      throw invalid_argument("tgc: compressed pointer target not 8 aligned");
+    return p ? (Ref)(((const char*)p - base) >> 3) : 0;
+  }
+  static void* decode(Ref r) { return r ? base + ((size_t)r << 3) : nullptr; }
+  static ObjMeta* findMeta(const void* p) {
+    auto offset = (size_t)((const char*)p - base);
+    if (offset >= ReservedSize)
+      return findLargeMeta(p);
+    auto* page = &pages[offset >> PageBits];
+    if (!page->slotSize)
+      return page->spanStart
+                 ? (ObjMeta*)(base + ((size_t)page->spanStart << PageBits))
+                 : findLargeMeta(p);
+    auto inPage = offset & (PageSize - 1);
+    auto slot = (size_t)(((uint64_t)inPage * page->recip) >> 32);
+    return (ObjMeta*)(base + (offset - inPage) + slot * page->slotSize);
+  }
+
+ private:
+  static void init();
+  static void* allocLocked(size_t size, bool buffer);
+  static void freeLocked(void* p);
+  static ObjMeta* findLargeMeta(const void* p);
+  static void* allocArena(Arena& a, size_t size);
+  static void releaseArenaChunk(char* p);
+  static char* base;
+  static Page* pages;
+};
+
+//////////////////////////////////////////////////////////////////////////
+
+class IPtrEnumerator {
+ public:
+  virtual ~IPtrEnumerator() {}
+  virtual const PtrBase* getNext() = 0;
+
+  void* operator new(size_t sz) {
+    static char buf[255];
+    assert(sz <= sizeof(buf));
+    return buf;
+  }
+  void operator delete(void*) {}
+};
+
+class ObjPtrEnumerator : public IPtrEnumerator {
+  size_t subPtrIdx = 0, arrayElemIdx = 0;
+  ObjMeta* meta = nullptr;
+
+ public:
+  ObjPtrEnumerator(ObjMeta* m) : meta(m) {}
+  const PtrBase* getNext() override;
+};
+
+template <typename T>
+struct PtrEnumerator : ObjPtrEnumerator {
+  using ObjPtrEnumerator::ObjPtrEnumerator;
+};
+
+// Specialize it (see TGC_DECL_ACYCLIC) for classes whose objects can never
+// be part of a cycle, they are reference counted under TGC_DEFERRED_RC.
+template <typename T>
+struct gc_acyclic : integral_constant<bool, is_arithmetic<T>::value ||
+                                                is_enum<T>::value> {};
+
+#define TGC_DECL_ACYCLIC(T) \
+  template <>               \
+  struct tgc::details::gc_acyclic<T> : std::true_type {};
+
+//////////////////////////////////////////////////////////////////////////
+
+class ClassMeta {
+ public:
+  enum class State : unsigned char { Unregistered, Registered };
+  enum class MemRequest {
+    Alloc,
+    AllocBatch,
+    Dctor,
+    Dealloc,
+    NewPtrEnumerator,
+    TypeInfo
+  };
+  using MemHandler = void* (*)(ClassMeta* cls, MemRequest r, void* param);
+  using OffsetType = uint32_t;
+  using SizeType = uint32_t;
+  using IndexType = uint32_t;
+
+  MemHandler memHandler = nullptr;
+  vector<OffsetType>* subPtrOffsets = nullptr;
+  SizeType size = 0;
+  // slot in the class table, assigned at the first allocation.
+  IndexType index : 24;
+  State state : 8;
+
+#ifdef TGC_MULTI_THREADED
+  shared_mutex mutex;
+#else
+  static shared_mutex mutex;
+#endif
+
+  static atomic<int> isCreatingObj;
+  static ClassMeta dummy;
+
+  // Classes are indexed in the order of their first allocation, chunks of
+  // the table are never moved so lookups need no lock.
+  static constexpr int TableChunkBits = 10;
+  static constexpr size_t TableChunkSize = 1 << TableChunkBits;
+  static ClassMeta** table[1024];
+  static ClassMeta* fromIndex(IndexType i) {
+    return table[i >> TableChunkBits][i & (TableChunkSize - 1)];
+  }
+
+  ClassMeta() : index(0), state(State::Unregistered) {}
+  ClassMeta(MemHandler h, SizeType sz)
+      : memHandler(h), size(sz), index(0), state(State::Unregistered) {}
+  ~ClassMeta() { delete subPtrOffsets; }
+
+  // Objects of gc_new_batch are allocated and added together, they are kept
+  // alive as the creating objects until the whole batch is constructed.
+  struct Batch {
+    vector<ObjMeta*> metas;
+    // the one under construction.
+    atomic<size_t> next{0};
+  };
+
+  // the object pointer must be inside the slot for empty arrays too.
+  size_t allocSize(size_t objCnt) const {
+    return ObjMeta::headerSize(objCnt) + (objCnt ? size * objCnt : 1);
+  }
+  ObjMeta* newMeta(size_t objCnt, gc_site* site = nullptr);
+  void newMetas(size_t cnt, Batch& b);
+  void registerSubPtr(ObjMeta* owner, PtrBase* p);
+  void endNewMeta(ObjMeta* meta, bool failed);
+  // metas from the failed one are discarded.
+  void endNewMetas(Batch& b, bool failed);
+  IPtrEnumerator* enumPtrs(ObjMeta* m) {
+    return (IPtrEnumerator*)memHandler(this, MemRequest::NewPtrEnumerator, m);
+  }
+  const type_info& typeInfo() {
+    return *(const type_info*)memHandler(this, MemRequest::TypeInfo, nullptr);
+  }
+
+  template <typename T>
+  static ClassMeta* get() {
+    return &Holder<T>::inst;
+  }
+
+ private:
+  // frees an object failed to construct, the collector is locked.
+  void discardMeta(ObjMeta* meta);
+
+  template <typename T>
+  struct Holder {
+    static void* MemHandler(ClassMeta* cls, MemRequest r, void* param) {
+      switch (r) {
+        case MemRequest::Alloc: {
+          auto cnt = (size_t)param;
+          auto* p = Heap::alloc(cls->allocSize(cnt));
+          auto* meta = new (p) ObjMeta(cls, cnt);
+#ifdef TGC_DEFERRED_RC
+          if (gc_acyclic<T>::value)
+            meta->refCnt = 0;
+#endif
+          return meta;
+        }
+        case MemRequest::AllocBatch: {
+          auto& metas = *(vector<ObjMeta*>*)param;
+          Heap::allocBatch(cls->allocSize(1), metas.size(),
+                           (void**)metas.data());
+          for (auto*& m : metas) {
+            m = new (m) ObjMeta(cls, 1);
+#ifdef TGC_DEFERRED_RC
+            if (gc_acyclic<T>::value)
+              m->refCnt = 0;
+#endif
+          }
+        } break;
+        case MemRequest::Dealloc:
+          Heap::free(param);
+          break;
+        case MemRequest::Dctor: {
+          auto meta = (ObjMeta*)param;
+          auto p = (T*)meta->objPtr();
+          for (size_t i = 0, n = meta->length(); i < n; i++, p++) {
+            p->~T();
+          }
+        } break;
+        case MemRequest::NewPtrEnumerator: {
+          auto meta = (ObjMeta*)param;
+          return new PtrEnumerator<T>(meta);
+        } break;
+        case MemRequest::TypeInfo:
+          return (void*)&typeid(T);
+      }
+      return nullptr;
+    }
+
+    static ClassMeta inst;
+  };
+};
+
+template <typename T>
+ClassMeta ClassMeta::Holder<T>::inst{MemHandler, sizeof(T)};
+
+#ifndef TGC_MULTI_THREADED
+static_assert(sizeof(ClassMeta) <= sizeof(void*) * 3,
+              "too large for lambda heavy programs");
+#endif
+
+#ifdef TGC_COMPACT_HEADER
+inline ObjMeta::ObjMeta(ClassMeta* c, size_t n)
+    : classIndex(c->index), destroyed(0), sampled(0), inRegion(0), aged(0),
+      sited(0), arrayLength(n < LongLength ? (LengthType)n : LongLength) {
+  if (arrayLength == LongLength)
+    *(uint64_t*)(this + 1) = n;
+}
+
+inline ClassMeta* ObjMeta::klass() const {
+  return ClassMeta::fromIndex(classIndex);
+}
+#else
+inline ObjMeta::ObjMeta(ClassMeta* c, size_t n)
+    : classPtr(c), destroyed(0), sampled(0), inRegion(0), aged(0), sited(0),
+      arrayLength(n < LongLength ? (LengthType)n : LongLength) {
+  if (arrayLength == LongLength)
+    *(uint64_t*)(this + 1) = n;
+}
+
+inline ClassMeta* ObjMeta::klass() const {
+  return classPtr;
+}
+#endif
+
+//////////////////////////////////////////////////////////////////////////
+
+class PtrBase {
+  friend class Collector;
+  friend class ClassMeta;
+
+ public:
+#ifdef TGC_COMPRESSED_PTRS
+  ObjMeta* getMeta() const { return ref ? Heap::findMeta(getObj()) : nullptr; }
+#else
+  ObjMeta* getMeta() const { return meta; }
+#endif
+
+ protected:
+  PtrBase();
+  PtrBase(void* obj);
+  ~PtrBase();
+#ifdef TGC_STOP_THE_WORLD
+  // no cycle is in progress while the mutator runs.
+  void onPtrChanged() {}
+#else
+  void onPtrChanged();
+#endif
+
+#ifdef TGC_COMPRESSED_PTRS
+  void* getObj() const { return Heap::decode(ref); }
+  void assignObj(void* o, ObjMeta*) { ref = Heap::encode(o); }
+  void assignObj(void* o, const PtrBase&) { ref = Heap::encode(o); }
+#else
+  void* getObj() const { return obj; }
+  void assignObj(void* o, ObjMeta* m) {
+    obj = o;
+    meta = m;
+  }
+  void assignObj(void* o, const PtrBase& r) {
+    obj = o;
+    meta = r.meta;
+  }
+#endif
+
+  // Targets are tracked for the reference counting and the gc_region scopes.
+  template <typename M>
+  void setObj(void* o, const M& m) {
+#ifndef TGC_DEFERRED_RC
+    if (!regionCnt) {
+      assignObj(o, m);
+      return;
+    }
+#endif
+#if defined(TGC_DEFERRED_RC) && defined(TGC_MULTI_THREADED)
+    RcLogScope scope;
+#endif
+    auto* old = getMeta();
+    assignObj(o, m);
+    auto* cur = getMeta();
+    if (cur != old && (isTracked(cur) || isTracked(old)))
+      onTargetChanged(isTracked(cur) ? cur : nullptr,
+                      isTracked(old) ? old : nullptr);
+  }
+  static bool isTracked(ObjMeta* m) {
+    if (!m)
+      return false;
+#ifdef TGC_DEFERRED_RC
+    if (m->refCnt != ObjMeta::NotCounted)
+      return true;
+#endif
+    return m->inRegion;
+  }
+  void onTargetChanged(ObjMeta* cur, ObjMeta* old);
+#if defined(TGC_DEFERRED_RC) && defined(TGC_MULTI_THREADED)
+  // Holds the counting log of the thread, so a flush never sees a target
+  // stored but not counted yet.
+  struct RcLogScope {
+    RcLogScope() { lockRcLog(); }
+    ~RcLogScope() { unlockRcLog(); }
+  };
+  static void lockRcLog();
+  static void unlockRcLog();
+#endif
+
+  // number of the gc_region scopes not exited.
+  static atomic<int> regionCnt;
+
+ protected:
+#ifdef TGC_COMPRESSED_PTRS
+  Heap::Ref ref = 0;
+#else
+  ObjMeta* meta = nullptr;
+  void* obj = nullptr;
+#endif
+  mutable unsigned int isRoot : 1;
+  // slot in the root list, unused by the interior pointers.
+  unsigned int index : 31;
+};
+
+template <typename T>
+class GcPtr : public PtrBase {
+ public:
+  using pointee = T;
+  using element_type = T;  // compatible with std::shared_ptr
+
+  template <typename U>
+  friend class GcPtr;
+
+ public:
+  // Constructors
+
+  GcPtr() {}
+  GcPtr(ObjMeta* meta) { reset((T*)meta->objPtr(), meta); }
+  explicit GcPtr(T* obj) : PtrBase(obj) {}
+  template <typename U>
+  GcPtr(const GcPtr<U>& r) {
+    resetFrom(static_cast<T*>(r.get()), r);
+  }
+  GcPtr(const GcPtr& r) { resetFrom(r.get(), r); }
+  GcPtr(GcPtr&& r) {
+    resetFrom(r.get(), r);
+    r = nullptr;
+  }
+
+  // Operators
+
+  template <typename U>
+  GcPtr& operator=(const GcPtr<U>& r) {
+    resetFrom(r.get(), r);
+    return *this;
+  }
+  GcPtr& operator=(const GcPtr& r) {
+    resetFrom(r.get(), r);
+    return *this;
+  }
+  GcPtr& operator=(GcPtr&& r) {
+    resetFrom(r.get(), r);
+    r = nullptr;
+    return *this;
+  }
+  T* operator->() const { return get(); }
+  T& operator*() const { return *get(); }
+  explicit operator bool() const { return get() != nullptr; }
+  bool operator==(const GcPtr& r) const { return get() == r.get(); }
+  bool operator!=(const GcPtr& r) const { return get() != r.get(); }
+  GcPtr& operator=(T* ptr) = delete;
+  GcPtr& operator=(nullptr_t) {
+    setObj(nullptr, nullptr);
+    return *this;
+  }
+  bool operator<(const GcPtr& r) const { return *get() < *r.get(); }
+
+  // Methods
+
+  T* get() const { return (T*)getObj(); }
+  void reset(T* o, ObjMeta* n) {
+    setObj(o, n);
+    onPtrChanged();
+  }
+
+ protected:
+  void resetFrom(T* o, const PtrBase& r) {
+    setObj(o, r);
+    onPtrChanged();
+  }
+};
+
+#ifdef TGC_COMPRESSED_PTRS
+static_assert(sizeof(GcPtr<int>) == 8, "compressed pointer should be 8 bytes");
+#else
+static_assert(sizeof(GcPtr<int>) <= sizeof(void*) * 3,
+              "too large for small object");
+#endif
+
+template <typename T>
+class gc : public GcPtr<T> {
+  using base = GcPtr<T>;
+
+ public:
+  using GcPtr<T>::GcPtr;
+  gc() {}
+  gc(nullptr_t) {}
+  gc(ObjMeta* o) : base(o) {}
+  explicit gc(T* o) : base(o) {}
+};
+
+#define TGC_DECL_AUTO_BOX(T, GcAliasName)                    \
+  template <>                                                \
+  class details::gc<T> : public details::GcPtr<T> {          \
+   public:                                                   \
+    using GcPtr<T>::GcPtr;                                   \
+    gc(const T& i) : GcPtr(details::gc_new_meta<T>(1, i)) {} \
+    gc() {}                                                  \
+    gc(nullptr_t) {}                                         \
+    operator T&() { return operator*(); }                    \
+    operator T&() const { return operator*(); }              \
+  };                                                         \
+  using GcAliasName = gc<T>;
+
+//////////////////////////////////////////////////////////////////////////
+
+// HDR style log-linear histogram: values are bucketed by magnitude and the
+// top bits below it, giving a constant relative precision (~6%) over the
+// whole range with a fixed memory footprint and O(1) recording.
+class PauseHistogram {
+ public:
+  static constexpr int SubBucketBits = 4;
+  static constexpr int SubBucketCnt = 1 << SubBucketBits;
+  static constexpr int BucketCnt = SubBucketCnt * (64 - SubBucketBits + 1);
+
+  void record(uint64_t ns);
+  void reset();
+  uint64_t count() const { return totalCnt; }
+  uint64_t max() const { return maxNs; }
+  uint64_t mean() const { return totalCnt ? totalNs / totalCnt : 0; }
+  // returns the upper bound of the bucket holding the given percentile.
+  uint64_t percentile(double pct) const;
+
+ private:
+  static size_t bucketOf(uint64_t ns);
+  static uint64_t bucketUpperBound(size_t idx);
+
+  uint64_t buckets[BucketCnt] = {};
+  uint64_t totalCnt = 0, totalNs = 0, maxNs = 0;
+};
+
+//////////////////////////////////////////////////////////////////////////
+
+// Survival of objects to their first sweep, the ones freed with their
+// gc_region or by reference counting die young too. Mostly surviving classes
+// and sites are pretenured: their objects skip the arenas of gc_region, from
+// which they would be promoted, taking the whole region along.
+struct SurvivalStats {
+  // the decision is made again every Window objects.
+  static constexpr uint32_t Window = 128;
+  size_t survivedObjs = 0, diedObjs = 0;
+  uint32_t windowObjs = 0, windowSurvived = 0;
+  bool pretenured = false;
+
+  void add(bool survived);
+};
+
+// Tags the objects of gc_new(site, ...) so they are pretenured by the survival
+// of the call site rather than of the class, should be static.
+class gc_site {
+  friend class HeapProfiler;
+
+ public:
+  explicit gc_site(const char* name) : name(name) {}
+  gc_site(const gc_site&) = delete;
+  gc_site& operator=(const gc_site&) = delete;
+
+  const char* name;
+  size_t allocatedObjs() const;
+  SurvivalStats survival() const;
+
+ private:
+  size_t allocCnt = 0;
+  SurvivalStats stats;
+  bool listed = false;
+};
+
+// Per-class live & allocated counters are always maintained (an indexed add
+// on allocation and free), call stacks are only captured for one in every
+// sampleInterval allocations after the profiler is started.
+class HeapProfiler {
+ public:
+  struct ClassStats {
+    ClassMeta* klass = nullptr;
+    size_t allocatedObjs = 0, allocatedBytes = 0;
+    size_t liveObjs = 0, liveBytes = 0;
+    SurvivalStats survival;
+  };
+
+  struct Site {
+    static constexpr int MaxFrames = 32;
+    ClassMeta* klass = nullptr;
+    void* frames[MaxFrames];
+    int frameCnt = 0;
+    size_t allocatedObjs = 0, allocatedBytes = 0;
+    size_t liveObjs = 0, liveBytes = 0;
+  };
+
+  void addClass(ClassMeta* cls);
+  void onAlloc(ObjMeta* meta, gc_site* site);
+  void onFree(ObjMeta* meta);
+  // the object is marked at its first sweep.
+  void onSurvived(ObjMeta* meta);
+  bool isPretenured(ClassMeta* cls, gc_site* site);
+  // buffers of gc_memory_resource are accounted to the class of the owner.
+  void onBufferAlloc(ObjMeta* owner, size_t bytes);
+  void onBufferFree(ObjMeta* owner, size_t bytes);
+  void start(size_t interval);
+  void stop();
+  vector<ClassStats> getClassStats();
+  void report();
+  bool dumpPprof(const char* path);
+
+  static string className(ClassMeta* cls);
+
+ private:
+  void sample(ObjMeta* meta);
+
+  vector<ClassStats> classes{1};
+  unordered_map<size_t, Site> sites;
+  unordered_map<ObjMeta*, size_t> sampledObjs;
+  vector<gc_site*> tagSites;
+  unordered_map<ObjMeta*, gc_site*> sitedObjs;
+  size_t sampleInterval = 1;
+  size_t allocsSinceSample = 0;
+  bool sampling = false;
+};
+
+//////////////////////////////////////////////////////////////////////////
+
+class Collector {
+  friend class ClassMeta;
+  friend class PtrBase;
+  friend class WeakPtrBase;
+  friend class EphemeronTableBase;
+  friend class gc_memory_resource;
+  friend class gc_site;
+
+ public:
+  static Collector* get();
+  void onPointerChanged(PtrBase* p);
+  void registerPtr(PtrBase* p);
+  void unregisterPtr(PtrBase* p);
+  ObjMeta* globalFindOwnerMeta(void* obj);
+  void collect(int stepCnt, bool stopAtCycleEnd = false);
+  // finishes the cycle in progress and runs a whole new one, returns false
+  // if called while collecting (e.g. from destructors).
+  bool collectFull();
+  // Runs the destructor of the target and clears the pointer. Reference
+  // counted targets no other pointer refers to are freed at once, unless
+  // reclaim is false: then they are freed by reclaimDeleted in one go.
+  // Immortal objects of heap images are left as is.
+  void deleteObj(PtrBase& p, bool reclaim = true);
+  void reclaimDeleted();
+  // The pointers the target holds in its containers (built outside of it)
+  // are owned by it from now on, instead of being roots until it's marked.
+  void adoptPtrs(const PtrBase& p);
+  void setHeapLimit(size_t hardLimit, size_t softTarget);
+  void dumpStats();
+
+  enum class State { RootMarking, LeafMarking, Sweeping, MaxCnt };
+
+  // Counters are maintained incrementally, taking a snapshot is O(1).
+  struct Stats {
+    using State = Collector::State;
+
+    struct Phase {
+      size_t slices = 0;
+      size_t steps = 0;
+      uint64_t totalPauseNs = 0;
+      uint64_t maxPauseNs = 0;
+    };
+
+    size_t allocatedObjs = 0, allocatedBytes = 0;
+    size_t freedObjs = 0, freedBytes = 0;
+    size_t liveObjs = 0, liveBytes = 0;
+    size_t pointers = 0, metas = 0, grayObjs = 0;
+    size_t cycles = 0;
+    size_t lastFreedObjs = 0;
+    // memory taken from the OS, the part kept in empty pages and the total
+    // returned by trimming.
+    size_t heapCommittedBytes = 0, heapRetainedBytes = 0;
+    size_t heapTrimmedBytes = 0;
+    // freed by reference counting, without tracing (TGC_DEFERRED_RC).
+    size_t rcFreedObjs = 0;
+    // freed with their gc_region, or escaped and left to the collector.
+    size_t regionFreedObjs = 0, regionPromotedObjs = 0;
+    // allocated in the heap rather than a gc_region by pretenuring.
+    size_t pretenuredObjs = 0;
+    // live buffers of gc_memory_resource, also counted in the bytes above.
+    size_t bufferBytes = 0;
+    // allocated and live bytes when the last cycle ended, for pacing.
+    size_t cycleEndAllocatedBytes = 0, cycleEndLiveBytes = 0;
+    // see gc_set_heap_limit.
+    size_t heapLimit = 0, heapSoftTarget = 0;
+    State state = State::RootMarking;
+    Phase phases[(int)State::MaxCnt];
+  };
+
+  Stats getStats();
+  // pass State::MaxCnt to get the histogram of the whole collecting slices.
+  PauseHistogram getPauseHistogram(State phase);
+
+  // Phase events are kept in a ring buffer and exported as Chrome trace
+  // json, timestamps are taken from steady_clock in microseconds.
+  void startTrace(size_t capacity);
+  void stopTrace();
+  bool dumpTrace(const char* path);
+
+  void startHeapProfiler(size_t sampleInterval);
+  void stopHeapProfiler();
+  vector<HeapProfiler::ClassStats> getClassStats();
+  void heapReport();
+  bool dumpHeapProfile(const char* path);
+  bool dumpHeapSnapshot(const char* path);
+
+  void registerImageClass(ClassMeta* cls);
+  bool saveImage(const PtrBase& root, const char* path);
+  ObjMeta* loadImage(ClassMeta* rootCls, const char* path, void** rootObj);
+
+  // Scope of gc_region, objects are added by ClassMeta::newMeta.
+  struct Region : Heap::Arena {
+    vector<ObjMeta*> objs;
+    // pointers outside the arena referring to the objects.
+    size_t externalRefs = 0;
+    // referred to by something not counted, e.g. the values of weak maps.
+    bool escaped = false;
+    Heap::Arena* prev = nullptr;
+  };
+  void enterRegion(Region& r);
+  void exitRegion(Region& r);
+
+#ifdef TGC_DEFERRED_RC
+  // Counting operations are buffered per thread and applied in batches, the
+  // buffers are drained together so they form a consistent cut.
+  struct RcLog {
+    mutex lock;
+    vector<ObjMeta*> incs, decs;
+  };
+  void logRc(ObjMeta* inc, ObjMeta* dec);
+  void flushRc();
+#endif
+
+ private:
+  Collector();
+  ~Collector();
+
+  void tryMarkRoot(PtrBase* p);
+  void removeRoot(PtrBase* p);
+  void demoteRoot(PtrBase* p);
+  ObjMeta* findCreatingObj(const void* p);
+  void registerClass(ClassMeta* cls);
+  void reserveHeap(size_t bytes);
+  bool markCreatingObjs();
+  void addMeta(ObjMeta* meta, gc_site* site);
+  void addBatch(ClassMeta::Batch& b);
+  void onMetaAdded(ObjMeta* meta, gc_site* site);
+  void onMetaFreed(ObjMeta* meta);
+  void onBufferAlloc(ObjMeta* owner, size_t bytes);
+  void onBufferFree(ObjMeta* owner, size_t bytes);
+  void addTraceEvent(int name, uint64_t beginNs, uint64_t endNs, int steps);
+  void pinPtr(PtrBase* p, ObjMeta* meta, void* obj);
+  void markGrayObjs(int& stepCnt);
+  bool markEphemerons(int& stepCnt);
+  void clearWeakRefs();
+  void sweepFor(size_t bytes);
+  bool sweepPage(int& stepCnt);
+  void sweepObj(ObjMeta* meta);
+  void clearRefsTo(const vector<ObjMeta*>& sortedObjs);
+  void onRegionRef(PtrBase* p, ObjMeta* inc, ObjMeta* dec);
+#ifdef TGC_DEFERRED_RC
+  RcLog* threadRcLog();
+  void applyRc();
+  void freeRc(vector<ObjMeta*>& objs);
+  bool isCreating(ObjMeta* m);
+#endif
+
+ private:
+  // pointers not inside any object, the others are just counted.
+  vector<PtrBase*> roots;
+  size_t interiorPtrs = 0;
+  vector<ObjMeta*> grayObjs;
+  vector<ObjMeta*> sweepingObjs;
+  vector<WeakPtrBase*> weakPtrs;
+  vector<EphemeronTableBase*> ephemeronTables;
+  // stack is no feasible for multi-threaded version.
+  list<ObjMeta*> creatingObjs;
+  vector<ClassMeta::Batch*> batches;
+  size_t nextRootMarking = 0;
+  State state = State::RootMarking;
+#ifdef TGC_STOP_THE_WORLD
+  bool rootsDemoted = false;
+#endif
+  // reentrant as destructors invoked by sweeping may touch pointers again.
+  recursive_mutex mutex;
+  int freeObjCntOfPrevGc = 0;
+  bool collecting = false;
+  size_t heapLimit = 0, heapSoftTarget = 0;
+  // mangled name -> class.
+  unordered_map<string, ClassMeta*> imageClasses;
+  Stats stats;
+  HeapProfiler profiler;
+  vector<Region*> regions;
+  // guards Region::externalRefs, taken with the counting log of the thread.
+  details::mutex regionLock;
+  // objects of the escaped regions, swept after the heap pages.
+  vector<ObjMeta*> promotedObjs;
+  size_t promotedCursor = 0;
+#ifdef TGC_DEFERRED_RC
+  vector<RcLog*> rcLogs;
+  // operations left by the exited threads.
+  RcLog orphanRcLog;
+  vector<ObjMeta*> rcIncs, rcDecs, rcZeros;
+  bool rcEnabled = true;
+#endif
+  PauseHistogram pauseHists[(int)State::MaxCnt + 1];
+
+  struct TraceEvent {
+    int name;
+    int steps;
+    unsigned tid;
+    uint64_t beginNs, endNs;
+  };
+  vector<TraceEvent> traceEvents;
+  size_t nextTraceEvent = 0;
+  bool tracing = false;
+
+  static Collector* inst;
+};
+
+using GcStats = Collector::Stats;
+
+inline void gc_collect(int steps = 256) {
+  Collector::get()->collect(steps);
+}
+
+inline void gc_collect_full() {
+  Collector::get()->collectFull();
+}
+
+// Live bytes (including the garbage not swept yet) are checked on each
+// allocation: beyond the soft target the allocating thread runs a collecting
+// slice, beyond the hard limit a full collection is run and bad_alloc is
+// thrown if still not enough. 0 disables the limit.
+inline void gc_set_heap_limit(size_t hardLimit, size_t softTarget = 0) {
+  Collector::get()->setHeapLimit(hardLimit, softTarget);
+}
+
+// Policy of returning empty heap pages to the OS, by default they are
+// released after 2 idle cycles.
+inline void gc_set_trim_policy(size_t idleCycles,
+                               size_t retainedBytes = SIZE_MAX) {
+  Heap::setTrimPolicy(idleCycles, retainedBytes);
+}
+
+// Returns all the empty heap pages to the OS now, e.g. after a full
+// collection following a burst.
+inline size_t gc_trim() {
+  return Heap::trim();
+}
+
+inline void gc_dumpStats() {
+  Collector::get()->dumpStats();
+}
+
+inline GcStats gc_stats() {
+  return Collector::get()->getStats();
+}
+
+inline PauseHistogram gc_pause_histogram() {
+  return Collector::get()->getPauseHistogram(Collector::State::MaxCnt);
+}
+
+inline PauseHistogram gc_pause_histogram(Collector::State phase) {
+  return Collector::get()->getPauseHistogram(phase);
+}
+
+inline void gc_trace_start(size_t capacity = 1024 * 64) {
+  Collector::get()->startTrace(capacity);
+}
+
+inline void gc_trace_stop() {
+  Collector::get()->stopTrace();
+}
+
+inline bool gc_trace_dump(const char* path) {
+  return Collector::get()->dumpTrace(path);
+}
+
+using GcClassStats = HeapProfiler::ClassStats;
+
+inline void gc_heap_profiler_start(size_t sampleInterval = 1024) {
+  Collector::get()->startHeapProfiler(sampleInterval);
+}
+
+inline void gc_heap_profiler_stop() {
+  Collector::get()->stopHeapProfiler();
+}
+
+inline vector<GcClassStats> gc_class_stats() {
+  return Collector::get()->getClassStats();
+}
+
+inline void gc_heap_report() {
+  Collector::get()->heapReport();
+}
+
+// writes the sampled sites in the legacy text format accepted by pprof.
+inline bool gc_heap_profile_dump(const char* path) {
+  return Collector::get()->dumpHeapProfile(path);
+}
+
+// writes the object graph for the offline analyzer (see heapsnap.cpp).
+inline bool gc_heap_snapshot(const char* path) {
+  return Collector::get()->dumpHeapSnapshot(path);
+}
+
+// Specialize it (see TGC_DECL_RELOCATABLE) for classes whose data depends
+// on the address space only through gc pointers, i.e. no vtables, raw
+// pointers or std containers, so their objects can be saved in heap images.
+template <typename T>
+struct gc_relocatable : std::is_arithmetic<T> {};
+
+#define TGC_DECL_RELOCATABLE(T) \
+  template <>                   \
+  struct tgc::details::gc_relocatable<T> : std::true_type {};
+
+// Classes of the objects in images must be registered by both the saving
+// and the loading processes, which must be the same build.
+template <typename... T>
+void gc_image_register() {
+  static_assert((gc_relocatable<T>::value && ...), "not relocatable");
+  (Collector::get()->registerImageClass(ClassMeta::get<T>()), ...);
+}
+
+// Saves all the objects reachable from root into a relocatable image,
+// returns false if any of them is not of a registered class.
+template <typename T>
+bool gc_image_save(const gc<T>& root, const char* path) {
+  return Collector::get()->saveImage(root, path);
+}
+
+// Objects loaded are immortal and read-only: they are never swept and
+// writing them crashes. Returns null if the image is not loadable.
+template <typename T>
+gc<T> gc_image_load(const char* path) {
+  void* obj = nullptr;
+  gc<T> r;
+  if (auto* meta =
+          Collector::get()->loadImage(ClassMeta::get<T>(), path, &obj))
+    r.reset((T*)obj, meta);
+  return r;
+}
+
+template <typename T, typename... Args>
+ObjMeta* gc_new_site_meta(gc_site* site, size_t len, Args&&... args) {
+  static_assert(alignof(T) <= MaxObjAlign, "over-aligned for the gc heap");
+  auto* cls = ClassMeta::get<T>();
+  auto* meta = cls->newMeta(len, site);
+
+  size_t i = 0;
+  auto* p = (T*)meta->objPtr();
+  try {
+    for (; i < len; i++, p++)
+      new (p) T(forward<Args>(args)...);
+  } catch (...) {
+    for (auto j = i; j > 0; j--, p--) {
+      p->~T();
+    }
+    cls->endNewMeta(meta, true);
+    throw;
+  }
+
+  cls->endNewMeta(meta, false);
+  return meta;
+}
+
+template <typename T, typename... Args>
+ObjMeta* gc_new_meta(size_t len, Args&&... args) {
+  return gc_new_site_meta<T>(nullptr, len, forward<Args>(args)...);
+}
+
+// Runs the destructor at once. The memory is reclaimed at once too if no other
+// pointer refers to the object, which is known for the reference counted ones
+// (see TGC_DEFERRED_RC), otherwise the collector claims it later.
+template <typename T>
+void gc_delete(gc<T>& c) {
+  if (c)
+    Collector::get()->deleteObj(c);
+}
+
+// used as shared_from_this
+template <typename T>
+gc<T> gc_from(T* o) {
+  return gc<T>(o);
+}
+
+// used as std::shared_ptr
+template <typename To, typename From>
+gc<To> gc_static_pointer_cast(gc<From>& from) {
+  return from;
+}
+
+// used as std::shared_ptr
+template <typename To, typename From>
+gc<To> gc_dynamic_pointer_cast(gc<From>& from) {
+  gc<To> r;
+  r.reset(dynamic_cast<To*>(from.operator->()), from.getMeta());
+  return r;
+}
+
+template <typename T, typename... Args>
+gc<T> gc_new(Args&&... args) {
+  return gc_new_meta<T>(1, forward<Args>(args)...);
+}
+
+template <typename T, typename... Args>
+gc<T> gc_new(gc_site& site, Args&&... args) {
+  return gc_new_site_meta<T>(&site, 1, forward<Args>(args)...);
+}
+
+template <typename T, typename... Args>
+gc<T> gc_new_array(size_t len, Args&&... args) {
+  return gc_new_meta<T>(len, forward<Args>(args)...);
+}
+
+// Allocates cnt objects constructed from the same arguments at once, placed
+// contiguously when possible and collected independently. Cheaper than
+// calling gc_new in a loop for bulk loading.
+template <typename T, typename... Args>
+vector<gc<T>> gc_new_batch(size_t cnt, Args&&... args) {
+  static_assert(alignof(T) <= MaxObjAlign, "over-aligned for the gc heap");
+  auto* cls = ClassMeta::get<T>();
+  vector<gc<T>> r;
+  if (!cnt)
+    return r;
+  r.reserve(cnt);
+  ClassMeta::Batch b;
+  cls->newMetas(cnt, b);
+
+  for (size_t i = 0; i < cnt; i++, b.next++) {
+    try {
+      new (b.metas[i]->objPtr()) T(args...);
+    } catch (...) {
+      cls->endNewMetas(b, true);
+      // the constructed ones are left to the collector.
+      for (size_t j = 0; j < i; j++)
+        r.emplace_back(b.metas[j]);
+      throw;
+    }
+  }
+  cls->endNewMetas(b, false);
+  for (auto* meta : b.metas)
+    r.emplace_back(meta);
+  return r;
+}
+
+// Objects allocated by the thread in the scope are bump allocated from a
+// private arena. At the scope exit they are destroyed and the arena released
+// at once if no pointer outside the arena refers to them, otherwise they are
+// promoted and collected as usual.
+class gc_region {
+ public:
+  gc_region() { Collector::get()->enterRegion(region); }
+  ~gc_region() { Collector::get()->exitRegion(region); }
+  gc_region(const gc_region&) = delete;
+  gc_region& operator=(const gc_region&) = delete;
+
+ private:
+  Collector::Region region;
+};
+
+// Memory resource allocating the buffers of pointer-free containers (e.g.
+// std::pmr::string, std::pmr::vector<int>) from the gc heap. Declared as a
+// member before the containers of an object, the buffers are accounted to it
+// in the heap profiler, and to the heap limits anyway.
+class gc_memory_resource : public std::pmr::memory_resource {
+ public:
+  gc_memory_resource();
+  gc_memory_resource(const gc_memory_resource&) = delete;
+  gc_memory_resource& operator=(const gc_memory_resource&) = delete;
+  ~gc_memory_resource();
+
+  // bytes of the buffers not freed yet.
+  size_t size() const { return bytes; }
+
+ private:
+  void* do_allocate(size_t size, size_t align) override;
+  void do_deallocate(void* p, size_t size, size_t align) override;
+  bool do_is_equal(const memory_resource& r) const noexcept override {
+    return this == &r;
+  }
+
+  // the object holding the resource, null if not in the gc heap.
+  ObjMeta* owner = nullptr;
+  size_t bytes = 0;
+};
+
+// Drives the collecting from an event loop, call onIdle with the time left
+// before the next event (or runUntil with a deadline) so the work lands in
+// the idle gaps. Slices are sized from the recent cost of a step, a new cycle
+// is started once the allocations since the last one exceed growth times the
+// bytes it left alive, or half the way to the soft target of the heap.
+class gc_scheduler {
+ public:
+  using clock = std::chrono::steady_clock;
+
+  explicit gc_scheduler(double growth = 0.25, int minSteps = 64)
+      : growth(growth), minSteps(minSteps) {}
+
+  // returns true if there is work left.
+  bool onIdle(clock::duration budget) {
+    return runUntil(clock::now() + budget);
+  }
+  bool runUntil(clock::time_point deadline);
+  bool hasWork() const;
+  // the heap doubled or passed the soft target before the cycle in progress
+  // could end, i.e. the idle gaps are too short for the allocation rate.
+  bool fallingBehind() const;
+  // steps of the slices run so far, and their average cost.
+  size_t steps() const { return totalSteps; }
+  double nsPerStep() const { return stepNs; }
+
+ private:
+  double growth;
+  int minSteps;
+  size_t totalSteps = 0;
+  // moving average, 0 before the first slice.
+  double stepNs = 0;
+};
+
+//////////////////////////////////////////////////////////////////////////
+/// Function
+
+template <typename T>
+class gc_function;
+
+template <typename R, typename... A>
+class gc_function<R(A...)> {
+ public:
+  gc_function() {}
+
+  template <typename F>
+  gc_function(F&& f) : callable(gc_new_meta<Imp<F>>(1, forward<F>(f))) {}
+
+  template <typename F>
+  gc_function& operator=(F&& f) {
+    callable = gc_new_meta<Imp<F>>(1, forward<F>(f));
+    return *this;
+  }
+
+  template <typename... U>
+  R operator()(U&&... a) const {
+    return callable->call(forward<U>(a)...);
+  }
+
+  explicit operator bool() const { return (bool)callable; }
+  bool operator==(const gc_function& r) const { return callable == r.callable; }
+  bool operator!=(const gc_function& r) const { return callable != r.callable; }
+
+ private:
+  struct Callable {
+    virtual ~Callable() {}
+    virtual R call(A... a) = 0;
+  };
+
+  template <typename F>
+  struct Imp : Callable {
+    F f;
+    Imp(F&& ff) : f(ff) {}
+    R call(A... a) override { return f(a...); }
+  };
+
+ private:
+  gc<Callable> callable;
+};
+
+//////////////////////////////////////////////////////////////////////////
+/// Weak Reference
+/// not traced by the collector, cleared at the end of marking if the target
+/// is unreachable, i.e. before it is swept.
+
+class WeakPtrBase {
+  friend class Collector;
+
+ public:
+  bool expired() const;
+
+ protected:
+  WeakPtrBase(ObjMeta* m = nullptr, void* o = nullptr);
+  WeakPtrBase(const WeakPtrBase& r);
+  ~WeakPtrBase();
+  WeakPtrBase& operator=(const WeakPtrBase& r);
+  void reset(ObjMeta* m, void* o);
+  // points r to the target if still alive.
+  void pin(PtrBase& r) const;
+
+ protected:
+  ObjMeta* meta = nullptr;
+  void* obj = nullptr;
+  size_t index = 0;
+};
+
+template <typename T>
+class gc_weak : public WeakPtrBase {
+ public:
+  gc_weak() {}
+  gc_weak(nullptr_t) {}
+  template <typename U>
+  gc_weak(const GcPtr<U>& r)
+      : WeakPtrBase(r.getMeta(), static_cast<T*>(r.get())) {}
+
+  template <typename U>
+  gc_weak& operator=(const GcPtr<U>& r) {
+    reset(r.getMeta(), static_cast<T*>(r.get()));
+    return *this;
+  }
+  gc_weak& operator=(nullptr_t) {
+    reset(nullptr, nullptr);
+    return *this;
+  }
+
+  gc<T> lock() const {
+    gc<T> r;
+    pin(r);
+    return r;
+  }
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Wrap STL Containers
+//////////////////////////////////////////////////////////////////////////
+
+template <typename C>
+struct ContainerPtrEnumerator : IPtrEnumerator {
+  C* o;
+  typename C::iterator it;
+  ContainerPtrEnumerator(ObjMeta* m) : o((C*)m->objPtr()), it(o->begin()) {}
+  bool hasNext() { return it != o->end(); }
+};
+
+//////////////////////////////////////////////////////////////////////////
+/// Vector
+/// vector elements are not stored contiguously due to implementation
+/// limitation. use gc_new_array for better performance.
+
+template <typename T>
+class gc_vector : public gc<vector<gc<T>>> {
+ public:
+  using gc<vector<gc<T>>>::gc;
+  gc<T>& operator[](int idx) { return (**this)[idx]; }
+};
+
+template <typename T>
+struct PtrEnumerator<vector<gc<T>>> : ContainerPtrEnumerator<vector<gc<T>>> {
+  using ContainerPtrEnumerator<vector<gc<T>>>::ContainerPtrEnumerator;
+
+  const PtrBase* getNext() override {
+    if (!this->hasNext())
+      return nullptr;
+    return &*this->it++;
+  }
+};
+
+template <typename T, typename... Args>
+gc_vector<T> gc_new_vector(Args&&... args) {
+  return gc_new_meta<vector<gc<T>>>(1, forward<Args>(args)...);
+}
+
+template <typename T>
+void gc_delete(gc_vector<T>& p) {
+  auto* c = Collector::get();
+  for (auto& i : *p)
+    c->deleteObj(i, false);
+  p->clear();
+  c->reclaimDeleted();
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Deque
+
+template <typename T>
+class gc_deque : public gc<deque<gc<T>>> {
+ public:
+  using gc<deque<gc<T>>>::gc;
+  gc<T>& operator[](int idx) { return (**this)[idx]; }
+};
+
+template <typename T>
+struct PtrEnumerator<deque<gc<T>>> : ContainerPtrEnumerator<deque<gc<T>>> {
+  using ContainerPtrEnumerator<deque<gc<T>>>::ContainerPtrEnumerator;
+
+  const PtrBase* getNext() override {
+    if (!this->hasNext())
+      return nullptr;
+    return &*this->it++;
+  }
+};
+
+template <typename T, typename... Args>
+gc_deque<T> gc_new_deque(Args&&... args) {
+  return gc_new_meta<deque<gc<T>>>(1, forward<Args>(args)...);
+}
+
+template <typename T>
+void gc_delete(gc_deque<T>& p) {
+  auto* c = Collector::get();
+  for (auto& i : *p)
+    c->deleteObj(i, false);
+  p->clear();
+  c->reclaimDeleted();
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// List
+
+template <typename T>
+using gc_list = gc<list<gc<T>>>;
+
+template <typename T>
+struct PtrEnumerator<list<gc<T>>> : ContainerPtrEnumerator<list<gc<T>>> {
+  using ContainerPtrEnumerator<list<gc<T>>>::ContainerPtrEnumerator;
+
+  const PtrBase* getNext() override {
+    if (!this->hasNext())
+      return nullptr;
+    return &*this->it++;
+  }
+};
+
+template <typename T, typename... Args>
+gc_list<T> gc_new_list(Args&&... args) {
+  return gc_new_meta<list<gc<T>>>(1, forward<Args>(args)...);
+}
+
+template <typename T>
+void gc_delete(gc_list<T>& p) {
+  auto* c = Collector::get();
+  for (auto& i : *p)
+    c->deleteObj(i, false);
+  p->clear();
+  c->reclaimDeleted();
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Map
+/// TODO: NOT support using gc object as key...
+
+template <typename K, typename V>
+class gc_map : public gc<map<K, gc<V>>> {
+ public:
+  using gc<map<K, gc<V>>>::gc;
+  gc<V>& operator[](const K& k) { return (**this)[k]; }
+};
+
+template <typename K, typename V>
+struct PtrEnumerator<map<K, gc<V>>> : ContainerPtrEnumerator<map<K, gc<V>>> {
+  using ContainerPtrEnumerator<map<K, gc<V>>>::ContainerPtrEnumerator;
+
+  const PtrBase* getNext() override {
+    if (!this->hasNext())
+      return nullptr;
+    auto* ret = &this->it->second;
+    ++this->it;
+    return ret;
+  }
+};
+
+template <typename K, typename V, typename... Args>
+gc_map<K, V> gc_new_map(Args&&... args) {
+  return gc_new_meta<map<K, gc<V>>>(1, forward<Args>(args)...);
+}
+
+template <typename K, typename V>
+void gc_delete(gc_map<K, V>& p) {
+  auto* c = Collector::get();
+  for (auto& i : *p)
+    c->deleteObj(i.second, false);
+  p->clear();
+  c->reclaimDeleted();
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// HashMap
+/// TODO: NOT support using gc object as key...
+
+template <typename K, typename V>
+class gc_unordered_map : public gc<unordered_map<K, gc<V>>> {
+ public:
+  using gc<unordered_map<K, gc<V>>>::gc;
+  gc<V>& operator[](const K& k) { return (**this)[k]; }
+};
+
+template <typename K, typename V>
+struct PtrEnumerator<unordered_map<K, gc<V>>>
+    : ContainerPtrEnumerator<unordered_map<K, gc<V>>> {
+  using ContainerPtrEnumerator<unordered_map<K, gc<V>>>::ContainerPtrEnumerator;
+
+  const PtrBase* getNext() override {
+    if (!this->hasNext())
+      return nullptr;
+    auto* ret = &this->it->second;
+    ++this->it;
+    return ret;
+  }
+};
+
+template <typename K, typename V, typename... Args>
+gc_unordered_map<K, V> gc_new_unordered_map(Args&&... args) {
+  return gc_new_meta<unordered_map<K, gc<V>>>(1, forward<Args>(args)...);
+}
+template <typename K, typename V>
+void gc_delete(gc_unordered_map<K, V>& p) {
+  auto* c = Collector::get();
+  for (auto& i : *p)
+    c->deleteObj(i.second, false);
+  p->clear();
+  c->reclaimDeleted();
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Set
+
+template <typename V>
+using gc_set = gc<set<gc<V>>>;
+
+template <typename V>
+struct PtrEnumerator<set<gc<V>>> : ContainerPtrEnumerator<set<gc<V>>> {
+  using ContainerPtrEnumerator<set<gc<V>>>::ContainerPtrEnumerator;
+
+  const PtrBase* getNext() override {
+    if (!this->hasNext())
+      return nullptr;
+    return &*this->it++;
+  }
+};
+
+template <typename V, typename... Args>
+gc_set<V> gc_new_set(Args&&... args) {
+  return gc_new_meta<set<gc<V>>>(1, forward<Args>(args)...);
+}
+
+template <typename T>
+void gc_delete(gc_set<T>& p) {
+  // elements are const, the copies are cleared instead.
+  auto* c = Collector::get();
+  for (auto i : *p)
+    c->deleteObj(i, false);
+  p->clear();
+  c->reclaimDeleted();
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// Persistent collections
+/// immutable values, every update returns a new version sharing the
+/// unchanged nodes with the old one. Nodes are gc objects, the ones no
+/// version refers to any more are freed by the collector.
+
+template <typename T>
+struct PVectorNode {
+  PVectorNode(vector<gc<PVectorNode>> c, vector<gc<T>> e)
+      : children(move(c)), elems(move(e)) {}
+  // children of the inner nodes, elements of the leaves.
+  vector<gc<PVectorNode>> children;
+  vector<gc<T>> elems;
+};
+
+template <typename T>
+struct PtrEnumerator<PVectorNode<T>> : IPtrEnumerator {
+  PVectorNode<T>* o;
+  size_t i = 0;
+  PtrEnumerator(ObjMeta* m) : o((PVectorNode<T>*)m->objPtr()) {}
+
+  const PtrBase* getNext() override {
+    if (i < o->children.size())
+      return &o->children[i++];
+    auto j = i++ - o->children.size();
+    return j < o->elems.size() ? &o->elems[j] : nullptr;
+  }
+};
+
+// Bit-partitioned vector trie of 32-way nodes with the last leaf kept aside
+// (the radix balanced part of RRB trees, no relaxed nodes for concatenating),
+// indexing and updates are O(log32 n), appending is amortized O(1).
+template <typename T>
+class gc_pvector {
+ public:
+  using Node = PVectorNode<T>;
+  static constexpr int Bits = 5;
+  static constexpr size_t Width = 1 << Bits, Mask = Width - 1;
+
+  size_t size() const { return cnt; }
+  bool empty() const { return !cnt; }
+  const gc<T>& operator[](size_t i) const {
+    return leafOf(i)->elems[i & Mask];
+  }
+  const gc<T>& back() const { return tail->elems.back(); }
+
+  gc_pvector push_back(const gc<T>& v) const {
+    auto r = *this;
+    r.cnt++;
+    if (cnt - tailOffset() < Width) {
+      auto elems = tail ? tail->elems : vector<gc<T>>();
+      elems.push_back(v);
+      r.tail = newNode(vector<gc<Node>>(), move(elems));
+      return r;
+    }
+    // the full tail goes into the trie, which grows a level when full.
+    if ((cnt >> Bits) > ((size_t)1 << shift)) {
+      r.root = newNode(vector<gc<Node>>{root, newPath(shift, tail)},
+                            vector<gc<T>>());
+      r.shift += Bits;
+    } else {
+      r.root = pushTail(shift, root, tail);
+    }
+    r.tail = newNode(vector<gc<Node>>(), vector<gc<T>>{v});
+    return r;
+  }
+
+  gc_pvector set(size_t i, const gc<T>& v) const {
+    assert(i < cnt);
+    auto r = *this;
+    if (i >= tailOffset()) {
+      auto elems = tail->elems;
+      elems[i & Mask] = v;
+      r.tail = newNode(vector<gc<Node>>(), move(elems));
+    } else {
+      r.root = assoc(shift, root, i, v);
+    }
+    return r;
+  }
+
+  gc_pvector pop_back() const {
+    assert(cnt);
+    if (cnt == 1)
+      return gc_pvector();
+    auto r = *this;
+    r.cnt--;
+    if (cnt - tailOffset() > 1) {
+      auto elems = tail->elems;
+      elems.pop_back();
+      r.tail = newNode(vector<gc<Node>>(), move(elems));
+      return r;
+    }
+    // the last leaf of the trie becomes the tail.
+    r.tail = leafOf(cnt - 2);
+    r.root = popTail(shift, root);
+    if (r.shift > Bits && r.root->children.size() == 1) {
+      r.root = r.root->children[0];
+      r.shift -= Bits;
+    }
+    return r;
+  }
+
+ private:
+  template <typename... Args>
+  static gc<Node> newNode(Args&&... args) {
+    auto n = gc_new<Node>(forward<Args>(args)...);
+    Collector::get()->adoptPtrs(n);
+    return n;
+  }
+
+  size_t tailOffset() const { return cnt < Width ? 0 : (cnt - 1) & ~Mask; }
+
+  const gc<Node>& leafOf(size_t i) const {
+    if (i >= tailOffset())
+      return tail;
+    auto* n = &root;
+    for (auto level = shift; level > 0; level -= Bits)
+      n = &(*n)->children[(i >> level) & Mask];
+    return *n;
+  }
+
+  static gc<Node> newPath(int level, const gc<Node>& leaf) {
+    if (!level)
+      return leaf;
+    return newNode(vector<gc<Node>>{newPath(level - Bits, leaf)},
+                        vector<gc<T>>());
+  }
+
+  gc<Node> pushTail(int level, const gc<Node>& parent,
+                    const gc<Node>& leaf) const {
+    auto idx = ((cnt - 1) >> level) & Mask;
+    auto children = parent ? parent->children : vector<gc<Node>>();
+    gc<Node> child;
+    if (level == Bits)
+      child = leaf;
+    else if (idx < children.size())
+      child = pushTail(level - Bits, children[idx], leaf);
+    else
+      child = newPath(level - Bits, leaf);
+    if (idx < children.size())
+      children[idx] = child;
+    else
+      children.push_back(child);
+    return newNode(move(children), vector<gc<T>>());
+  }
+
+  static gc<Node> assoc(int level, const gc<Node>& n, size_t i,
+                        const gc<T>& v) {
+    if (!level) {
+      auto elems = n->elems;
+      elems[i & Mask] = v;
+      return newNode(vector<gc<Node>>(), move(elems));
+    }
+    auto children = n->children;
+    auto idx = (i >> level) & Mask;
+    children[idx] = assoc(level - Bits, children[idx], i, v);
+    return newNode(move(children), vector<gc<T>>());
+  }
+
+  // returns null if the node becomes empty.
+  gc<Node> popTail(int level, const gc<Node>& n) const {
+    auto idx = ((cnt - 2) >> level) & Mask;
+    auto children = n->children;
+    if (level > Bits) {
+      auto child = popTail(level - Bits, children[idx]);
+      if (!child && !idx)
+        return nullptr;
+      if (child)
+        children[idx] = child;
+      else
+        children.pop_back();
+    } else {
+      if (!idx)
+        return nullptr;
+      children.pop_back();
+    }
+    return newNode(move(children), vector<gc<T>>());
+  }
+
+  size_t cnt = 0;
+  int shift = Bits;
+  // null until the first leaf is pushed into it.
+  gc<Node> root;
+  // the last 1 to 32 elements.
+  gc<Node> tail;
+};
+
+template <typename K, typename V>
+struct PMapNode {
+  using Entry = pair<K, gc<V>>;
+  PMapNode(uint32_t dm, uint32_t nm, vector<Entry> e, vector<gc<PMapNode>> c)
+      : dataMap(dm), nodeMap(nm), entries(move(e)), children(move(c)) {}
+  // slots of the entries & children, the bits are taken from the key hashes.
+  // Nodes below the hash bits only hold the colliding entries.
+  uint32_t dataMap, nodeMap;
+  vector<Entry> entries;
+  vector<gc<PMapNode>> children;
+};
+
+template <typename K, typename V>
+struct PtrEnumerator<PMapNode<K, V>> : IPtrEnumerator {
+  PMapNode<K, V>* o;
+  size_t i = 0;
+  PtrEnumerator(ObjMeta* m) : o((PMapNode<K, V>*)m->objPtr()) {}
+
+  const PtrBase* getNext() override {
+    if (i < o->entries.size())
+      return &o->entries[i++].second;
+    auto j = i++ - o->entries.size();
+    return j < o->children.size() ? &o->children[j] : nullptr;
+  }
+};
+
+// Hash array mapped trie in the compressed layout of CHAMP: 32-way nodes
+// keep the entries and the children in two packed arrays indexed by bitmaps,
+// lookups and updates are O(log32 n). Removing compacts the paths so equal
+// maps have the same shape.
+template <typename K, typename V, typename Hash = hash<K>>
+class gc_pmap {
+ public:
+  using Node = PMapNode<K, V>;
+  using Entry = typename Node::Entry;
+  static constexpr int Bits = 5;
+  static constexpr int HashBits = sizeof(size_t) * 8;
+
+  size_t size() const { return cnt; }
+  bool empty() const { return !cnt; }
+
+  // null if not found.
+  gc<V> get(const K& k) const {
+    auto h = Hash()(k);
+    auto* n = root.get();
+    for (int shift = 0; n; shift += Bits) {
+      if (shift >= HashBits) {
+        for (auto& e : n->entries)
+          if (e.first == k)
+            return e.second;
+        break;
+      }
+      auto bit = bitOf(h, shift);
+      if (n->dataMap & bit) {
+        auto& e = n->entries[indexOf(n->dataMap, bit)];
+        if (e.first == k)
+          return e.second;
+        break;
+      }
+      if (!(n->nodeMap & bit))
+        break;
+      n = n->children[indexOf(n->nodeMap, bit)].get();
+    }
+    return nullptr;
+  }
+  bool contains(const K& k) const { return get(k).get() != nullptr; }
+
+  gc_pmap set(const K& k, const gc<V>& v) const {
+    auto r = *this;
+    auto added = false;
+    r.root = root ? setIn(root, k, v, Hash()(k), 0, added)
+                  : newNode(bitOf(Hash()(k), 0), 0,
+                                 vector<Entry>{{k, v}}, vector<gc<Node>>());
+    r.cnt += root ? added : 1;
+    return r;
+  }
+
+  gc_pmap erase(const K& k) const {
+    if (!root)
+      return *this;
+    auto removed = false;
+    auto n = eraseIn(root, k, Hash()(k), 0, removed);
+    if (!removed)
+      return *this;
+    auto r = *this;
+    r.cnt--;
+    r.root = r.cnt ? n : nullptr;
+    return r;
+  }
+
+  template <typename F>
+  void for_each(F f) const {
+    if (root)
+      forEach(*root, f);
+  }
+
+ private:
+  template <typename... Args>
+  static gc<Node> newNode(Args&&... args) {
+    auto n = gc_new<Node>(forward<Args>(args)...);
+    Collector::get()->adoptPtrs(n);
+    return n;
+  }
+
+  static uint32_t bitOf(size_t h, int shift) {
+    return (uint32_t)1 << ((h >> shift) & 31);
+  }
+  static size_t indexOf(uint32_t map, uint32_t bit) {
+    return bitset<32>(map & (bit - 1)).count();
+  }
+
+  static gc<Node> merge(const Entry& a, size_t ha, const Entry& b, size_t hb,
+                        int shift) {
+    if (shift >= HashBits)
+      return newNode(0, 0, vector<Entry>{a, b}, vector<gc<Node>>());
+    auto ba = bitOf(ha, shift), bb = bitOf(hb, shift);
+    if (ba == bb) {
+      return newNode(
+          0, ba, vector<Entry>(),
+          vector<gc<Node>>{merge(a, ha, b, hb, shift + Bits)});
+    }
+    auto entries = ba < bb ? vector<Entry>{a, b} : vector<Entry>{b, a};
+    return newNode(ba | bb, 0, move(entries), vector<gc<Node>>());
+  }
+
+  static gc<Node> setIn(const gc<Node>& n, const K& k, const gc<V>& v,
+                        size_t h, int shift, bool& added) {
+    auto entries = n->entries;
+    auto children = n->children;
+    auto dataMap = n->dataMap, nodeMap = n->nodeMap;
+    if (shift >= HashBits) {
+      auto i = find_if(entries.begin(), entries.end(),
+                       [&](const Entry& e) { return e.first == k; });
+      if (i != entries.end()) {
+        i->second = v;
+      } else {
+        entries.push_back({k, v});
+        added = true;
+      }
+    } else if (auto bit = bitOf(h, shift); dataMap & bit) {
+      auto idx = indexOf(dataMap, bit);
+      if (entries[idx].first == k) {
+        entries[idx].second = v;
+      } else {
+        // both go down into a new child.
+        auto& old = entries[idx];
+        auto child = merge(old, Hash()(old.first), {k, v}, h, shift + Bits);
+        entries.erase(entries.begin() + idx);
+        dataMap ^= bit;
+        children.insert(children.begin() + indexOf(nodeMap, bit), child);
+        nodeMap |= bit;
+        added = true;
+      }
+    } else if (nodeMap & bit) {
+      auto idx = indexOf(nodeMap, bit);
+      children[idx] = setIn(children[idx], k, v, h, shift + Bits, added);
+    } else {
+      entries.insert(entries.begin() + indexOf(dataMap, bit), {k, v});
+      dataMap |= bit;
+      added = true;
+    }
+    return newNode(dataMap, nodeMap, move(entries), move(children));
+  }
+
+  static gc<Node> eraseIn(const gc<Node>& n, const K& k, size_t h,
+                          int shift, bool& removed) {
+    if (shift >= HashBits) {
+      auto entries = n->entries;
+      auto i = find_if(entries.begin(), entries.end(),
+                       [&](const Entry& e) { return e.first == k; });
+      if (i == entries.end())
+        return n;
+      entries.erase(i);
+      removed = true;
+      return newNode(0, 0, move(entries), vector<gc<Node>>());
+    }
+
+    auto bit = bitOf(h, shift);
+    if (n->dataMap & bit) {
+      auto idx = indexOf(n->dataMap, bit);
+      if (!(n->entries[idx].first == k))
+        return n;
+      auto entries = n->entries;
+      entries.erase(entries.begin() + idx);
+      removed = true;
+      return newNode(n->dataMap ^ bit, n->nodeMap, move(entries),
+                          n->children);
+    }
+    if (!(n->nodeMap & bit))
+      return n;
+
+    auto idx = indexOf(n->nodeMap, bit);
+    auto child = eraseIn(n->children[idx], k, h, shift + Bits, removed);
+    if (!removed)
+      return n;
+    auto entries = n->entries;
+    auto children = n->children;
+    auto dataMap = n->dataMap, nodeMap = n->nodeMap;
+    if (child->children.empty() && child->entries.size() == 1) {
+      // a single entry left, inlined into this node.
+      children.erase(children.begin() + idx);
+      nodeMap ^= bit;
+      entries.insert(entries.begin() + indexOf(dataMap, bit),
+                     child->entries[0]);
+      dataMap |= bit;
+    } else {
+      children[idx] = child;
+    }
+    return newNode(dataMap, nodeMap, move(entries), move(children));
+  }
+
+  template <typename F>
+  static void forEach(const Node& n, F& f) {
+    for (auto& e : n.entries)
+      f(e.first, e.second);
+    for (auto& c : n.children)
+      forEach(*c, f);
+  }
+
+  size_t cnt = 0;
+  gc<Node> root;
+};
+
+//////////////////////////////////////////////////////////////////////////
+/// String
+/// immutable, the characters are stored inline in the same allocation and
+/// the hash is computed once. Interned ones (see gc_intern) are unique per
+/// content, so comparing two of them is comparing pointers.
+
+// Header of the string objects, allocated as arrays of it with the
+// characters (zero terminated) in the elements after the first one.
+struct StrData {
+  size_t hash;
+  uint32_t len;
+  uint32_t interned;
+
+  char* chars() { return (char*)(this + 1); }
+};
+
+template <>
+struct gc_acyclic<StrData> : true_type {};
+
+// Not reference counted: the weak refs of the intern table would be
+// scanned on every flush of the counts.
+struct InternedStrData : StrData {};
+
+class gc_str {
+ public:
+  gc_str() {}
+  gc_str(string_view s) : data(alloc<StrData>(s, hashOf(s))) {}
+
+  static gc_str intern(string_view s);
+
+  size_t size() const { return data ? data->len : 0; }
+  size_t length() const { return size(); }
+  bool empty() const { return !size(); }
+  const char* c_str() const { return data ? data->chars() : ""; }
+  size_t hash() const { return data ? data->hash : hashOf({}); }
+  bool interned() const { return data && data->interned; }
+  string_view view() const { return {c_str(), size()}; }
+  operator string_view() const { return view(); }
+  string str() const { return string(view()); }
+
+  bool operator==(const gc_str& r) const {
+    auto *a = data.get(), *b = r.data.get();
+    if (a == b)
+      return true;
+    if (a && b && (a->interned & b->interned || a->hash != b->hash))
+      return false;
+    return view() == r.view();
+  }
+  bool operator!=(const gc_str& r) const { return !(*this == r); }
+  bool operator<(const gc_str& r) const { return view() < r.view(); }
+
+ private:
+  gc_str(const gc<StrData>& d) : data(d) {}
+
+  static size_t hashOf(string_view s) { return std::hash<string_view>()(s); }
+
+  template <typename D>
+  static gc<StrData> alloc(string_view s, size_t h) {
+    assert(s.size() < UINT32_MAX);
+    gc<StrData> d = gc_new_meta<D>(1 + (s.size() + sizeof(D)) / sizeof(D));
+    d->hash = h;
+    d->len = (uint32_t)s.size();
+    d->interned = is_same<D, InternedStrData>::value;
+    memcpy(d->chars(), s.data(), s.size());
+    return d;
+  }
+
+  gc<StrData> data;
+};
+
+// Returns the string equal to s if it's still alive, otherwise a new one.
+// The table holds them weakly, they are collected as usual.
+inline gc_str gc_intern(string_view s) {
+  return gc_str::intern(s);
+}
+
+//////////////////////////////////////////////////////////////////////////
+/// WeakMap
+/// ephemeron table: a value is kept alive only while both its key and the
+/// table are reachable, entries are removed once the key is unreachable.
+/// keys are compared by identity.
+
+class EphemeronTableBase {
+  friend class Collector;
+
+ public:
+  size_t size() const;
+  void clear();
+
+ protected:
+  EphemeronTableBase();
+  EphemeronTableBase(const EphemeronTableBase&) = delete;
+  ~EphemeronTableBase();
+  void set(ObjMeta* key, ObjMeta* valueMeta, void* value);
+  void get(ObjMeta* key, PtrBase& r) const;
+  bool erase(ObjMeta* key);
+
+  struct Entry {
+    ObjMeta* meta;
+    void* value;
+  };
+
+  // the object holding the table, null if not in the gc heap.
+  ObjMeta* owner = nullptr;
+  unordered_map<ObjMeta*, Entry> entries;
+  size_t index = 0;
+};
+
+template <typename K, typename V>
+class EphemeronTable : public EphemeronTableBase {
+ public:
+  void set(const gc<K>& k, const gc<V>& v) {
+    EphemeronTableBase::set(k.getMeta(), v.getMeta(), v.get());
+  }
+  gc<V> get(const gc<K>& k) const {
+    gc<V> r;
+    EphemeronTableBase::get(k.getMeta(), r);
+    return r;
+  }
+  bool contains(const gc<K>& k) const { return (bool)get(k); }
+  bool erase(const gc<K>& k) { return EphemeronTableBase::erase(k.getMeta()); }
+};
+
+template <typename K, typename V>
+class gc_weak_map : public gc<EphemeronTable<K, V>> {
+ public:
+  using gc<EphemeronTable<K, V>>::gc;
+};
+
+template <typename K, typename V>
+gc_weak_map<K, V> gc_new_weak_map() {
+  return gc_new_meta<EphemeronTable<K, V>>(1);
+}
+
+}  // namespace details
+
+//////////////////////////////////////////////////////////////////////////
+// Public APIs
+
+using details::gc;
+using details::gc_collect;
+using details::gc_collect_full;
+using details::gc_set_heap_limit;
+using details::gc_set_trim_policy;
+using details::gc_trim;
+using details::gc_dumpStats;
+using details::gc_stats;
+using details::GcStats;
+using details::gc_pause_histogram;
+using details::gc_trace_dump;
+using details::gc_trace_start;
+using details::gc_trace_stop;
+using details::PauseHistogram;
+using details::gc_class_stats;
+using details::gc_heap_profile_dump;
+using details::gc_heap_profiler_start;
+using details::gc_heap_profiler_stop;
+using details::gc_heap_report;
+using details::gc_heap_snapshot;
+using details::gc_heap_exhausted;
+using details::gc_image_load;
+using details::gc_image_register;
+using details::gc_image_save;
+using details::gc_memory_resource;
+using details::GcClassStats;
+using details::gc_dynamic_pointer_cast;
+using details::gc_from;
+using details::gc_function;
+using details::gc_new;
+using details::gc_new_array;
+using details::gc_new_batch;
+using details::gc_region;
+using details::gc_site;
+using details::gc_scheduler;
+using details::gc_static_pointer_cast;
+
+using details::gc_new_vector;
+using details::gc_vector;
+
+using details::gc_deque;
+using details::gc_new_deque;
+
+using details::gc_list;
+using details::gc_new_list;
+
+using details::gc_map;
+using details::gc_new_map;
+
+using details::gc_new_set;
+using details::gc_set;
+
+using details::gc_new_unordered_map;
+using details::gc_unordered_map;
+
+using details::gc_weak;
+
+using details::gc_new_weak_map;
+using details::gc_weak_map;
+
+using details::gc_pmap;
+using details::gc_pvector;
+
+using details::gc_intern;
+using details::gc_str;
+
+TGC_DECL_AUTO_BOX(char, gc_char);
+TGC_DECL_AUTO_BOX(unsigned char, gc_uchar);
+TGC_DECL_AUTO_BOX(short, gc_short);
+TGC_DECL_AUTO_BOX(unsigned short, gc_ushort);
+TGC_DECL_AUTO_BOX(int, gc_int);
+TGC_DECL_AUTO_BOX(unsigned int, gc_uint);
+TGC_DECL_AUTO_BOX(float, gc_float);
+TGC_DECL_AUTO_BOX(double, gc_double);
+TGC_DECL_AUTO_BOX(long, gc_long);
+TGC_DECL_AUTO_BOX(unsigned long, gc_ulong);
+TGC_DECL_AUTO_BOX(std::string, gc_string);
+
+}  // namespace tgc
+
+namespace std {
+template <>
+struct hash<tgc::gc_str> {
+  size_t operator()(const tgc::gc_str& s) const { return s.hash(); }
+};
+}  // namespace std